@@ -0,0 +1,558 @@
+// Benchmark suite for the matrix "library" kernels
+
+#include "matrix.h"     // matrix "library"
+using namespace matrix; // use shortened names
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef _MSC_VER
+ #include <intrin.h> // _ReadWriteBarrier
+#endif
+
+namespace {
+
+// The largest matrix (in bytes) benchmarked with STACK storage. Several
+// operands and results live on the stack at the same time, so it is kept well
+// below the default thread stack size (1 MB on Windows).
+constexpr size_t kStackBytesMax = 64 * 1024;
+
+// The shortest time of one sample. Fast kernels are called several times per
+// sample to keep the timer resolution negligible.
+constexpr double kSampleNsMin = 100000.0;
+
+// Command line options
+struct Options {
+    size_t min_size = 4;
+    size_t max_size = 4096;
+    size_t warmup = 1;         // calls before measurement
+    size_t reps = 15;          // samples per benchmark
+    double budget_ms = 500;    // stop sampling after this time (at least one sample is taken)
+    std::string kernel;        // run kernels containing this substring only
+    std::string types = "float,double,int";
+    std::string storages = "unspecified,stack,heap,user,shared";
+    std::string json;          // file for machine-readable results
+    bool roofline = false;     // probe the host and report achieved versus attainable performance
+};
+
+// One benchmark result
+struct Result {
+    std::string kernel;
+    std::string type;
+    std::string storage;
+    size_t m, n, p;
+    size_t samples;
+    size_t calls;      // calls per sample
+    double median_ns;  // per call
+    double p99_ns;
+    double min_ns;
+    double flops;      // per call
+    double bytes;      // per call (compulsory memory traffic)
+};
+
+std::vector<Result> results;
+
+// Peak performance of the host measured by "probe_*()"
+struct Peak {
+    double gbytes_per_s = 0;              // memory bandwidth
+    std::map<std::string, double> gflops; // multiply-add throughput for every element type
+};
+
+Peak peak;
+
+// Prevents the compiler from optimizing away the benchmarked computation
+inline void escape(const void *p) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    static const void * volatile sink;
+    sink = p;
+    _ReadWriteBarrier();
+#else
+    asm volatile("" : : "g"(p) : "memory");
+#endif
+}
+
+template<typename T> const char* type_name();
+template<> const char* type_name<float>() { return "float"; }
+template<> const char* type_name<double>() { return "double"; }
+template<> const char* type_name<int>() { return "int"; }
+
+const char* storage_name(const MatrixDataStorage s) {
+    switch (s) {
+      case MatrixDataStorage::UNSPECIFIED: return "unspecified";
+      case MatrixDataStorage::STACK: return "stack";
+      case MatrixDataStorage::HEAP: return "heap";
+      case MatrixDataStorage::USER: return "user";
+      case MatrixDataStorage::SHARED: return "shared";
+    }
+    return "";
+}
+
+// Checks whether "name" is in the comma separated list
+bool listed(const std::string &list, const std::string &name) {
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Storage which is actually used for the matrix data
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+constexpr MatrixDataStorage data_storage() {
+    return (S == MatrixDataStorage::UNSPECIFIED) ? choose_matrix_data_storage(sizeof(T) * M * N) : S;
+}
+
+// Measures a single call of "op": median, 99th percentile and minimum of the
+// per-call time over several samples.
+template<typename F>
+Result measure(const Options &opt, F &&op, const size_t calls_per_op = 1) {
+    using clock = std::chrono::steady_clock;
+    auto elapsed_ns = [](clock::time_point t0) {
+        return std::chrono::duration<double, std::nano>(clock::now() - t0).count();
+    };
+
+    for (size_t i = 0; i < opt.warmup; ++i) {
+        op();
+    }
+
+    std::vector<double> samples;
+    const auto start = clock::now();
+
+    // Calibrate the number of calls per sample
+    size_t calls = 1;
+    for (;;) {
+        auto t0 = clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            op();
+        }
+        double ns = elapsed_ns(t0);
+        if (ns >= kSampleNsMin) {
+            samples.push_back(ns / calls); // long enough to be a sample itself
+            break;
+        }
+        calls *= (ns > 0) ? std::max<size_t>(2, static_cast<size_t>(kSampleNsMin / ns) + 1) : 16;
+    }
+
+    while ((samples.size() < opt.reps) && (elapsed_ns(start) < opt.budget_ms * 1e6)) {
+        auto t0 = clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            op();
+        }
+        samples.push_back(elapsed_ns(t0) / calls);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    Result r{};
+    r.samples = samples.size();
+    r.calls = calls * calls_per_op;
+    r.median_ns = samples[samples.size() / 2] / calls_per_op;
+    r.p99_ns = samples[(samples.size() * 99 + 99) / 100 - 1] / calls_per_op; // nearest rank
+    r.min_ns = samples.front() / calls_per_op;
+    return r;
+}
+
+// Matrix filled with random values, owning the memory for USER storage
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+struct Operand {
+    Matrix<T, M, N, S> m;
+    explicit Operand(const T *arr) : m(arr) {}
+};
+template<typename T, size_t M, size_t N>
+struct Operand<T, M, N, MatrixDataStorage::USER> {
+    std::vector<T> mem;
+    Matrix<T, M, N, MatrixDataStorage::USER> m;
+    explicit Operand(const T *arr) : mem(M * N), m(mem.data(), arr) {}
+};
+
+template<typename T>
+std::vector<T> random_values(const size_t size, const T lo, const T hi) {
+    std::mt19937 gen(12345);
+    std::vector<T> vals(size);
+    using Dist = std::conditional_t<std::is_integral<T>::value, std::uniform_int_distribution<T>,
+                                    std::uniform_real_distribution<T>>;
+    Dist dist(lo, hi);
+    for (auto &v : vals) {
+        v = dist(gen);
+    }
+    return vals;
+}
+
+// Benchmarks all kernels for square matrices of type T, size N and storage S
+template<typename T, size_t N, MatrixDataStorage S>
+class Suite {
+  private:
+    using M_ = Matrix<T, N, N, S>;
+    static constexpr bool kDataOnStack = (data_storage<T, N, N, S>() == MatrixDataStorage::STACK);
+
+    const Options &opt_;
+    std::vector<T> vals_;
+    std::vector<T> zeros_;
+    Operand<T, N, N, S> a_, b_, zero_, x_, y_;
+    volatile T one_ = 1; // hides the value from the optimizer
+
+    // Copy of the matrix: "in" bytes are read and the matrix is written
+    static constexpr MatrixCost copy_cost(const size_t in = sizeof(T)) {
+        return elementwise_cost(N * N, in, sizeof(T), 0);
+    }
+    // Copies of SHARED matrices only share the data (the elements are copied
+    // by the first "write()"), so no bytes are charged
+    static constexpr MatrixCost share_cost() {
+        return (S == MatrixDataStorage::SHARED) ? MatrixCost{ 0, 0 } : copy_cost();
+    }
+
+    bool enabled(const char *kernel) const {
+        return opt_.kernel.empty() || (std::string(kernel).find(opt_.kernel) != std::string::npos);
+    }
+
+    template<typename F>
+    void run(const char *kernel, const MatrixCost cost, F &&op, const size_t calls_per_op = 1) {
+        if (!enabled(kernel)) {
+            return;
+        }
+        Result r = measure(opt_, std::forward<F>(op), calls_per_op);
+        r.kernel = kernel;
+        r.type = type_name<T>();
+        r.storage = storage_name(S);
+        r.m = r.n = N;
+        r.p = (std::strcmp(kernel, "mul") == 0) ? N : 0; // P is only defined for "mul()"
+        r.flops = static_cast<double>(cost.flops);
+        r.bytes = static_cast<double>(cost.bytes);
+        results.push_back(r);
+
+        std::cout << std::left << std::setw(14) << r.kernel << std::setw(8) << r.type
+            << std::setw(13) << r.storage << std::right << std::setw(6) << N
+            << std::setw(6) << r.samples << std::fixed << std::setprecision(1)
+            << std::setw(16) << r.median_ns << std::setw(16) << r.p99_ns
+            << std::setprecision(3) << std::setw(11) << (r.flops / r.median_ns)
+            << std::setw(11) << (r.bytes / r.median_ns) << std::endl;
+    }
+
+    // Kernels which need a pointer to user memory to construct a matrix
+    void constructors(std::true_type /*user*/) {
+        const T *arr = vals_.data();
+        T *mem = x_.mem.data();
+        run("ctor", MatrixCost{ 0, 0 }, [&] { M_ m(mem); escape(m.read()); });
+        run("ctor_fill", copy_cost(0), [&] { M_ m(mem, T(1)); escape(m.read()); });
+        run("ctor_arr", copy_cost(), [&] { M_ m(mem, arr); escape(m.read()); });
+    }
+    void constructors(std::false_type /*user*/) {
+        const T *arr = vals_.data();
+        const M_ &a = a_.m;
+        run("ctor", MatrixCost{ 0, 0 }, [&] { M_ m; escape(m.read()); });
+        run("ctor_fill", copy_cost(0), [&] { M_ m(T(1)); escape(m.read()); });
+        run("ctor_arr", copy_cost(), [&] { M_ m(arr); escape(m.read()); });
+        run("copy", share_cost(), [&] { M_ m(a); escape(m.read()); });
+        run("copy_write", copy_cost(), [&] { M_ m(a); escape(m.write()); });
+    }
+
+    // Determinant is benchmarked for floating point types only (see "det()")
+    void determinant(std::true_type /*floating*/) {
+        const M_ &a = a_.m;
+        run("det", det_cost<T, N>(), [&] { volatile T d = det(a); (void)d; });
+    }
+    void determinant(std::false_type /*floating*/) {}
+
+  public:
+    Suite(const Options &opt)
+        : opt_(opt), vals_(random_values<T>(N * N, T(-4), T(4))), zeros_(N * N, T(0)),
+          a_(vals_.data()), b_(vals_.data()), zero_(zeros_.data()), x_(vals_.data()), y_(vals_.data()) {}
+
+    void run_all() {
+        const M_ &a = a_.m;
+        const M_ &b = b_.m;
+        const M_ &zero = zero_.m;
+        M_ &x = x_.m;
+        M_ &y = y_.m;
+
+        constructors(std::integral_constant<bool, S == MatrixDataStorage::USER>());
+        const size_t sz = sizeof(T);
+        run("copy_assign", share_cost(), [&] { x = a; escape(x.read()); });
+        run("move_assign", kDataOnStack ? copy_cost() : MatrixCost{ 0, 0 },
+            [&] { y = std::move(x); x = std::move(y); escape(x.read()); }, 2);
+
+        run("neg", elementwise_cost(N * N, sz, sz), [&] { auto r = -a; escape(r.read()); });
+        run("add", elementwise_cost(N * N, 2 * sz, sz), [&] { auto r = a + b; escape(r.read()); });
+        run("sub", elementwise_cost(N * N, 2 * sz, sz), [&] { auto r = a - b; escape(r.read()); });
+        run("scale", elementwise_cost(N * N, sz, sz), [&] { auto r = a * T(2); escape(r.read()); });
+        run("div", elementwise_cost(N * N, sz, sz), [&] { auto r = a / T(2); escape(r.read()); });
+        run("add_assign", elementwise_cost(N * N, 2 * sz, sz), [&] { x += zero; escape(x.read()); });
+        run("scale_assign", elementwise_cost(N * N, sz, sz), [&] { x *= T(one_); escape(x.read()); });
+        run("eq", elementwise_cost(N * N, 2 * sz, 0), [&] { volatile bool r = (a == b); (void)r; });
+
+        run("mul", mul_cost<T, T, N, N, N>(), [&] { auto r = mul(a, b); escape(r.read()); });
+        determinant(std::integral_constant<bool, std::is_floating_point<T>::value>());
+    }
+};
+
+template<typename T, size_t N, MatrixDataStorage S>
+void run_storage(const Options &opt, std::true_type /*fits*/) {
+    if (!listed(opt.storages, storage_name(S))) {
+        return;
+    }
+    Suite<T, N, S> suite(opt);
+    suite.run_all();
+}
+template<typename T, size_t N, MatrixDataStorage S>
+void run_storage(const Options &, std::false_type /*fits*/) {} // too big for stack
+
+template<typename T, size_t N>
+void run_type(const Options &opt) {
+    if (!listed(opt.types, type_name<T>())) {
+        return;
+    }
+    constexpr bool stack_fits = (sizeof(T) * N * N <= kStackBytesMax);
+    run_storage<T, N, MatrixDataStorage::UNSPECIFIED>(opt, std::true_type());
+    run_storage<T, N, MatrixDataStorage::STACK>(opt, std::integral_constant<bool, stack_fits>());
+    run_storage<T, N, MatrixDataStorage::HEAP>(opt, std::true_type());
+    run_storage<T, N, MatrixDataStorage::USER>(opt, std::true_type());
+    run_storage<T, N, MatrixDataStorage::SHARED>(opt, std::true_type());
+}
+
+template<size_t N>
+void run_size(const Options &opt) {
+    if ((N < opt.min_size) || (N > opt.max_size)) {
+        return;
+    }
+    run_type<float, N>(opt);
+    run_type<double, N>(opt);
+    run_type<int, N>(opt);
+}
+
+template<size_t... Ns>
+void run_sizes(const Options &opt) {
+    int expand[] = { (run_size<Ns>(opt), 0)... };
+    (void)expand;
+}
+
+// Sustained memory bandwidth: the best of several "a = b + s * c" passes over
+// arrays which are much larger than caches
+double probe_bandwidth() {
+    using clock = std::chrono::steady_clock;
+    const size_t n = 4 << 20; // 32 MB per array
+    std::vector<double> a(n, 0), b(n, 1), c(n, 2);
+    volatile double s_ = 0.5;
+    const double s = s_;
+    double best = 0;
+    for (int rep = 0; rep < 10; ++rep) {
+        auto t0 = clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            a[i] = b[i] + s * c[i];
+        }
+        escape(a.data());
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - t0).count();
+        best = std::max(best, 3.0 * n * sizeof(double) / ns);
+    }
+    return best;
+}
+
+// Multiply-add throughput. Many independent chains hide the latency of the
+// operation and let the compiler vectorize them with the same instructions
+// that are available to the library kernels.
+template<typename T>
+double probe_flops() {
+    using clock = std::chrono::steady_clock;
+    constexpr size_t kChains = 64;
+    T acc[kChains];
+    for (size_t i = 0; i < kChains; ++i) {
+        acc[i] = T(i % 7);
+    }
+    // Chains converge to a fixed point for floating point types
+    volatile T a_ = std::is_floating_point<T>::value ? T(0.999) : T(1);
+    volatile T b_ = std::is_floating_point<T>::value ? T(0.001) : T(0);
+    const T a = a_, b = b_;
+    double best = 0;
+    size_t iters = 1024;
+    for (int rep = 0; rep < 8; ) {
+        auto t0 = clock::now();
+        for (size_t it = 0; it < iters; ++it) {
+            for (size_t i = 0; i < kChains; ++i) {
+                acc[i] = acc[i] * a + b;
+            }
+            escape(acc);
+        }
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - t0).count();
+        if (ns < 2e7) { // too short to be measured precisely
+            iters *= 2;
+            continue;
+        }
+        best = std::max(best, 2.0 * kChains * iters / ns);
+        ++rep;
+    }
+    return best;
+}
+
+void probe_peak() {
+    peak.gbytes_per_s = probe_bandwidth();
+    peak.gflops["float"] = probe_flops<float>();
+    peak.gflops["double"] = probe_flops<double>();
+    peak.gflops["int"] = probe_flops<int>();
+}
+
+// Part of the roofline bound reached by the benchmark. The bound is the time
+// needed either for the operations at peak throughput or for the memory traffic
+// at peak bandwidth, whichever is longer. Bandwidth is measured for memory, so
+// kernels working in caches could exceed 100%.
+double roofline_efficiency(const Result &r) {
+    const double compute_ns = r.flops / peak.gflops[r.type];
+    const double memory_ns = r.bytes / peak.gbytes_per_s;
+    return std::max(compute_ns, memory_ns) / r.median_ns;
+}
+// Performance attainable for the arithmetic intensity of the benchmark
+double roofline_attainable_gflops(const Result &r) {
+    return (r.bytes > 0) ? std::min(peak.gflops[r.type], r.flops / r.bytes * peak.gbytes_per_s) : peak.gflops[r.type];
+}
+
+void print_roofline() {
+    std::cout << "\nRoofline: memory " << std::setprecision(2) << peak.gbytes_per_s << " GB/s, multiply-add "
+        << peak.gflops["float"] << " (float) " << peak.gflops["double"] << " (double) "
+        << peak.gflops["int"] << " (int) GOP/s\n" << std::endl;
+    std::cout << std::left << std::setw(14) << "kernel" << std::setw(8) << "type"
+        << std::setw(13) << "storage" << std::right << std::setw(6) << "size"
+        << std::setw(12) << "flop/byte" << std::setw(14) << "attainable" << std::setw(12) << "achieved"
+        << std::setw(10) << "bound" << std::setw(10) << "of bound" << std::endl;
+    for (const Result &r : results) {
+        if (r.flops == 0) {
+            continue; // copies are characterized by GB/s above
+        }
+        const bool memory_bound = (r.flops / r.bytes < peak.gflops[r.type] / peak.gbytes_per_s);
+        std::cout << std::left << std::setw(14) << r.kernel << std::setw(8) << r.type
+            << std::setw(13) << r.storage << std::right << std::setw(6) << r.n
+            << std::fixed << std::setprecision(3) << std::setw(12) << (r.flops / r.bytes)
+            << std::setw(14) << roofline_attainable_gflops(r) << std::setw(12) << (r.flops / r.median_ns)
+            << std::setw(10) << (memory_bound ? "memory" : "compute")
+            << std::setprecision(1) << std::setw(9) << (100 * roofline_efficiency(r)) << '%' << std::endl;
+    }
+}
+
+void write_json(const std::string &path) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "Cannot open \"" << path << "\" for writing" << std::endl;
+        std::exit(1);
+    }
+    out << "{\n  \"context\": {\n"
+        << "    \"stack_bytes_max\": " << kStackBytesMax << ",\n"
+        << "    \"sizeof_void_p\": " << sizeof(void*);
+    if (peak.gbytes_per_s > 0) {
+        out << ",\n    \"peak_gbytes_per_s\": " << peak.gbytes_per_s << ",\n    \"peak_gflops\": {";
+        bool comma = false;
+        for (auto &p : peak.gflops) {
+            out << (comma ? ", " : "") << "\"" << p.first << "\": " << p.second;
+            comma = true;
+        }
+        out << "}";
+    }
+    out << "\n  },\n  \"benchmarks\": [";
+    out << std::setprecision(6);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        out << (i ? "," : "") << "\n    {"
+            << "\"kernel\": \"" << r.kernel << "\", "
+            << "\"type\": \"" << r.type << "\", "
+            << "\"storage\": \"" << r.storage << "\", "
+            << "\"m\": " << r.m << ", \"n\": " << r.n << ", \"p\": " << r.p << ", "
+            << "\"samples\": " << r.samples << ", \"calls_per_sample\": " << r.calls << ", "
+            << "\"median_ns\": " << r.median_ns << ", \"p99_ns\": " << r.p99_ns << ", "
+            << "\"min_ns\": " << r.min_ns << ", "
+            << "\"flops\": " << r.flops << ", \"bytes\": " << r.bytes << ", "
+            << "\"gflops\": " << (r.flops / r.median_ns) << ", "
+            << "\"gbytes_per_s\": " << (r.bytes / r.median_ns);
+        if (peak.gbytes_per_s > 0) {
+            out << ", \"attainable_gflops\": " << roofline_attainable_gflops(r)
+                << ", \"roofline_efficiency\": " << roofline_efficiency(r);
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void usage(const char *name) {
+    std::cout << "Usage: " << name << " [options]\n"
+        << "  --min-size N     smallest matrix size, power of two (default 4)\n"
+        << "  --max-size N     largest matrix size, power of two (default 4096)\n"
+        << "  --warmup N       calls before measurement (default 1)\n"
+        << "  --reps N         samples per benchmark (default 15)\n"
+        << "  --budget-ms X    time limit of sampling per benchmark (default 500)\n"
+        << "  --kernel NAME    run kernels containing NAME only\n"
+        << "  --types LIST     comma separated: float,double,int\n"
+        << "  --storages LIST  comma separated: unspecified,stack,heap,user,shared\n"
+        << "  --json FILE      write results in JSON format\n"
+        << "  --roofline       measure peak bandwidth and multiply-add throughput of the host\n"
+        << "                   and report performance of kernels against the roofline" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-h") || (arg == "--help")) {
+            usage(argv[0]);
+            return 0;
+        }
+        if (arg == "--roofline") {
+            opt.roofline = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string val = argv[++i];
+        if (arg == "--min-size") {
+            opt.min_size = std::stoul(val);
+        } else if (arg == "--max-size") {
+            opt.max_size = std::stoul(val);
+        } else if (arg == "--warmup") {
+            opt.warmup = std::stoul(val);
+        } else if (arg == "--reps") {
+            opt.reps = std::max<size_t>(1, std::stoul(val));
+        } else if (arg == "--budget-ms") {
+            opt.budget_ms = std::stod(val);
+        } else if (arg == "--kernel") {
+            opt.kernel = val;
+        } else if (arg == "--types") {
+            opt.types = val;
+        } else if (arg == "--storages") {
+            opt.storages = val;
+        } else if (arg == "--json") {
+            opt.json = val;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::cout << std::left << std::setw(14) << "kernel" << std::setw(8) << "type"
+        << std::setw(13) << "storage" << std::right << std::setw(6) << "size"
+        << std::setw(6) << "reps" << std::setw(16) << "median ns/op" << std::setw(16) << "p99 ns/op"
+        << std::setw(11) << "GFLOP/s" << std::setw(11) << "GB/s" << std::endl;
+
+    if (opt.roofline) {
+        probe_peak(); // before benchmarks to report the bound in JSON too
+    }
+    run_sizes<4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096>(opt);
+    if (opt.roofline) {
+        print_roofline();
+    }
+
+    if (!opt.json.empty()) {
+        write_json(opt.json);
+    }
+    return 0;
+}
@@ -0,0 +1,546 @@
+// Differential tester of the matrix "library" kernels. Every kernel is compared
+// with a straightforward reference implementation on random operands of various
+// shapes, element types, storages and alignments of user memory.
+
+#include "matrix.h"     // matrix "library"
+using namespace matrix; // use shortened names
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+// Reference implementations. They are the plain loops the library started
+// with and must stay this way: optimized kernels are checked against them.
+namespace ref {
+
+template<typename R, typename T>
+void neg(R *r, const T *a, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        r[i] = -a[i];
+    }
+}
+template<typename R, typename T, typename T_>
+void add(R *r, const T *a, const T_ *b, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        r[i] = static_cast<R>(a[i] + b[i]);
+    }
+}
+template<typename R, typename T, typename T_>
+void sub(R *r, const T *a, const T_ *b, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        r[i] = static_cast<R>(a[i] - b[i]);
+    }
+}
+// Assignment operators convert the right operand to the type of the left one
+template<typename T, typename T_>
+void add_assign(T *r, const T_ *b, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        r[i] += static_cast<T>(b[i]);
+    }
+}
+template<typename T, typename T_>
+void sub_assign(T *r, const T_ *b, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        r[i] -= static_cast<T>(b[i]);
+    }
+}
+template<typename T, typename T_>
+void scale(T *r, const T *a, const T_ s, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        r[i] = a[i] * static_cast<T>(s);
+    }
+}
+template<typename T, typename T_>
+void div(T *r, const T *a, const T_ s, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        r[i] = a[i] / static_cast<T>(s);
+    }
+}
+template<typename T, typename T_>
+bool eq(const T *a, const T_ *b, const size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+template<typename R, typename T, typename T_>
+void mul(R *r, const T *a, const T_ *b, const size_t m, const size_t n, const size_t p) {
+    for (size_t i = 0; i < m; ++i) {
+        for (size_t j = 0; j < p; ++j) {
+            R val = 0;
+            for (size_t k = 0; k < n; ++k) {
+                val += static_cast<R>(a[i * n + k] * b[k * p + j]);
+            }
+            r[i * p + j] = val;
+        }
+    }
+}
+// Gaussian elimination to almost lower triangular matrix by columns
+template<typename T>
+T det(std::vector<T> arr, const size_t n) {
+    T factor = 1;
+    for (size_t i = 0; i < n; ++i) {
+        size_t in = i * n;
+        if (arr[in + i] == 0) {
+            size_t j = i + 1;
+            for ( ; j < n; ++j) {
+                if (arr[in + j] != 0) {
+                    for (size_t k = i; k < n; ++k) {
+                        std::swap(arr[k * n + i], arr[k * n + j]);
+                    }
+                    factor = -factor;
+                    j = i;
+                    break;
+                }
+            }
+            if (j != i) {
+                return T(0);
+            }
+        }
+        for (size_t j = i + 1; j < n; ++j) {
+            if (arr[in + j] != 0) {
+                T multiplier = arr[in + i] / arr[in + j];
+                factor *= multiplier;
+                for (size_t k = i + 1; k < n; ++k) {
+                    arr[k * n + j] = arr[k * n + j] * multiplier - arr[k * n + i];
+                }
+            }
+        }
+    }
+    T res = arr[0];
+    for (size_t i = 1; i < n; ++i) {
+        res *= arr[i * n + i];
+    }
+    return res / factor;
+}
+// Determinant of integer matrix modulo prime p < 2^31
+template<typename T>
+long long det_mod(const std::vector<T> &vals, const size_t n, const long long p) {
+    std::vector<long long> arr(vals.size());
+    for (size_t i = 0; i < vals.size(); ++i) {
+        arr[i] = (static_cast<long long>(vals[i]) % p + p) % p;
+    }
+    auto inverse = [p](long long a) { // Fermat's little theorem
+        long long res = 1;
+        for (long long e = p - 2; e != 0; e >>= 1, a = a * a % p) {
+            res = (e & 1) ? res * a % p : res;
+        }
+        return res;
+    };
+    long long res = 1;
+    for (size_t i = 0; i < n; ++i) {
+        size_t k = i;
+        while ((k < n) && (arr[k * n + i] == 0)) {
+            ++k;
+        }
+        if (k == n) {
+            return 0;
+        }
+        if (k != i) {
+            for (size_t j = 0; j < n; ++j) {
+                std::swap(arr[i * n + j], arr[k * n + j]);
+            }
+            res = p - res;
+        }
+        res = res * arr[i * n + i] % p;
+        const long long inv = inverse(arr[i * n + i]);
+        for (k = i + 1; k < n; ++k) {
+            const long long f = arr[k * n + i] * inv % p;
+            for (size_t j = i; j < n; ++j) {
+                arr[k * n + j] = ((arr[k * n + j] - f * arr[i * n + j]) % p + p) % p;
+            }
+        }
+    }
+    return res % p;
+}
+
+} // namespace ref
+
+// Command line options
+struct Options {
+    unsigned seed = 1;
+    size_t iters = 20;  // random operands per case
+    unsigned ulps = 4;  // allowed distance for floating point results
+    bool verbose = false;
+};
+
+// Distance between floating point numbers in units in the last place
+template<typename T>
+uint64_t ulp_distance(const T a, const T b) {
+    using I = std::conditional_t<sizeof(T) == 4, int32_t, int64_t>;
+    static_assert(sizeof(T) == sizeof(I), "float or double is expected");
+    if (std::isnan(a) || std::isnan(b)) {
+        return (std::isnan(a) && std::isnan(b)) ? 0 : std::numeric_limits<uint64_t>::max();
+    }
+    I ia, ib;
+    std::memcpy(&ia, &a, sizeof(T));
+    std::memcpy(&ib, &b, sizeof(T));
+    // Map sign-magnitude representation to a monotonic one
+    const int64_t oa = (ia < 0) ? std::numeric_limits<I>::min() - static_cast<int64_t>(ia) : ia;
+    const int64_t ob = (ib < 0) ? std::numeric_limits<I>::min() - static_cast<int64_t>(ib) : ib;
+    return (oa > ob) ? static_cast<uint64_t>(oa - ob) : static_cast<uint64_t>(ob - oa);
+}
+
+// Collects results of the checks
+class Checker {
+  private:
+    const Options &opt_;
+    size_t checks_ = 0;
+    size_t failures_ = 0;
+
+    template<typename T>
+    bool close(const T got, const T ref, const unsigned ulps, const double bound, std::true_type /*floating*/) {
+        return (ulp_distance(got, ref) <= ulps) || (std::abs(static_cast<double>(got) - ref) <= bound);
+    }
+    template<typename T>
+    bool close(const T got, const T ref, const unsigned, const double, std::false_type /*floating*/) {
+        return got == ref; // integer results are exact
+    }
+
+  public:
+    std::string context; // description of the current case
+
+    explicit Checker(const Options &opt) : opt_(opt) {}
+
+    size_t checks() const { return checks_; }
+    size_t failures() const { return failures_; }
+
+    // Compares arrays elementwise. Floating point elements match if they are
+    // within "ulps" or their absolute difference is within "bounds[i]" (an
+    // error bound of the operation, used when results could be cancelled).
+    template<typename T>
+    void expect(const char *op, const T *got, const T *ref, const size_t size, const unsigned ulps,
+                const double *bounds = nullptr) {
+        ++checks_;
+        for (size_t i = 0; i < size; ++i) {
+            if (!close(got[i], ref[i], ulps, bounds ? bounds[i] : 0,
+                       std::integral_constant<bool, std::is_floating_point<T>::value>())) {
+                ++failures_;
+                std::cout << "FAILED " << op << " " << context << ": element " << i << " is "
+                    << std::setprecision(17) << got[i] << ", expected " << ref[i] << std::endl;
+                return;
+            }
+        }
+        if (opt_.verbose) {
+            std::cout << "ok " << op << " " << context << std::endl;
+        }
+    }
+    void expect(const char *op, const bool got, const bool ref) {
+        expect(op, &got, &ref, 1, 0);
+    }
+};
+
+const char* storage_name(const MatrixDataStorage s) {
+    switch (s) {
+      case MatrixDataStorage::UNSPECIFIED: return "unspecified";
+      case MatrixDataStorage::STACK: return "stack";
+      case MatrixDataStorage::HEAP: return "heap";
+      case MatrixDataStorage::USER: return "user";
+      case MatrixDataStorage::SHARED: return "shared";
+    }
+    return "";
+}
+
+template<typename T> const char* type_name();
+template<> const char* type_name<float>() { return "float"; }
+template<> const char* type_name<double>() { return "double"; }
+template<> const char* type_name<int>() { return "int"; }
+
+// Random operand values. Exact zeros are frequent to exercise special paths.
+template<typename T>
+std::vector<T> random_values(std::mt19937 &gen, const size_t size) {
+    std::vector<T> vals(size);
+    std::uniform_int_distribution<int> zero(0, 15);
+    std::uniform_int_distribution<int> ints(-9, 9);
+    std::uniform_real_distribution<double> reals(-8, 8);
+    for (auto &v : vals) {
+        v = !zero(gen) ? T(0) : (std::is_integral<T>::value ? T(ints(gen)) : T(reals(gen)));
+    }
+    return vals;
+}
+
+// Largest offset (in elements) of user memory from the allocated one
+constexpr size_t kMaxOffset = 7;
+
+// Matrix of storage S initialized with values. USER matrices are placed at the
+// given offset to check unaligned memory.
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+struct Operand {
+    Matrix<T, M, N, S> m;
+    Operand(const T *arr, size_t /*offset*/) : m(arr) {}
+};
+template<typename T, size_t M, size_t N>
+struct Operand<T, M, N, MatrixDataStorage::USER> {
+    std::vector<T> mem;
+    Matrix<T, M, N, MatrixDataStorage::USER> m;
+    Operand(const T *arr, size_t offset) : mem(M * N + kMaxOffset), m(mem.data() + offset, arr) {}
+};
+
+// Checks all kernels for lhs matrix(m,n) of type T in storage S and rhs
+// matrices of type T_ in storage S_: matrix(m,n) for elementwise operations
+// and matrix(n,p) for multiplication.
+template<typename T, typename T_, size_t M, size_t N, size_t P, MatrixDataStorage S, MatrixDataStorage S_>
+class Case {
+  private:
+    using TT_ = std::common_type_t<T, T_>;
+    static constexpr bool kFloating = std::is_floating_point<TT_>::value;
+
+    Checker &check_;
+    const Options &opt_;
+    std::mt19937 &gen_;
+
+    size_t offset() {
+        return std::uniform_int_distribution<size_t>(0, kMaxOffset)(gen_);
+    }
+
+    // Conversion to another type and storage (USER matrix can't be created by copying)
+    void conversion(const Operand<T, M, N, S> &, std::true_type /*user*/) {}
+    void conversion(const Operand<T, M, N, S> &a, std::false_type /*user*/) {
+        Matrix<T_, M, N, S_> r = a.m;
+        std::vector<T_> expected(a.m.read(), a.m.read() + M * N);
+        for (size_t i = 0; i < M * N; ++i) {
+            expected[i] = static_cast<T_>(a.m.read()[i]);
+        }
+        check_.expect("convert", r.read(), expected.data(), M * N, 0);
+    }
+
+    // Determinant of square floating point matrices may differ by rounding errors
+    // of elimination, which are bounded by the product of row norms (Hadamard
+    // bound of the determinant).
+    void determinant(const std::vector<T> &vals, const Operand<T, M, N, S> &a, std::true_type /*square floating*/) {
+        T got = det(a.m);
+        T expected = ref::det(vals, N);
+        double hadamard = 1;
+        for (size_t i = 0; i < N; ++i) {
+            double norm = 0;
+            for (size_t j = 0; j < N; ++j) {
+                norm += static_cast<double>(vals[i * N + j]) * vals[i * N + j];
+            }
+            hadamard *= std::sqrt(norm);
+        }
+        double bound = opt_.ulps * N * std::numeric_limits<T>::epsilon() * hadamard;
+        check_.expect("det", &got, &expected, 1, opt_.ulps, &bound);
+    }
+    void determinant(const std::vector<T> &vals, const Operand<T, M, N, S> &a, std::false_type /*square floating*/) {
+        determinant_exact(vals, a, std::integral_constant<bool, (M == N) && std::is_integral<T>::value>());
+    }
+    // Exact determinant of integer matrices is compared modulo two primes when
+    // it's representable
+    void determinant_exact(const std::vector<T> &vals, const Operand<T, M, N, S> &a, std::true_type /*square integer*/) {
+        T got = 0;
+        if (det(a.m, got)) {
+            for (long long p : { 2147483647LL, 1000000007LL }) {
+                long long residue = (static_cast<long long>(got) % p + p) % p;
+                long long expected = ref::det_mod(vals, N, p);
+                check_.expect("det", &residue, &expected, 1, 0);
+            }
+        }
+    }
+    void determinant_exact(const std::vector<T> &, const Operand<T, M, N, S> &, std::false_type /*square integer*/) {}
+
+    // Error bounds of dot products for cancelled results
+    std::vector<double> mul_bounds(const std::vector<T> &a, const std::vector<T_> &b) const {
+        std::vector<double> bounds(M * P, 0);
+        const double eps = kFloating ? std::numeric_limits<TT_>::epsilon() : 0;
+        for (size_t i = 0; i < M; ++i) {
+            for (size_t j = 0; j < P; ++j) {
+                double sum = 0;
+                for (size_t k = 0; k < N; ++k) {
+                    sum += std::abs(static_cast<double>(a[i * N + k]) * b[k * P + j]);
+                }
+                bounds[i * P + j] = opt_.ulps * N * eps * sum;
+            }
+        }
+        return bounds;
+    }
+
+  public:
+    Case(Checker &check, const Options &opt, std::mt19937 &gen) : check_(check), opt_(opt), gen_(gen) {}
+
+    void run() {
+        std::stringstream ss;
+        ss << "[" << type_name<T>() << " " << M << "x" << N << " " << storage_name(S) << ", "
+            << type_name<T_>() << " " << storage_name(S_) << ", p=" << P << "]";
+        check_.context = ss.str();
+
+        const unsigned ulps = opt_.ulps;
+        auto av = random_values<T>(gen_, M * N);
+        auto bv = random_values<T_>(gen_, M * N);
+        auto cv = random_values<T_>(gen_, N * P);
+        Operand<T, M, N, S> a(av.data(), offset());
+        Operand<T_, M, N, S_> b(bv.data(), offset());
+        Operand<T_, N, P, S_> c(cv.data(), offset());
+        T_ s = random_values<T_>(gen_, 1)[0];
+        T_ d = (static_cast<T>(s) != T(0)) ? s : T_(3); // divisor
+
+        std::vector<T> rt(M * N);
+        std::vector<TT_> rtt(std::max(M * N, M * P));
+
+        // Construction keeps values
+        check_.expect("construct", a.m.read(), av.data(), M * N, 0);
+        conversion(a, std::integral_constant<bool, S_ == MatrixDataStorage::USER>());
+
+        // Unary operators
+        auto pos = +a.m;
+        check_.expect("pos", pos.read(), av.data(), M * N, 0);
+        auto neg = -a.m;
+        ref::neg(rt.data(), av.data(), M * N);
+        check_.expect("neg", neg.read(), rt.data(), M * N, ulps);
+
+        // Binary operators
+        auto sum = a.m + b.m;
+        ref::add(rtt.data(), av.data(), bv.data(), M * N);
+        check_.expect("add", sum.read(), rtt.data(), M * N, ulps);
+        auto dif = a.m - b.m;
+        ref::sub(rtt.data(), av.data(), bv.data(), M * N);
+        check_.expect("sub", dif.read(), rtt.data(), M * N, ulps);
+        auto scaled = a.m * s;
+        ref::scale(rt.data(), av.data(), s, M * N);
+        check_.expect("scale", scaled.read(), rt.data(), M * N, ulps);
+        auto scaled_ = s * a.m;
+        check_.expect("scale (scalar first)", scaled_.read(), rt.data(), M * N, ulps);
+        auto divided = a.m / d;
+        ref::div(rt.data(), av.data(), d, M * N);
+        check_.expect("div", divided.read(), rt.data(), M * N, ulps);
+
+        // Assignment operators
+        {
+            Operand<T, M, N, S> x(av.data(), offset());
+            rt = av;
+            x.m += b.m;
+            ref::add_assign(rt.data(), bv.data(), M * N);
+            check_.expect("add_assign", x.m.read(), rt.data(), M * N, ulps);
+            x.m -= b.m;
+            ref::sub_assign(rt.data(), bv.data(), M * N);
+            check_.expect("sub_assign", x.m.read(), rt.data(), M * N, ulps);
+            x.m *= s;
+            ref::scale(rt.data(), rt.data(), s, M * N);
+            check_.expect("scale_assign", x.m.read(), rt.data(), M * N, ulps);
+            x.m /= d;
+            ref::div(rt.data(), rt.data(), d, M * N);
+            check_.expect("div_assign", x.m.read(), rt.data(), M * N, ulps);
+        }
+
+        // Comparison
+        {
+            std::vector<T_> same(av.begin(), av.end());
+            for (size_t i = 0; i < M * N; ++i) {
+                same[i] = static_cast<T_>(av[i]);
+            }
+            Operand<T_, M, N, S_> e(same.data(), offset());
+            check_.expect("eq (equal)", a.m == e.m, ref::eq(av.data(), same.data(), M * N));
+            same[std::uniform_int_distribution<size_t>(0, M * N - 1)(gen_)] += T_(1);
+            Operand<T_, M, N, S_> f(same.data(), offset());
+            check_.expect("eq (different)", a.m == f.m, ref::eq(av.data(), same.data(), M * N));
+            check_.expect("eq (random)", a.m == b.m, ref::eq(av.data(), bv.data(), M * N));
+            check_.expect("neq", a.m != b.m, !ref::eq(av.data(), bv.data(), M * N));
+        }
+
+        // Multiplication
+        {
+            auto prod = mul(a.m, c.m);
+            ref::mul(rtt.data(), av.data(), cv.data(), M, N, P);
+            auto bounds = mul_bounds(av, cv);
+            check_.expect("mul", prod.read(), rtt.data(), M * P, ulps, bounds.data());
+        }
+
+        determinant(av, a, std::integral_constant<bool, (M == N) && std::is_floating_point<T>::value>());
+    }
+};
+
+template<size_t M_, size_t N_, size_t P_>
+struct Shape {
+    static constexpr size_t M = M_, N = N_, P = P_;
+};
+template<typename T_, typename U_>
+struct Types {
+    using T = T_;
+    using U = U_;
+};
+template<MatrixDataStorage S_, MatrixDataStorage U_>
+struct Storages {
+    static constexpr MatrixDataStorage S = S_, U = U_;
+};
+
+template<typename Ty, typename Sh, typename St>
+void run_case(Checker &check, const Options &opt, std::mt19937 &gen) {
+    for (size_t i = 0; i < opt.iters; ++i) {
+        Case<typename Ty::T, typename Ty::U, Sh::M, Sh::N, Sh::P, St::S, St::U>(check, opt, gen).run();
+    }
+}
+template<typename Ty, typename Sh, typename... St>
+void run_storages(Checker &check, const Options &opt, std::mt19937 &gen) {
+    int expand[] = { (run_case<Ty, Sh, St>(check, opt, gen), 0)... };
+    (void)expand;
+}
+template<typename Ty, typename... Sh>
+void run_shapes(Checker &check, const Options &opt, std::mt19937 &gen) {
+    using U = MatrixDataStorage;
+    int expand[] = { (run_storages<Ty, Sh,
+                                   Storages<U::UNSPECIFIED, U::UNSPECIFIED>, Storages<U::STACK, U::STACK>,
+                                   Storages<U::HEAP, U::HEAP>, Storages<U::USER, U::USER>,
+                                   Storages<U::STACK, U::HEAP>, Storages<U::HEAP, U::USER>,
+                                   Storages<U::USER, U::STACK>, Storages<U::UNSPECIFIED, U::USER>,
+                                   Storages<U::SHARED, U::SHARED>, Storages<U::SHARED, U::HEAP>,
+                                   Storages<U::STACK, U::SHARED>>(check, opt, gen), 0)... };
+    (void)expand;
+}
+template<typename... Ty>
+void run_types(Checker &check, const Options &opt, std::mt19937 &gen) {
+    int expand[] = { (run_shapes<Ty,
+                                 Shape<1, 1, 1>, Shape<1, 7, 3>, Shape<3, 1, 5>, Shape<4, 4, 4>,
+                                 Shape<5, 5, 5>, Shape<7, 3, 2>, Shape<16, 16, 16>, Shape<17, 33, 9>,
+                                 Shape<40, 40, 40>, Shape<67, 29, 45>>(check, opt, gen), 0)... };
+    (void)expand;
+}
+
+void usage(const char *name) {
+    std::cout << "Usage: " << name << " [options]\n"
+        << "  --seed N     seed of random operands (default 1)\n"
+        << "  --iters N    random operands for every case (default 20)\n"
+        << "  --ulps N     allowed difference of floating point results (default 4)\n"
+        << "  --verbose    print every check" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--verbose") {
+            opt.verbose = true;
+        } else if ((arg == "--seed") && (i + 1 < argc)) {
+            opt.seed = static_cast<unsigned>(std::stoul(argv[++i]));
+        } else if ((arg == "--iters") && (i + 1 < argc)) {
+            opt.iters = std::stoul(argv[++i]);
+        } else if ((arg == "--ulps") && (i + 1 < argc)) {
+            opt.ulps = static_cast<unsigned>(std::stoul(argv[++i]));
+        } else {
+            usage(argv[0]);
+            return (arg == "-h") || (arg == "--help") ? 0 : 1;
+        }
+    }
+
+    std::cout << "Differential testing with seed " << opt.seed << std::endl;
+    std::mt19937 gen(opt.seed);
+    Checker check(opt);
+    run_types<Types<float, float>, Types<double, double>, Types<int, int>,
+              Types<float, double>, Types<int, double>>(check, opt, gen);
+
+    std::cout << check.checks() << " checks, " << check.failures() << " failures" << std::endl;
+    return check.failures() ? 1 : 0;
+}
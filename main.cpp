@@ -3,8 +3,21 @@
 #include "matrix.h"     // matrix "library"
 using namespace matrix; // use shortened names
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#ifdef __linux__
+ #include <sys/mman.h> // mincore()
+ #include <unistd.h>   // sysconf()
+#endif
 
 int main(int argc, char *argv[]) {
     std::cout << "[BEGIN TESTING]\n" << std::endl;
@@ -1612,6 +1625,36 @@ int main(int argc, char *argv[]) {
         if (!j19) {
             fails += " #J19 ";
         }
+        // Large matrices differing in one element, matrices sharing user memory
+        Matrix<int, 300, 300, MatrixDataStorage::HEAP> mh6(7);
+        Matrix<int, 300, 300, MatrixDataStorage::HEAP> mh7(7);
+        mh7.write()[300 * 300 - 1] = 8;
+        int mem6[4] = { 1, 2, 3, 4 };
+        Matrix<int, 2, 2, MatrixDataStorage::USER> mu6(mem6);
+        Matrix<int, 2, 2, MatrixDataStorage::USER> mu7(mem6);
+        if ((mh6 == mh7) || (mh6 != Matrix<int, 300, 300, MatrixDataStorage::HEAP>(7)) || (mu6 != mu7)) { // #J20
+            fails += " #J20 ";
+        }
+        // NaN is not equal to itself even in the same memory
+        double mem8[2] = { 1.0, std::nan("") };
+        Matrix<double, 1, 2, MatrixDataStorage::USER> mu8(mem8);
+        Matrix<double, 1, 2, MatrixDataStorage::USER> mu9(mem8);
+        if ((mu8 == mu9) || (mu8 == mu8)) { // #J21
+            fails += " #J21 ";
+        }
+        // Comparison with tolerances
+        const Matrix<double, 1, 3> ma1{ 1.0, 1e-12, -1e6 };
+        const Matrix<double, 1, 3> ma2{ 1.0 + 1e-10, -1e-12, -1e6 - 1e-4 };
+        const Matrix<float, 1, 2> ma3{ 1.0f, 0.0f };
+        const Matrix<float, 1, 2> ma4{ std::nextafter(std::nextafter(1.0f, 2.0f), 2.0f), -0.0f };
+        const Matrix<double, 1, 2> ma5{ std::numeric_limits<double>::infinity(), std::nan("") };
+        const Matrix<double, 1, 2> ma6{ std::numeric_limits<double>::infinity(), 0.0 };
+        const Matrix<double, 1, 2> ma7{ std::numeric_limits<double>::max(), 0.0 };
+        if (approx_equal(ma1, ma2) || !approx_equal(ma1, ma2, 1e-9, 1e-11) || approx_equal(ma1, ma2, 1e-9) || // #J22
+            approx_equal(ma3, ma4, 0.0f, 0.0f, 1) || !approx_equal(ma3, ma4, 0.0f, 0.0f, 2) ||
+            approx_equal(ma5, ma5) || !approx_equal(ma6, ma6) || approx_equal(ma6, ma7, 1.0, 1.0, 10)) {
+            fails += " #J22 ";
+        }
 
         std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
             << "(Comparison operators (eq and neq))" << std::endl;
@@ -1659,6 +1702,35 @@ int main(int argc, char *argv[]) {
             }
         }
 
+        // Test 4 (chain of multiplications in the optimal order)
+        constexpr size_t left = detail::chain_split<10, 100, 5, 50>(0, 2); // #K3
+        constexpr size_t right = detail::chain_split<50, 5, 100, 10>(0, 2);
+        constexpr size_t middle = detail::chain_split<40, 20, 30, 10, 30>(0, 3);
+        if ((left != 1) || (right != 0) || (middle != 2) || (detail::chain_split<40, 20, 30, 10, 30>(0, 2) != 0)) {
+            fails += " #K3 ";
+        }
+        Matrix<int, 4, 6> ch0;
+        Matrix<int, 6, 2> ch1;
+        Matrix<int, 2, 5> ch2;
+        Matrix<int, 5, 3> ch3;
+        for (size_t i = 0; i < 4 * 6; ++i) {
+            ch0.write()[i] = static_cast<int>(i % 7) - 3;
+        }
+        for (size_t i = 0; i < 6 * 2; ++i) {
+            ch1.write()[i] = static_cast<int>(i % 5) - 2;
+        }
+        for (size_t i = 0; i < 2 * 5; ++i) {
+            ch2.write()[i] = static_cast<int>(i % 3) - 1;
+        }
+        for (size_t i = 0; i < 5 * 3; ++i) {
+            ch3.write()[i] = static_cast<int>(i % 4) - 2;
+        }
+        if ((mul_chain(ch0, ch1, ch2, ch3) != mul(mul(ch0, ch1), mul(ch2, ch3))) || // #K4
+            (mul_chain(ch0, ch1, ch2, ch3) != mul(ch0, mul(ch1, mul(ch2, ch3)))) ||
+            (mul_chain(ch0, ch1) != mul(ch0, ch1)) || (mul_chain(aa, aa, aa, aa, aa, aa) != a6_)) {
+            fails += " #K4 ";
+        }
+
         std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
             << "(Matrix multiplication)" << std::endl;
     }
@@ -1715,10 +1787,1179 @@ int main(int argc, char *argv[]) {
             fails += " #L3 ";
         }
 
+        // Test 4 (exact determinant of integer matrix)
+        Matrix<int, 5, 5> m5 = {  1, -4, 2,  5,  7,
+                                  0,  0, 3,  5,  3,
+                                  3,  1, 7, -3, -2,
+                                 -1,  0, 5,  2,  4,
+                                  8,  9, 7,  1,  0 };
+        Matrix<int, 4, 4> m6 = {  3, -2,  1,  1,
+                                  6, -4,  2,  2,
+                                 -1,  1, -1,  1,
+                                  2, -1,  6, -3 };
+        if ((det(m5) != 6974) || (det(m6) != 0)) { // #L4
+            fails += " #L4 ";
+        }
+
+        // Test 5 (intermediate values overflow 64-bit integers)
+        const long long x = 3000000000LL;
+        Matrix<long long, 2, 2> m7 = { x, x - 1, x + 1, x };
+        long long det_m7 = 0;
+        if (!det(m7, det_m7) || (det_m7 != 1)) { // #L5
+            fails += " #L5 ";
+        }
+
+        // Test 6 (intermediate values overflow 128-bit integers)
+        const long long y = 1LL << 62;
+        Matrix<long long, 3, 3> m8 = { y, 1LL, 0LL, 1LL, y, 1LL, y + 1, y + 2, 1LL };
+        long long det_m8 = 0;
+        if (!det(m8, det_m8) || (det_m8 != -y)) { // #L6
+            fails += " #L6 ";
+        }
+
+        // Test 7 (determinant isn't representable)
+        Matrix<int, 2, 2> m9 = { 100000, 0, 0, 100000 };
+        Matrix<unsigned, 2, 2> m10 = { 1u, 2u, 3u, 4u };
+        int det_m9 = 0;
+        unsigned det_m10 = 0;
+        bool overflow = false;
+        try {
+            det(Matrix<int, 2, 2>{ 2000000000, 2000000000, -2000000000, 2000000000 });
+        } catch (const std::overflow_error &) {
+            overflow = true;
+        }
+        if (det(m9, det_m9) || det(m10, det_m10) || !overflow) { // #L7
+            fails += " #L7 ";
+        }
+
         std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
             << "(Determinant)" << std::endl;
     }
 
+    // Instrumentation counters
+    {
+        std::string fails;
+
+#ifdef MATRIX_STATS
+        // Heap allocation
+        reset_matrix_stats();
+        Matrix<int, 3, 3, MatrixDataStorage::HEAP> h0(1);
+        if ((matrix_stats(MatrixDataStorage::HEAP).allocations != 1) ||
+            (matrix_stats(MatrixDataStorage::HEAP).bytes_allocated != sizeof(int) * 3 * 3)) { // #N0
+            fails += " #N0 ";
+        }
+
+        // Deep copy allocates too
+        Matrix<int, 3, 3, MatrixDataStorage::HEAP> h1 = h0;
+        if ((matrix_stats(MatrixDataStorage::HEAP).copies != 1) ||
+            (matrix_stats(MatrixDataStorage::HEAP).allocations != 2)) { // #N1
+            fails += " #N1 ";
+        }
+
+        // Move doesn't allocate
+        Matrix<int, 3, 3, MatrixDataStorage::HEAP> h2 = std::move(h1);
+        if ((matrix_stats(MatrixDataStorage::HEAP).moves != 1) ||
+            (matrix_stats(MatrixDataStorage::HEAP).allocations != 2)) { // #N2
+            fails += " #N2 ";
+        }
+
+        // Type conversion is a copy as well
+        Matrix<double, 3, 3, MatrixDataStorage::HEAP> h3 = h0;
+        if ((matrix_stats(MatrixDataStorage::HEAP).conversions != 1) ||
+            (matrix_stats(MatrixDataStorage::HEAP).copies != 2)) { // #N3
+            fails += " #N3 ";
+        }
+
+        // Stack copies and moves
+        Matrix<int, 2, 2, MatrixDataStorage::STACK> s0(1);
+        reset_matrix_stats();
+        auto s1 = s0;
+        s1 = std::move(s0);
+        if ((matrix_stats(MatrixDataStorage::STACK).copies != 1) ||
+            (matrix_stats(MatrixDataStorage::STACK).moves != 1) || (matrix_stats().allocations != 0)) { // #N4
+            fails += " #N4 ";
+        }
+
+        // Storage of UNSPECIFIED matrix is accounted
+        reset_matrix_stats();
+        Matrix<int, 100, 100> x0(0);
+        if ((matrix_stats(MatrixDataStorage::HEAP).allocations != 1) ||
+            (matrix_stats(MatrixDataStorage::UNSPECIFIED).allocations != 0)) { // #N5
+            fails += " #N5 ";
+        }
+
+        // Deallocation
+        reset_matrix_stats();
+        {
+            Matrix<int, 3, 3, MatrixDataStorage::HEAP> t(0);
+        }
+        if (matrix_stats(MatrixDataStorage::HEAP).deallocations != 1) { // #N6
+            fails += " #N6 ";
+        }
+
+        // Assignment operators neither allocate nor copy
+        reset_matrix_stats();
+        h0 += h2;
+        h0 *= 2;
+        s1 -= s1;
+        MatrixStats hot = matrix_stats();
+        if (hot.allocations || hot.copies || hot.moves || hot.conversions) { // #N7
+            fails += " #N7 ";
+        }
+
+        // Reset
+        reset_matrix_stats();
+        if (matrix_stats(MatrixDataStorage::HEAP).allocations != 0) { // #N8
+            fails += " #N8 ";
+        }
+
+        // Analytical cost of library calls
+        Matrix<double, 2, 3, MatrixDataStorage::HEAP> c0(1);
+        Matrix<float, 3, 4, MatrixDataStorage::STACK> c1(1);
+        reset_matrix_stats();
+        auto c2 = mul(c0, c1);
+        if ((matrix_stats(MatrixDataStorage::HEAP).flops != 2 * 2 * 3 * 4) ||
+            (matrix_stats(MatrixDataStorage::HEAP).bytes_accessed != 6 * sizeof(double) + 12 * sizeof(float) + 8 * sizeof(double))) { // #N9
+            fails += " #N9 ";
+        }
+        reset_matrix_stats();
+        c2 += c2;
+        det(Matrix<double, 2, 2, MatrixDataStorage::STACK>(1.0));
+        if ((matrix_stats().flops != 8 + 6) || (det_cost<double, 2>().flops != 6)) { // #N10
+            fails += " #N10 ";
+        }
+#else
+        // Counters stay zero if "MATRIX_STATS" isn't defined
+        Matrix<int, 3, 3, MatrixDataStorage::HEAP> h0(1);
+        Matrix<int, 3, 3, MatrixDataStorage::HEAP> h1 = h0;
+        if (matrix_stats().allocations || matrix_stats().copies) { // #N0
+            fails += " #N0 ";
+        }
+#endif
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Instrumentation counters)" << std::endl;
+    }
+
+    // Tracing
+    {
+        std::string fails;
+
+#ifdef MATRIX_TRACE
+        // Library calls are recorded with their shapes, types and storages
+        matrix_trace_clear();
+        Matrix<double, 2, 3, MatrixDataStorage::HEAP> a(1.5);
+        Matrix<double, 3, 4, MatrixDataStorage::STACK> b(2);
+        auto c = mul(a, b);
+        c *= 2;
+        std::stringstream trace;
+        matrix_trace_dump(trace); // #O0
+        if ((trace.str().find("\"name\":\"mul\"") == std::string::npos) ||
+            (trace.str().find("\"m\":2,\"n\":3,\"p\":4,\"type\":\"double\",\"storage\":\"heap,stack\"") == std::string::npos) ||
+            (trace.str().find("\"name\":\"scale_assign\"") == std::string::npos)) {
+            fails += " #O0 ";
+        }
+
+        // Clearing forgets recorded calls
+        matrix_trace_clear();
+        trace.str("");
+        matrix_trace_dump(trace); // #O1
+        if (trace.str().find("\"name\"") != std::string::npos) {
+            fails += " #O1 ";
+        }
+#else
+        // Nothing is recorded if "MATRIX_TRACE" isn't defined
+        Matrix<int, 2, 2> a(1);
+        auto b = mul(a, a);
+        std::stringstream trace;
+        matrix_trace_dump(trace); // #O0
+        if (trace.str().find("\"name\"") != std::string::npos) {
+            fails += " #O0 ";
+        }
+#endif
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Tracing)" << std::endl;
+    }
+
+    // Cholesky factorization
+    {
+        std::string fails;
+
+        // Factor symmetric positive definite matrix: A = L * L^T
+        Matrix<double, 3, 3> a{ 4, 12, -16, 12, 37, -43, -16, -43, 98 };
+        auto c = cholesky(a); // #P0
+        if (!c.positive_definite() || (c.factor() != Matrix<double, 3, 3>{ 2, 0, 0, 6, 1, 0, -8, 5, 3 })) {
+            fails += " #P0 ";
+        }
+
+        // Determinant and its logarithm reuse the factor
+        if ((std::abs(c.det() - 36.0) > 1e-12) || (std::abs(c.log_det() - std::log(36.0)) > 1e-12)) { // #P1
+            fails += " #P1 ";
+        }
+
+        // Solve with one and several right-hand sides
+        Matrix<double, 3, 1> x{ 1, 2, 3 };
+        auto y = c.solve(mul(a, x)); // #P2
+        Matrix<int, 3, 2, MatrixDataStorage::HEAP> b{ 4, 12, 12, 37, -16, -43 };
+        Matrix<double, 3, 2, MatrixDataStorage::HEAP> z = c.solve(b); // #P3
+        const double *yarr = y.read();
+        const double *zarr = z.read();
+        if ((std::abs(yarr[0] - 1) > 1e-12) || (std::abs(yarr[1] - 2) > 1e-12) || (std::abs(yarr[2] - 3) > 1e-12)) {
+            fails += " #P2 ";
+        }
+        if ((std::abs(zarr[0] - 1) > 1e-12) || (std::abs(zarr[1]) > 1e-12) || (std::abs(zarr[2]) > 1e-12) ||
+            (std::abs(zarr[3] - 1) > 1e-12) || (std::abs(zarr[4]) > 1e-12) || (std::abs(zarr[5]) > 1e-12)) {
+            fails += " #P3 ";
+        }
+
+        // Not positive definite matrix is reported
+        Matrix<int, 2, 2> d{ 1, 2, 2, 1 };
+        if (cholesky(d).positive_definite()) { // #P4
+            fails += " #P4 ";
+        }
+
+        // Matrix of several blocks factored by several threads
+        const size_t n = 150;
+        Matrix<double, n, n> e;
+        double *earr = e.write();
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                earr[i * n + j] = (i == j) ? n : 1.0 / (1 + i + j);
+            }
+        }
+        set_matrix_threads(4);
+        auto f = cholesky(e);
+        set_matrix_threads(1);
+        const double *l = f.factor().read();
+        double error = 0;
+        for (size_t i = 0; i < n; ++i) { // #P5
+            for (size_t j = 0; j < n; ++j) {
+                double sum = 0;
+                for (size_t k = 0; k < n; ++k) {
+                    sum += l[i * n + k] * l[j * n + k];
+                }
+                error = std::max(error, std::abs(sum - earr[i * n + j]));
+            }
+        }
+        if (!f.positive_definite() || (error > 1e-10)) {
+            fails += " #P5 ";
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Cholesky factorization)" << std::endl;
+    }
+
+    // QR factorization and least squares
+    {
+        std::string fails;
+
+        // Factor matrix: A = Q * R, R is upper triangular
+        Matrix<double, 3, 2> a{ 3, 1, 0, 1, 4, 2 };
+        auto f = qr(a); // #Q0
+        auto qr_error = [](const double *x, const double *y, size_t size) { // maximal elementwise difference
+            double error = 0;
+            for (size_t i = 0; i < size; ++i) {
+                error = std::max(error, std::abs(x[i] - y[i]));
+            }
+            return error;
+        };
+        auto fr = f.r();
+        auto fq = f.q();
+        const double *r = fr.read();
+        if (!f.full_rank() || (std::abs(std::abs(r[0]) - 5) > 1e-12) || (r[2] != 0) || (qr_error(mul(fq, fr).read(), a.read(), 6) > 1e-12)) {
+            fails += " #Q0 ";
+        }
+
+        // Columns of Q are orthonormal
+        Matrix<double, 2, 3> qt;
+        const double *q = fq.read();
+        for (size_t i = 0; i < 3; ++i) {
+            for (size_t j = 0; j < 2; ++j) {
+                qt.write()[j * 3 + i] = q[i * 2 + j];
+            }
+        }
+        if (qr_error(mul(qt, fq).read(), Matrix<double, 2, 2>{ 1, 0, 0, 1 }.read(), 4) > 1e-12) { // #Q1
+            fails += " #Q1 ";
+        }
+
+        // Least squares fit of line y = 1 + 2 * x to points with symmetric noise
+        Matrix<int, 4, 2> x{ 1, 0, 1, 1, 1, 2, 1, 3 };
+        Matrix<int, 4, 1> y{ 2, 2, 6, 6 };
+        Matrix<double, 2, 1> c = qr(x).solve(y); // #Q2
+        if (qr_error(c.read(), Matrix<double, 2, 1>{ 1.6, 1.6 }.read(), 2) > 1e-12) {
+            fails += " #Q2 ";
+        }
+
+        // Tall matrix of several blocks, exact solution is recovered
+        const size_t m = 300;
+        const size_t n = 140;
+        Matrix<double, m, n> b;
+        double *barr = b.write();
+        for (size_t i = 0; i < m; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                barr[i * n + j] = ((i == j) ? 4.0 : 0.0) + std::sin(1.0 + i * n + j);
+            }
+        }
+        Matrix<double, n, 2> z;
+        for (size_t i = 0; i < 2 * n; ++i) {
+            z.write()[i] = std::cos(double(i));
+        }
+        set_matrix_threads(4);
+        auto g = qr(b);
+        auto w = g.solve(mul(b, z)); // #Q3
+        set_matrix_threads(1);
+        if (!g.full_rank() || (qr_error(w.read(), z.read(), n * 2) > 1e-9) || (qr_error(mul(g.q(), g.r()).read(), barr, m * n) > 1e-10)) {
+            fails += " #Q3 ";
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(QR factorization and least squares)" << std::endl;
+    }
+
+    // Linear systems and inverse
+    {
+        std::string fails;
+        auto max_error = [](const double *x, const double *y, size_t size) { // maximal elementwise difference
+            double error = 0;
+            for (size_t i = 0; i < size; ++i) {
+                error = std::max(error, std::abs(x[i] - y[i]));
+            }
+            return error;
+        };
+
+        // Solve system with several right-hand sides, pivoting is required
+        const Matrix<int, 3, 3> a{ 0, 2, 1, 1, 1, 1, 2, 1, 0 };
+        Matrix<int, 3, 2> b{ 7, 1, 6, 0, 4, 1 };
+        Matrix<double, 3, 2> x = solve(a, b); // #R0
+        if (max_error(x.read(), Matrix<double, 3, 2>{ 1, 0, 2, 1, 3, -1 }.read(), 6) > 1e-12) {
+            fails += " #R0 ";
+        }
+
+        // Inverse matrix
+        Matrix<double, 3, 3> c = inverse(a); // #R1
+        if (max_error(c.read(), (Matrix<double, 3, 3>{ -1, 1, 1, 2, -2, 1, -1, 4, -2 } / 3.0).read(), 9) > 1e-12) {
+            fails += " #R1 ";
+        }
+
+        // Factorization is reused for determinant and several solutions
+        auto f = lu(a); // #R2
+        if (f.singular() || (std::abs(f.det() - 3) > 1e-12) || (max_error(f.solve(b).read(), x.read(), 6) != 0)) {
+            fails += " #R2 ";
+        }
+
+        // Singular matrix is reported
+        if (!lu(Matrix<float, 2, 2>{ 1, 2, 2, 4 }).singular()) { // #R3
+            fails += " #R3 ";
+        }
+
+        // Matrix of several blocks inverted by several threads
+        const size_t n = 200;
+        Matrix<double, n, n> d;
+        Matrix<double, n, n> i(0.0);
+        for (size_t k = 0; k < n * n; ++k) {
+            d.write()[k] = std::sin(1.0 + double(k) * k);
+        }
+        for (size_t k = 0; k < n; ++k) {
+            i.write()[k * n + k] = 1;
+        }
+        set_matrix_threads(4);
+        auto e = mul(d, inverse(d)); // #R4
+        set_matrix_threads(1);
+        if (max_error(e.read(), i.read(), n * n) > 1e-10) {
+            fails += " #R4 ";
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Linear systems and inverse)" << std::endl;
+    }
+
+    // Mixed precision multiplication
+    {
+        std::string fails;
+
+        // Narrow integers are accumulated in wider type
+        Matrix<int8_t, 2, 64> a(static_cast<int8_t>(100));
+        Matrix<int8_t, 64, 3> b(static_cast<int8_t>(-100));
+        Matrix<int32_t, 2, 3> ab = mul(a, b, Accumulate<int32_t>()); // #S0
+        if (ab != Matrix<int32_t, 2, 3>(-640000)) {
+            fails += " #S0 ";
+        }
+        Matrix<int16_t, 3, 300> c(static_cast<int16_t>(1000));
+        Matrix<int16_t, 300, 1> d(static_cast<int16_t>(1000));
+        if (mul(c, d, Accumulate<int32_t>()) != Matrix<int32_t, 3, 1>(300000000)) { // #S1
+            fails += " #S1 ";
+        }
+
+        // Long float dot products are summed in double or compensated float
+        const size_t n = 4096;
+        Matrix<float, 1, n> e(1.0f);
+        Matrix<float, n, 2> f;
+        double exact[2] = { 0, 0 };
+        for (size_t i = 0; i < n; ++i) {
+            f.write()[i * 2] = 0.1f;
+            f.write()[i * 2 + 1] = 1.0f / (1 + i);
+            exact[0] += 0.1f;
+            exact[1] += 1.0f / (1 + i);
+        }
+        Matrix<float, 1, 2> g = mul(e, f, Accumulate<double, float>()); // #S2
+        Matrix<double, 1, 2> h = mul(e, f, Accumulate<double>());
+        if ((g.read()[0] != static_cast<float>(exact[0])) || (g.read()[1] != static_cast<float>(exact[1])) ||
+            (h.read()[0] != exact[0]) || (std::abs(h.read()[1] - exact[1]) > 1e-12)) {
+            fails += " #S2 ";
+        }
+        Matrix<float, 1, 2> k = mul(e, f, CompensatedAccumulate<float>()); // #S3
+        if ((std::abs(k.read()[0] - exact[0]) > exact[0] * 1e-7) || (std::abs(k.read()[1] - exact[1]) > exact[1] * 1e-7)) {
+            fails += " #S3 ";
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Mixed precision multiplication)" << std::endl;
+    }
+
+    // Half precision element types
+    {
+        std::string fails;
+
+        // Rounding to nearest even, overflow and subnormal numbers
+        if ((float16(1.0f).bits() != 0x3c00) || (float16(65504.0f).bits() != 0x7bff) || (float16(65520.0f).bits() != 0x7c00) ||
+            (float16(std::ldexp(1.0f, -24)).bits() != 0x0001) || (float16(1.0f + std::ldexp(1.0f, -11)).bits() != 0x3c00) ||
+            (float(float16(-2.5f)) != -2.5f) || (bfloat16(1.0f).bits() != 0x3f80) ||
+            (bfloat16(1.0f + std::ldexp(1.0f, -8)).bits() != 0x3f80) || (float(bfloat16(-3.0f)) != -3.0f)) { // #T0
+            fails += " #T0 ";
+        }
+
+        // Half precision matrices take half of memory and compute in float
+        Matrix<float16, 2, 2> a{ 1.5f, -2.0f, 0.25f, 4.0f };
+        Matrix<float16, 2, 2> b(float16(0.5f));
+        Matrix<float16, 2, 2> c = -a + b * 2 - a / float16(2); // #T1
+        if ((sizeof(a) != 4 * sizeof(uint16_t)) || (c != Matrix<float16, 2, 2>{ -1.25f, 4.0f, 0.625f, -5.0f })) {
+            fails += " #T1 ";
+        }
+        c += a; // #T2
+        c *= 2;
+        if ((c != Matrix<float16, 2, 2>{ 0.5f, 4.0f, 1.75f, -2.0f }) || (c == a)) {
+            fails += " #T2 ";
+        }
+
+        // Mixed arithmetic is done in the common type
+        const Matrix<float, 2, 2> d{ 1.0f, 2.0f, 3.0f, 4.0f };
+        Matrix<float, 2, 2> ad = a + d; // #T3
+        Matrix<float, 2, 2> mad = mul(a, d);
+        if ((ad != Matrix<float, 2, 2>{ 2.5f, 0.0f, 3.25f, 8.0f }) || (mad != Matrix<float, 2, 2>{ -4.5f, -5.0f, 12.25f, 16.5f })) {
+            fails += " #T3 ";
+        }
+
+        // Multiplication in half precision or with float accumulation
+        Matrix<bfloat16, 2, 2> e{ 1.0f, 2.0f, 3.0f, 4.0f };
+        Matrix<bfloat16, 2, 2> ee = mul(e, e); // #T4
+        Matrix<bfloat16, 2, 2> ef = mul(e, e, Accumulate<float, bfloat16>());
+        if ((ee != Matrix<bfloat16, 2, 2>{ 7.0f, 10.0f, 15.0f, 22.0f }) || (ef != ee)) {
+            fails += " #T4 ";
+        }
+
+        // Bulk conversions are the same as elementwise ones
+        Matrix<float, 5, 7> f;
+        for (size_t i = 0; i < 35; ++i) {
+            f.write()[i] = std::ldexp(std::sin(float(i)), int(i % 40) - 20);
+        }
+        const Matrix<float, 5, 7> &cf = f;
+        const Matrix<float16, 5, 7, MatrixDataStorage::HEAP> g(cf); // #T5
+        const Matrix<float, 5, 7> h(g);
+        const Matrix<bfloat16, 5, 7> k(cf);
+        const Matrix<float, 5, 7> l(k);
+        for (size_t i = 0; i < 35; ++i) {
+            if ((g.read()[i].bits() != float16(f.read()[i]).bits()) || (h.read()[i] != float(g.read()[i])) ||
+                (k.read()[i].bits() != bfloat16(f.read()[i]).bits()) || (l.read()[i] != float(k.read()[i]))) {
+                fails += " #T5 ";
+                break;
+            }
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Half precision element types)" << std::endl;
+    }
+
+    // Quantized matrices
+    {
+        std::string fails;
+
+        // Quantization keeps zero exact and restores values within a half of scale
+        const Matrix<float, 2, 4> a{ -1.0f, 0.0f, 0.5f, 2.0f, 10.0f, 20.0f, 0.0f, 5.0f };
+        auto qa = quantize(a); // #U0
+        auto ra = quantize<MatrixQuantization::PER_ROW>(a);
+        Matrix<float, 2, 4> da = qa.dequantize();
+        Matrix<float, 2, 4> dra = ra.dequantize();
+        bool close = (sizeof(qa.data()) == sizeof(Matrix<int8_t, 2, 4>)) && (std::abs(qa.scale() - 21.0f / 255) < 1e-6f) &&
+                     (std::abs(ra.scale(0) - 3.0f / 255) < 1e-6f) && (std::abs(ra.scale(1) - 20.0f / 255) < 1e-6f);
+        for (size_t i = 0; i < 8; ++i) {
+            close = close && (std::abs(da.read()[i] - a.read()[i]) <= qa.scale() / 2 + 1e-6f) &&
+                             (std::abs(dra.read()[i] - a.read()[i]) <= ra.scale(i / 4) / 2 + 1e-6f);
+        }
+        if (!close || (da.read()[1] != 0) || (dra.read()[6] != 0)) {
+            fails += " #U0 ";
+        }
+
+        // Quantized multiplication equals multiplication of dequantized matrices
+        const size_t m = 5;
+        const size_t n = 70;
+        const size_t p = 9;
+        Matrix<float, m, n> b;
+        Matrix<float, n, p> c;
+        for (size_t i = 0; i < m * n; ++i) {
+            b.write()[i] = std::sin(1.0f + i) * (1 + i / n);
+        }
+        for (size_t i = 0; i < n * p; ++i) {
+            c.write()[i] = std::cos(1.0f + i) + 0.5f;
+        }
+        auto qb = quantize<MatrixQuantization::PER_ROW>(b);
+        auto qc = quantize(c);
+        Matrix<float, m, p> bc = mul(qb, qc); // #U1
+        const Matrix<float, m, n> db = qb.dequantize();
+        const Matrix<float, n, p> dc = qc.dequantize();
+        Matrix<double, m, p> exact = mul(Matrix<double, m, n>(db), Matrix<double, n, p>(dc));
+        Matrix<float, m, p> approx = mul(b, c);
+        for (size_t i = 0; i < m * p; ++i) {
+            if ((std::abs(bc.read()[i] - exact.read()[i]) > 1e-3 * (1 + std::abs(exact.read()[i]))) ||
+                (std::abs(bc.read()[i] - approx.read()[i]) > 0.5f)) {
+                fails += " #U1 ";
+                break;
+            }
+        }
+
+        // Several panels and blocks of rows of the integer kernel, with partial ones
+        Matrix<float, 19, 37, MatrixDataStorage::HEAP> e;
+        Matrix<float, 37, 70, MatrixDataStorage::HEAP> f;
+        for (size_t i = 0; i < 19 * 37; ++i) {
+            e.write()[i] = std::sin(3.0f * i);
+        }
+        for (size_t i = 0; i < 37 * 70; ++i) {
+            f.write()[i] = std::cos(2.0f * i) - 0.25f;
+        }
+        auto qe = quantize(e);
+        auto qf = quantize(f);
+        const auto ef = mul(qe, qf); // #U2
+        const Matrix<double, 19, 37, MatrixDataStorage::HEAP> de = qe.dequantize();
+        const Matrix<double, 37, 70, MatrixDataStorage::HEAP> df = qf.dequantize();
+        const auto exact_ef = mul(de, df);
+        for (size_t i = 0; i < 19 * 70; ++i) {
+            if (std::abs(ef.read()[i] - exact_ef.read()[i]) > 1e-3 * (1 + std::abs(exact_ef.read()[i]))) {
+                fails += " #U2 ";
+                break;
+            }
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Quantized matrices)" << std::endl;
+    }
+
+    // Strassen-Winograd multiplication
+    {
+        std::string fails;
+        set_matrix_strassen_crossover(4); // several levels of recursion with odd sizes
+
+        // Integer products are exact
+        const size_t m = 37;
+        const size_t n = 41;
+        const size_t p = 35;
+        Matrix<long long, m, n, MatrixDataStorage::HEAP> a;
+        Matrix<long long, n, p, MatrixDataStorage::HEAP> b;
+        for (size_t i = 0; i < m * n; ++i) {
+            a.write()[i] = static_cast<long long>(i * 7 % 23) - 11;
+        }
+        for (size_t i = 0; i < n * p; ++i) {
+            b.write()[i] = static_cast<long long>(i * 5 % 19) - 9;
+        }
+        if (mul(a, b, Strassen()) != mul(a, b)) { // #V0
+            fails += " #V0 ";
+        }
+
+        // Floating point products are close to the blocked kernel
+        Matrix<double, 64, 64, MatrixDataStorage::HEAP> c;
+        for (size_t i = 0; i < 64 * 64; ++i) {
+            c.write()[i] = std::sin(1.0 + i);
+        }
+        const Matrix<double, 64, 64, MatrixDataStorage::HEAP> fast = mul(c, c, Strassen()); // #V1
+        const Matrix<double, 64, 64, MatrixDataStorage::HEAP> blocked = mul(c, c);
+        for (size_t i = 0; i < 64 * 64; ++i) {
+            if (std::abs(fast.read()[i] - blocked.read()[i]) > 1e-12) {
+                fails += " #V1 ";
+                break;
+            }
+        }
+
+        // The policy selects Strassen-Winograd for floating point matrices only
+        set_matrix_mul_policy(MatrixMulPolicy::STRASSEN); // #V2
+        const Matrix<double, 64, 64, MatrixDataStorage::HEAP> automatic = mul(c, c);
+        Matrix<double, 3, 3> small = mul(Matrix<double, 3, 3>(1.0), Matrix<double, 3, 3>(2.0));
+        if ((matrix_mul_policy() != MatrixMulPolicy::STRASSEN) || (matrix_strassen_crossover() != 4) ||
+            (automatic != fast) || (mul(a, b) != mul(a, b, Strassen())) || (small != Matrix<double, 3, 3>(6.0))) {
+            fails += " #V2 ";
+        }
+        set_matrix_mul_policy(MatrixMulPolicy::BLOCKED);
+        set_matrix_strassen_crossover(0);
+        if ((mul(c, c) != blocked) || (matrix_strassen_crossover() == 4)) {
+            fails += " #V2 ";
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Strassen-Winograd multiplication)" << std::endl;
+    }
+
+    // Constant expressions
+    {
+        std::string fails;
+#if defined(MATRIX_STATS) || defined(MATRIX_TRACE)
+ #define CONSTEXPR_ const // instrumented functions aren't usable in constant expressions
+#else
+ #define CONSTEXPR_ constexpr
+#endif
+
+        // Matrices on stack are created and copied at compile time
+        CONSTEXPR_ Matrix<int, 3, 3> a{ 2, 0, 1,
+                                        1, 3, 2,
+                                        1, 1, 2 }; // #W0
+        CONSTEXPR_ Matrix<int, 2, 2, MatrixDataStorage::STACK> b(7);
+        CONSTEXPR_ Matrix<int, 2, 3> c{ 1, 2 }; // the rest is zero
+        CONSTEXPR_ Matrix<double, 3, 3> ad(a);
+        CONSTEXPR_ Matrix<int, 2, 2> z;
+        if ((a.read()[5] != 2) || (b.read()[3] != 7) || (c.read()[1] != 2) || (c.read()[5] != 0) ||
+            (ad.read()[4] != 3.0) || (z.read()[3] != 0)) {
+            fails += " #W0 ";
+        }
+
+        // Arithmetic operators, multiplication and comparisons
+        CONSTEXPR_ auto aa = mul(a, a); // #W1
+        CONSTEXPR_ auto expr = a + aa - (-a) * 2 / 1;
+        CONSTEXPR_ Matrix<double, 2, 2> rot{ 0.0, -1.0, 1.0, 0.0 };
+        CONSTEXPR_ bool cycle = (mul(rot, mul(rot, mul(rot, rot))) == Matrix<double, 2, 2>{ 1.0, 0.0, 0.0, 1.0 }) &&
+                                (mul(rot, rot) != Matrix<double, 2, 2>{ 1.0, 0.0, 0.0, 1.0 });
+        if ((aa.read()[0] != 5) || (aa.read()[8] != 7) || (expr.read()[0] != 11) || !cycle || (aa != mul(a, a))) {
+            fails += " #W1 ";
+        }
+
+        // Determinant
+        CONSTEXPR_ int det_a = det(a); // #W2
+        CONSTEXPR_ double det_ad = det(ad);
+        CONSTEXPR_ Matrix<long long, 2, 2> big{ 4000000000LL, 3LL, 5000000000LL, 7LL };
+        CONSTEXPR_ long long det_big = det(big);
+        if ((det_a != 6) || (std::abs(det_ad - 6) > 1e-12) || (det_big != 13000000000LL)) {
+            fails += " #W2 ";
+        }
+
+#undef CONSTEXPR_
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Constant expressions)" << std::endl;
+    }
+
+    // Vectors
+    {
+        std::string fails;
+
+        // Matrix by vector
+        const Matrix<int, 3, 4> a{ 1, 2, 3, 4,
+                                   0, -1, 2, 5,
+                                   7, 0, 0, -2 };
+        const Vector<int, 4> x{ 1, -1, 2, 3 };
+        const RowVector<int, 3> xr{ 2, 0, -1 };
+        const Vector<int, 3> ax = gemv(a, x); // #X0
+        if ((ax != mul(a, x)) || (ax != Vector<int, 3>{ 17, 20, 1 })) {
+            fails += " #X0 ";
+        }
+
+        // Row vector by matrix
+        const RowVector<int, 4> xa = gevm(xr, a); // #X1
+        if ((xa != mul(xr, a)) || (xa != RowVector<int, 4>{ -5, 4, 6, 10 })) {
+            fails += " #X1 ";
+        }
+
+        // Large matrices are split between threads, batched products equal separate ones
+        const size_t m = 301;
+        const size_t n = 517;
+        const size_t k = 5;
+        Matrix<double, m, n> b;
+        Matrix<double, k, n> vs;
+        for (size_t i = 0; i < m * n; ++i) {
+            b.write()[i] = std::sin(1.0 + i);
+        }
+        for (size_t i = 0; i < k * n; ++i) {
+            vs.write()[i] = std::cos(1.0 + i);
+        }
+        const Vector<double, n> v(vs.read() + 2 * n);
+        const Vector<double, m> bv = gemv(b, v); // #X2
+        const Matrix<double, k, m> bvs = gemv_batched(b, vs);
+        const Matrix<double, m, 1> exact = mul(b, v);
+        set_matrix_threads(3);
+        const Vector<double, m> bv3 = gemv(b, v);
+        const RowVector<double, n> vb3 = gevm(RowVector<double, m>(bv.read()), b);
+        set_matrix_threads(1);
+        const RowVector<double, n> vb = gevm(RowVector<double, m>(bv.read()), b);
+        if ((bv3 != bv) || (vb3 != vb) || (RowVector<double, m>(bvs.read() + 2 * m) != RowVector<double, m>(bv.read()))) {
+            fails += " #X2 ";
+        }
+        for (size_t i = 0; i < m; ++i) {
+            if (std::abs(bv.read()[i] - exact.read()[i]) > 1e-12) {
+                fails += " #X2 ";
+                break;
+            }
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Vectors)" << std::endl;
+    }
+
+    // Fused updates
+    {
+        std::string fails;
+
+        // Product is added to a matrix in place
+        const Matrix<int, 2, 3> a{ 1, 2, 3,
+                                   4, 5, 6 };
+        const Matrix<int, 3, 2> b{ 1, -1,
+                                   0, 2,
+                                   -2, 1 };
+        Matrix<int, 2, 2> c{ 1, 2, 3, 4 };
+        const Matrix<int, 2, 2> c0 = c;
+        gemm(2, a, b, 3, c); // #Y0
+        if (c != mul(a, b) * 2 + c0 * 3) {
+            fails += " #Y0 ";
+        }
+
+        // Result in user memory, zero "beta" overwrites NaN
+        double mem[4] = { std::nan(""), std::nan(""), std::nan(""), std::nan("") };
+        Matrix<double, 2, 2, MatrixDataStorage::USER> cu(mem);
+        gemm(0.5, a, b, 0, cu); // #Y1
+        const Matrix<double, 2, 2> ab = mul(a, b);
+        const Matrix<double, 2, 2> half = ab * 0.5;
+        if ((cu != half) || (mem[3] != half.read()[3])) {
+            fails += " #Y1 ";
+        }
+
+        // Scaled vectors are added in place
+        const Vector<double, 5> x{ 1.0, 2.0, 3.0, 4.0, 5.0 };
+        Vector<double, 5> y{ 0.5, 0.5, 0.5, 0.5, 0.5 };
+        axpy(2, x, y); // #Y2
+        Vector<double, 5> z{ 1.0, std::nan(""), 1.0, 1.0, 1.0 };
+        scale_add(-1, x, 0, z);
+        Vector<double, 5> w(1.0);
+        scale_add(0.5, x, 4, w);
+        if ((y != Vector<double, 5>{ 2.5, 4.5, 6.5, 8.5, 10.5 }) || (z != -x) || (w != Vector<double, 5>{ 4.5, 5.0, 5.5, 6.0, 6.5 })) {
+            fails += " #Y2 ";
+        }
+
+#ifdef MATRIX_STATS
+        // Large heap matrices are updated without allocations
+        Matrix<float, 300, 300, MatrixDataStorage::HEAP> big(1.0f);
+        Matrix<float, 300, 300, MatrixDataStorage::HEAP> acc(2.0f);
+        reset_matrix_stats();
+        gemm(1.0f, big, big, 1.0f, acc); // #Y3
+        axpy(2.0f, big, acc);
+        scale_add(1.0f, big, 0.5f, acc);
+        if ((matrix_stats().allocations != 0) || (matrix_stats().copies != 0) || (acc.read()[7] != 153.0f)) {
+            fails += " #Y3 ";
+        }
+#endif
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Fused updates)" << std::endl;
+    }
+
+    // Reductions
+    {
+        std::string fails;
+
+        // Sums, inner product and trace of integer matrices are exact
+        const Matrix<int, 3, 3> a{ 1, -2, 3,
+                                   -4, 5, -6,
+                                   7, -8, 9 };
+        if ((sum(a) != 5) || (dot(a, a) != 285) || (trace(a) != 15) || (sum(a, Accumulate<long long>()) != 5LL)) { // #Z0
+            fails += " #Z0 ";
+        }
+
+        // Norms
+        if ((norm_l1(a) != 18.0) || (norm_linf(a) != 24.0) || (std::abs(norm_frobenius(a) - std::sqrt(285.0)) > 1e-12)) { // #Z1
+            fails += " #Z1 ";
+        }
+
+        // Row and column reductions
+        if ((sum_rows(a) != Vector<int, 3>{ 2, -5, 8 }) || (sum_columns(a) != RowVector<int, 3>{ 4, -5, 6 }) ||
+            (min_rows(a) != Vector<int, 3>{ -2, -6, -8 }) || (max_rows(a) != Vector<int, 3>{ 3, 5, 9 }) ||
+            (min_columns(a) != RowVector<int, 3>{ -4, -8, -6 }) || (max_columns(a) != RowVector<int, 3>{ 7, 5, 9 })) { // #Z2
+            fails += " #Z2 ";
+        }
+
+        // Minimum and maximum with positions skip NaN, the first one is found
+        const Matrix<double, 2, 3> b{ std::nan(""), 2.0, -1.0,
+                                      5.0, -1.0, 5.0 };
+        const MatrixExtremum<double> lo = min(b); // #Z3
+        const MatrixExtremum<double> hi = max(b);
+        const Matrix<double, 1, 2> nans(std::nan(""));
+        if ((lo.value != -1.0) || (lo.row != 0) || (lo.column != 2) ||
+            (hi.value != 5.0) || (hi.row != 1) || (hi.column != 0) || !std::isnan(max(nans).value)) {
+            fails += " #Z3 ";
+        }
+
+        // Long float sums are accurate and don't depend on the number of threads
+        Matrix<float, 1000, 1000, MatrixDataStorage::HEAP> c(0.1f);
+        c.write()[123457] = -7.0f;
+        const size_t threads = matrix_threads();
+        set_matrix_threads(1);
+        const float s1 = sum(c); // #Z4
+        const MatrixExtremum<float> m1 = min(c);
+        set_matrix_threads(4);
+        const float s4 = sum(c);
+        const MatrixExtremum<float> m4 = min(c);
+        set_matrix_threads(threads);
+        const double exact = 999999 * static_cast<double>(0.1f) - 7.0;
+        if ((s1 != s4) || (std::abs(s1 - exact) > 1e-6 * exact) || (std::abs(sum(c, Accumulate<double>()) - exact) > 1e-6) ||
+            (m1.row != 123) || (m1.column != 457) || (m4.row != 123) || (m4.column != 457) ||
+            (std::abs(sum_columns(c).read()[457] - (999 * 0.1 - 7.0)) > 1e-4)) {
+            fails += " #Z4 ";
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Reductions)" << std::endl;
+    }
+
+    // Elementwise functions
+    {
+        std::string fails;
+
+        // Lambdas are applied to elements, the result type is returned by the lambda
+        const Matrix<int, 2, 3> a{ -1, 2, -3,
+                                   4, -5, 6 };
+        const Matrix<double, 2, 3, MatrixDataStorage::HEAP> b(0.5);
+        const Matrix<int, 2, 3> c = map(a, [](int x) { return std::abs(x); }); // #a0
+        const Matrix<double, 2, 3> d = zip(a, b, [](int x, double y) { return x * y; });
+        if ((c != Matrix<int, 2, 3>{ 1, 2, 3, 4, 5, 6 }) || (d != Matrix<double, 2, 3>{ -0.5, 1.0, -1.5, 2.0, -2.5, 3.0 })) {
+            fails += " #a0 ";
+        }
+
+        // Elements are replaced in place
+        Matrix<float, 100, 100, MatrixDataStorage::HEAP> e(2.0f);
+        e.write()[9999] = -1.0f;
+        apply(apply(e, [](float x) { return x * x; }), [](float x) { return std::max(x, 3.0f); }); // #a1
+        if ((e.read()[0] != 4.0f) || (e.read()[9999] != 3.0f)) {
+            fails += " #a1 ";
+        }
+
+        // Approximations of elementary functions are close to the standard ones
+        float worst = 0.0f;
+        for (int i = -2000; i <= 2000; ++i) {
+            const float x = i * 0.01f;
+            const float ax = std::abs(x) + 0.001f;
+            worst = std::max(worst, std::abs(approx_exp(x) - std::exp(x)) / std::exp(x)); // #a2
+            worst = std::max(worst, std::abs(approx_log(ax) - std::log(ax)) / std::max(std::abs(std::log(ax)), 1e-30f));
+            worst = std::max(worst, std::abs(approx_tanh(x) - std::tanh(x)) / std::max(std::abs(std::tanh(x)), 1e-30f));
+            worst = std::max(worst, std::abs(approx_sqrt(ax) - std::sqrt(ax)) / std::sqrt(ax));
+        }
+        for (const float x : { 1e-30f, -1e-6f, 1e-4f, 0.0123f, -0.5499f, 0.5501f }) {
+            worst = std::max(worst, std::abs(approx_tanh(x) - std::tanh(x)) / std::abs(std::tanh(x)));
+        }
+        if (worst > 4 * std::numeric_limits<float>::epsilon()) {
+            fails += " #a2 ";
+        }
+
+        // Special values
+        const double inf = std::numeric_limits<double>::infinity();
+        if ((approx_exp(-inf) != 0.0) || (approx_exp(1000.0) != inf) || (approx_log(0.0) != -inf) ||
+            !std::isnan(approx_log(-1.0)) || !std::isnan(approx_sqrt(-1.0)) || (approx_sqrt(inf) != inf) ||
+            (approx_tanh(-inf) != -1.0) || !std::isnan(approx_exp(std::nan(""))) ||
+            (std::abs(approx_sqrt(1e-310) - std::sqrt(1e-310)) > 1e-170) || (std::abs(approx_log(1e-310) - std::log(1e-310)) > 1e-12)) { // #a3
+            fails += " #a3 ";
+        }
+
+        // Matrix overloads, integer matrices give double results
+        const Matrix<int, 1, 3> f{ 1, 4, 9 };
+        const Matrix<double, 1, 3> g = approx_sqrt(f); // #a4
+        const Matrix<double, 1, 3> h = approx_log(approx_exp(f));
+        if ((g != Matrix<double, 1, 3>{ 1.0, 2.0, 3.0 }) || (std::abs(h.read()[2] - 9.0) > 1e-14) ||
+            (std::abs(approx_tanh(f).read()[0] - std::tanh(1.0)) > 1e-15)) {
+            fails += " #a4 ";
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Elementwise functions)" << std::endl;
+    }
+
+    // Memoization
+    {
+        std::string fails;
+
+        // Hashes depend on contents and shape
+        Matrix<double, 40, 50, MatrixDataStorage::HEAP> a(1.5);
+        Matrix<double, 40, 50> b(1.5);
+        const uint64_t ha = hash(a); // #b0
+        a.write()[1999] = 2.5;
+        if ((ha != hash(b)) || (ha == hash(a)) || (hash(Matrix<double, 50, 40>(1.5)) == ha) ||
+            (hash(Matrix<std::string, 1, 2>{ "a", "b" }) != hash(Matrix<std::string, 1, 2>{ "a", "b" }))) {
+            fails += " #b0 ";
+        }
+
+        // Disabled cache computes the results
+        clear_matrix_cache();
+        const Matrix<int, 3, 3> c{ 2, 0, 1,
+                                   1, 3, 0,
+                                   0, 1, 4 };
+        if ((det(c, Memoize()) != 25) || (matrix_cache_stats().misses != 0)) { // #b1
+            fails += " #b1 ";
+        }
+
+        // Repeated operations are found in the cache
+        const size_t capacity = matrix_cache_capacity();
+        set_matrix_cache_capacity(1 << 20);
+        const int d0 = det(c, Memoize()); // #b2
+        const int d1 = det(c, Memoize());
+        const Matrix<int, 3, 3> p0 = mul(c, c, Memoize());
+        const Matrix<int, 3, 3> p1 = mul(c, c, Memoize());
+        const Matrix<double, 3, 3> p2 = mul(Matrix<double, 3, 3>(c), c, Memoize());
+        if ((d0 != 25) || (d1 != 25) || (p0 != mul(c, c)) || (p1 != p0) || (p2 != mul(c, c)) ||
+            (matrix_cache_stats().hits != 2) || (matrix_cache_stats().misses != 3) || (matrix_cache_stats().entries != 3)) {
+            fails += " #b2 ";
+        }
+
+        // The least recently used results are evicted to fit the capacity
+        set_matrix_cache_capacity((40 * 50 + 50 * 40 + 40 * 40) * sizeof(double));
+        const Matrix<double, 40, 40, MatrixDataStorage::HEAP> aat = mul(a, Matrix<double, 50, 40, MatrixDataStorage::HEAP>(0.5), Memoize()); // #b3
+        const MatrixCacheStats stats = matrix_cache_stats();
+        if ((stats.entries != 1) || (stats.evictions != 3) || (stats.bytes > matrix_cache_capacity()) ||
+            (aat != mul(a, Matrix<double, 50, 40, MatrixDataStorage::HEAP>(0.5)))) {
+            fails += " #b3 ";
+        }
+        set_matrix_cache_capacity(capacity);
+        clear_matrix_cache();
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Memoization)" << std::endl;
+    }
+
+    // Shared storage
+    {
+        std::string fails;
+
+        // Copies share the data
+        Matrix<double, 40, 50, MatrixDataStorage::SHARED> a(1.5);
+        const Matrix<double, 40, 50, MatrixDataStorage::SHARED> b = a; // #c0
+        Matrix<double, 40, 50, MatrixDataStorage::SHARED> c;
+        c = b;
+        if ((b.read() != a.read()) || (c.read() != a.read()) || (c.read()[1999] != 1.5) || (c != a)) {
+            fails += " #c0 ";
+        }
+
+        // Write to a shared matrix copies the data, the last owner writes in place
+        c.write()[0] = 2.5; // #c1
+        const double *own = c.read();
+        c.write()[1] = 3.5;
+        if ((c.read() == a.read()) || (c.read() != own) || (a.read()[0] != 1.5) || (b.read() != a.read()) ||
+            (c.read()[0] != 2.5) || (c.read()[1] != 3.5) || (c.read()[1999] != 1.5)) {
+            fails += " #c1 ";
+        }
+
+        // Operations keep the storage unless mixed with another one
+        Matrix<double, 40, 50, MatrixDataStorage::SHARED> d = a;
+        d *= 2.0; // #c2
+        const auto e = a + b;
+        const Matrix<double, 40, 50, MatrixDataStorage::HEAP> h = a;
+        const auto f = a - h;
+        if (!std::is_same<std::decay_t<decltype(e)>, Matrix<double, 40, 50, MatrixDataStorage::SHARED>>::value ||
+            !std::is_same<std::decay_t<decltype(f)>, Matrix<double, 40, 50, MatrixDataStorage::HEAP>>::value ||
+            (d != e) || (d.read() == a.read()) || (a.read()[0] != 1.5) || (f != Matrix<double, 40, 50>(0.0)) ||
+            (Matrix<int, 40, 50, MatrixDataStorage::SHARED>(b) != Matrix<int, 40, 50>(1))) {
+            fails += " #c2 ";
+        }
+
+        // Fan-out to several threads, one of them writes to its copy
+        std::vector<double> sums(4);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < sums.size(); ++t) {
+            threads.emplace_back([&sums, &a, t]() { // #c3
+                Matrix<double, 40, 50, MatrixDataStorage::SHARED> copy = a;
+                if (t == 0) {
+                    copy *= 2.0;
+                }
+                sums[t] = sum(copy);
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        if ((sums[0] != 6000.0) || (sums[1] != 3000.0) || (sums[3] != 3000.0) || (a.read()[0] != 1.5)) {
+            fails += " #c3 ";
+        }
+
+#ifdef MATRIX_STATS
+        // Copies count references instead of allocating
+        reset_matrix_stats();
+        Matrix<double, 40, 50, MatrixDataStorage::SHARED> g = a;
+        g = c;
+        const MatrixStats shared = matrix_stats(MatrixDataStorage::SHARED);
+        g.write(); // #c4
+        if ((shared.shares != 2) || (shared.allocations != 0) || (shared.copies != 0) ||
+            (matrix_stats(MatrixDataStorage::SHARED).copies != 1) || (matrix_stats(MatrixDataStorage::SHARED).allocations != 1)) {
+            fails += " #c4 ";
+        }
+#endif
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Shared storage)" << std::endl;
+    }
+
+    // Bulk copies and fills
+    {
+        std::string fails;
+
+        // Large fill of user memory, unaligned and with odd size
+        constexpr size_t rows = 1023, cols = 2051;
+        std::vector<float> mem(rows * cols + 2, -1.0f);
+        const Matrix<float, rows, cols, MatrixDataStorage::USER> u(mem.data() + 1, 2.5); // #d0
+        if ((mem[0] != -1.0f) || (mem[rows * cols + 1] != -1.0f) ||
+            (std::count(mem.begin() + 1, mem.end() - 1, 2.5f) != static_cast<long>(rows * cols))) {
+            fails += " #d0 ";
+        }
+
+        // Copies of the same type and conversions
+        Matrix<int, 30, 70, MatrixDataStorage::HEAP> a;
+        for (size_t i = 0; i < 30 * 70; ++i) {
+            a.write()[i] = static_cast<int>(i) - 1000;
+        }
+        const Matrix<int, 30, 70, MatrixDataStorage::HEAP> b = a; // #d1
+        const Matrix<double, 30, 70, MatrixDataStorage::HEAP> c = a;
+        const Matrix<float16, 30, 70, MatrixDataStorage::HEAP> h = Matrix<float, 30, 70, MatrixDataStorage::HEAP>(c);
+        const Matrix<double, 30, 70, MatrixDataStorage::HEAP> z(0);
+        bool same = true;
+        for (size_t i = 0; i < 30 * 70; ++i) {
+            same &= (b.read()[i] == a.read()[i]) && (c.read()[i] == a.read()[i]) &&
+                    (static_cast<float>(h.read()[i]) == a.read()[i]) && (z.read()[i] == 0.0);
+        }
+        if (!same) {
+            fails += " #d1 ";
+        }
+
+        // Elements which aren't trivially copyable
+        const Matrix<std::string, 2, 600, MatrixDataStorage::HEAP> s(std::string(40, 'x'));
+        Matrix<std::string, 2, 600, MatrixDataStorage::HEAP> t = s; // #d2
+        t.write()[0] += "y";
+        if ((s.read()[1199] != std::string(40, 'x')) || (t.read()[1199] != s.read()[1199]) || (s.read()[0] == t.read()[0])) {
+            fails += " #d2 ";
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Bulk copies and fills)" << std::endl;
+    }
+
+    // Uninitialized and zeroed matrices
+    {
+        std::string fails;
+
+        // Uninitialized matrices are usable after their elements are written
+        auto a = Matrix<int, 3, 3, MatrixDataStorage::STACK>::uninitialized(); // #e0
+        auto b = Matrix<int, 30, 30, MatrixDataStorage::HEAP>::uninitialized();
+        auto c = Matrix<double, 3, 3>::uninitialized();
+        const auto d = Matrix<std::string, 2, 2, MatrixDataStorage::SHARED>::uninitialized();
+        for (size_t i = 0; i < 3 * 3; ++i) {
+            a.write()[i] = static_cast<int>(i);
+            c.write()[i] = 0.5 * i;
+        }
+        for (size_t i = 0; i < 30 * 30; ++i) {
+            b.write()[i] = 1;
+        }
+        const Matrix<double, 3, 3> e = a;
+        if ((a != Matrix<int, 3, 3>{ 0, 1, 2, 3, 4, 5, 6, 7, 8 }) || (c != e / 2) || (sum(b) != 900) ||
+            (d != Matrix<std::string, 2, 2>())) {
+            fails += " #e0 ";
+        }
+
+        // Zero matrices are allocated as zeroed memory
+        const Matrix<double, 4096, 4096, MatrixDataStorage::HEAP> z(0); // #e1
+        const Matrix<int, 4096, 4096> zi(0.0);
+        const Matrix<double, 30, 30, MatrixDataStorage::HEAP> nz(-0.0);
+        if ((z.read()[0] != 0.0) || (z.read()[4096 * 4096 - 1] != 0.0) || (zi.read()[4096 * 2048] != 0) ||
+            (z != Matrix<double, 4096, 4096, MatrixDataStorage::HEAP>(0.0)) || !std::signbit(nz.read()[899])) {
+            fails += " #e1 ";
+        }
+
+        // Heap memory is aligned for over-aligned elements
+        struct alignas(64) Wide { float x[16]; };
+        const auto aligned = [](const void *p) { return reinterpret_cast<uintptr_t>(p) % 64 == 0; };
+        for (int i = 0; i < 8; ++i) {
+            const Matrix<Wide, 3, 3, MatrixDataStorage::HEAP> w; // #e2
+            const auto uw = Matrix<Wide, 3, 3, MatrixDataStorage::HEAP>::uninitialized();
+            const Matrix<Wide, 3, 3, MatrixDataStorage::SHARED> sw;
+            const std::vector<char> shift(i * 8 + 1); // moves following blocks of the allocator
+            if (!aligned(w.read()) || !aligned(uw.read()) || !aligned(sw.read())) {
+                fails += " #e2 ";
+                break;
+            }
+        }
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Uninitialized and zeroed matrices)" << std::endl;
+    }
+
+    // Allocation policies
+    {
+        std::string fails;
+        using P = MatrixAllocationPolicy;
+
+        // Default allocations
+        const Matrix<double, 512, 1024, MatrixDataStorage::HEAP> a(1.5); // #f0
+        if ((matrix_allocation_policy() != P::DEFAULT) || (a.allocation_policy() != P::DEFAULT)) {
+            fails += " #f0 ";
+        }
+
+        // Requested policies are applied to large matrices or fall back
+        const P policies[] = { P::TRANSPARENT_HUGE_PAGES, P::EXPLICIT_HUGE_PAGES, P::INTERLEAVE, P::FIRST_TOUCH };
+        for (const P policy : policies) {
+            set_matrix_allocation_policy(policy);
+            Matrix<double, 512, 1024, MatrixDataStorage::HEAP> b(1.5); // #f1
+            const Matrix<double, 512, 1024, MatrixDataStorage::HEAP> z(0);
+            const Matrix<double, 8, 8, MatrixDataStorage::HEAP> s(1.5);
+            const Matrix<std::string, 512, 1024, MatrixDataStorage::HEAP> t;
+            const P applied = b.allocation_policy();
+            const bool fallback = (applied == P::DEFAULT) ||
+                                  ((policy == P::EXPLICIT_HUGE_PAGES) && (applied == P::TRANSPARENT_HUGE_PAGES));
+            b.write()[512 * 1024 - 1] = 2.5;
+            const Matrix<double, 512, 1024, MatrixDataStorage::HEAP> c = b;
+            const Matrix<double, 512, 1024, MatrixDataStorage::HEAP> m = std::move(b);
+            if (((applied != policy) && !fallback) || (m.allocation_policy() != applied) ||
+                (s.allocation_policy() != P::DEFAULT) || (t.allocation_policy() != P::DEFAULT) ||
+                (sum(z) != 0.0) || (c != m) || (sum(c) != 1.5 * 512 * 1024 + 1.0)) {
+                fails += " #f1 ";
+                break;
+            }
+        }
+
+        // Pages are touched by chunks of rows of parallel kernels: every page of
+        // a zero matrix is resident before its elements are written (placement
+        // on NUMA nodes isn't checked, threads aren't pinned to processors)
+        const size_t threads = matrix_threads();
+        set_matrix_threads(3);
+        set_matrix_allocation_policy(P::FIRST_TOUCH);
+        const Matrix<double, 513, 1024, MatrixDataStorage::HEAP> d(0.5);
+        const Matrix<double, 1024, 511, MatrixDataStorage::HEAP> e(2.0);
+        const Matrix<double, 513, 511, MatrixDataStorage::HEAP> f = mul(d, e); // #f2
+        const Matrix<double, 1001, 700, MatrixDataStorage::HEAP> g(0);
+        bool resident = true;
+#ifdef __linux__
+        if (g.allocation_policy() == P::FIRST_TOUCH) {
+            const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            std::vector<unsigned char> pages((sizeof(double) * 1001 * 700 + page - 1) / page);
+            void *mem = const_cast<double*>(g.read());
+            resident = (mincore(mem, sizeof(double) * 1001 * 700, pages.data()) == 0) &&
+                       std::all_of(pages.begin(), pages.end(), [](unsigned char p) { return (p & 1) != 0; });
+        }
+#endif
+        if ((f != Matrix<double, 513, 511, MatrixDataStorage::HEAP>(1024.0)) || (d.allocation_policy() != e.allocation_policy()) ||
+            !resident || (sum(g) != 0.0)) {
+            fails += " #f2 ";
+        }
+        set_matrix_allocation_policy(P::DEFAULT);
+        set_matrix_threads(threads);
+
+        std::cout << (!fails.empty() ? (" !!! FAILED !!! [" + fails + "] ") : "PASSED ")
+            << "(Allocation policies)" << std::endl;
+    }
+
     // Other
     {
         std::string fails;
@@ -3,18 +3,107 @@
 #ifndef MATRIX_H
 #define MATRIX_H
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
-// Debug print
-#ifdef MATRIX_DEBUG
- #define MATRIX_DEBUG_(x) x
- #ifdef _MSC_VER // for Visual Studio
-  #define FUNC_NAME_ __FUNCSIG__
- #else
-  #define FUNC_NAME_ __func__
- #endif
+// Instrumentation counters (see "matrix_stats()")
+#ifdef MATRIX_STATS
+ #define MATRIX_STATS_(x) x
 #else
- #define MATRIX_DEBUG_(x)
+ #define MATRIX_STATS_(x)
+#endif
+
+// Tracing of library calls (see "matrix_trace_dump()")
+#ifdef MATRIX_TRACE
+ #include <chrono>
+ #include <memory>
+ #include <typeinfo>
+ #define MATRIX_TRACE_(x) x
+#else
+ #define MATRIX_TRACE_(x)
+#endif
+
+// Matrices on stack and functions on them are usable in constant expressions
+// unless instrumentation is enabled
+#if defined(MATRIX_STATS) || defined(MATRIX_TRACE)
+ #define MATRIX_CONSTEXPR_
+#else
+ #define MATRIX_CONSTEXPR_ constexpr
+#endif
+
+// The number of trace events kept for every thread (the oldest ones are overwritten)
+#ifdef MATRIX_TRACE_BUFFER_SIZE
+ #define MATRIX_TRACE_BUFFER_SIZE_ MATRIX_TRACE_BUFFER_SIZE
+#else
+ #define MATRIX_TRACE_BUFFER_SIZE_ 16384
+#endif
+
+// Hardware conversion of half precision floating point numbers
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+ #define MATRIX_F16C_
+#endif
+
+// Multiply-add instructions of 8-bit integers, which sum products of adjacent
+// pairs (or quadruples for VNNI) of elements into 32-bit lanes
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+ #define MATRIX_I8_AVX512_VNNI_
+ #define MATRIX_I8_
+#elif defined(__AVX512BW__)
+ #define MATRIX_I8_AVX512_
+ #define MATRIX_I8_
+#elif defined(__AVX2__)
+ #define MATRIX_I8_AVX2_
+ #define MATRIX_I8_
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+ #define MATRIX_I8_SSE2_
+ #define MATRIX_I8_
+#endif
+
+#if defined(MATRIX_F16C_) || defined(__AVX512F__) || defined(__AVX2__)
+ #include <immintrin.h>
+#endif
+
+// Non-temporal (streaming) stores, which bypass the cache
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+ #define MATRIX_STREAM_
+ #include <emmintrin.h>
+#endif
+
+// Allocation policies of large heap matrices (see "MatrixAllocationPolicy")
+#ifdef __linux__
+ #define MATRIX_MMAP_
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+ #include <unistd.h>
+#endif
+
+// The minimal size (in bytes) of the matrix being filled with non-temporal
+// stores. Larger matrices don't fit in the cache, so writing around it avoids
+// reading the destination memory first.
+#ifdef MATRIX_STREAM_BYTES_MIN
+ #define MATRIX_STREAM_BYTES_MIN_ MATRIX_STREAM_BYTES_MIN
+#else
+ #define MATRIX_STREAM_BYTES_MIN_ (8 << 20)
 #endif
 
 // The maximum size (in bytes) of the matrix being allocated on the stack
@@ -24,6 +113,28 @@
  #define MATRIX_DATA_STORAGE_STACK_SIZE_MAX_ 1024
 #endif
 
+// The size of square blocks processed at once by blocked factorizations
+#ifdef MATRIX_BLOCK_SIZE
+ #define MATRIX_BLOCK_SIZE_ MATRIX_BLOCK_SIZE
+#else
+ #define MATRIX_BLOCK_SIZE_ 64
+#endif
+
+// The minimal number of operations worth to be split between threads
+#ifdef MATRIX_PARALLEL_WORK_MIN
+ #define MATRIX_PARALLEL_WORK_MIN_ MATRIX_PARALLEL_WORK_MIN
+#else
+ #define MATRIX_PARALLEL_WORK_MIN_ 262144
+#endif
+
+// The default size of matrices below which Strassen-Winograd multiplication
+// switches to the blocked kernel
+#ifdef MATRIX_STRASSEN_CROSSOVER
+ #define MATRIX_STRASSEN_CROSSOVER_ MATRIX_STRASSEN_CROSSOVER
+#else
+ #define MATRIX_STRASSEN_CROSSOVER_ 512
+#endif
+
 
 
 namespace matrix {
@@ -33,7 +144,8 @@ enum class MatrixDataStorage {
     UNSPECIFIED, // stack or heap storage will be chosen based on matrix size
     STACK,       // allocates matrix on stack
     HEAP,        // allocates matrix on heap
-    USER         // places matrix in the memory given by the pointer
+    USER,        // places matrix in the memory given by the pointer
+    SHARED       // allocates matrix on heap, copies share it until one of them is written
 };
 
 // Chooses the best storage for the matrix with giving size
@@ -43,11 +155,12 @@ constexpr MatrixDataStorage choose_matrix_data_storage(const size_t size) {
 
 // Chooses storage based on storages of giving two matrices. Decision is done
 // according to the following diagram:
-//     x   UNSP. STACK HEAP  USER
-//   UNSP. unsp. stack heap  unsp.
-//   STACK stack stack unsp. stack
-//   HEAP  heap  unsp. heap  heap
-//   USER  unsp. stack heap  unsp.
+//     x    UNSP.  STACK HEAP  USER   SHARED
+//   UNSP.  unsp.  stack heap  unsp.  shared
+//   STACK  stack  stack unsp. stack  unsp.
+//   HEAP   heap   unsp. heap  heap   heap
+//   USER   unsp.  stack heap  unsp.  shared
+//   SHARED shared unsp. heap  shared shared
 // For unspecified result the matrix storage will be chosen based on matrix size.
 constexpr MatrixDataStorage result_matrix_data_storage(const MatrixDataStorage lhs, const MatrixDataStorage rhs = MatrixDataStorage::UNSPECIFIED) {
     switch (lhs) {
@@ -55,848 +168,5081 @@ constexpr MatrixDataStorage result_matrix_data_storage(const MatrixDataStorage l
       case MatrixDataStorage::USER:
         return (rhs == MatrixDataStorage::USER) ? MatrixDataStorage::UNSPECIFIED : rhs;
       case MatrixDataStorage::STACK:
-        return (rhs == MatrixDataStorage::HEAP) ? MatrixDataStorage::UNSPECIFIED : MatrixDataStorage::STACK;
+        return ((rhs == MatrixDataStorage::HEAP) || (rhs == MatrixDataStorage::SHARED)) ? MatrixDataStorage::UNSPECIFIED : MatrixDataStorage::STACK;
       case MatrixDataStorage::HEAP:
         return (rhs == MatrixDataStorage::STACK) ? MatrixDataStorage::UNSPECIFIED : MatrixDataStorage::HEAP;
+      case MatrixDataStorage::SHARED:
+        return (rhs == MatrixDataStorage::STACK) ? MatrixDataStorage::UNSPECIFIED :
+               (rhs == MatrixDataStorage::HEAP) ? MatrixDataStorage::HEAP : MatrixDataStorage::SHARED;
     }
 }
 
 
+// Analytical cost of a library call: the number of arithmetic operations and
+// compulsory memory traffic in bytes (every operand is read once and the result
+// is written once). Arithmetic intensity is "flops / bytes".
+struct MatrixCost {
+    size_t flops;
+    size_t bytes;
+};
 
-// Memory managemant of a matrix
-template<typename T, size_t M, size_t N, MatrixDataStorage S>
-class MatrixData; // only stack, heap and user types of memory are allowed
-
-// Allocates matrix on stack. Suitable for small matrix size.
+// Elementwise operation: for every element "in" bytes are read, "out" bytes are
+// written and "ops" operations are done
+constexpr MatrixCost elementwise_cost(const size_t elements, const size_t in, const size_t out, const size_t ops = 1) {
+    return { elements * ops, elements * (in + out) };
+}
+// Multiplication of matrix(m,n) by matrix(n,p): multiply and add for every term
+template<typename T, typename T_, size_t M, size_t N, size_t P>
+constexpr MatrixCost mul_cost() {
+    return { 2 * M * N * P, M * N * sizeof(T) + N * P * sizeof(T_) + M * P * sizeof(std::common_type_t<T, T_>) };
+}
+// Update of matrix(m,p) of type R by product of matrix(m,n) and matrix(n,p):
+// the result is read and written, scaling takes three operations per element
+template<typename T, typename T_, typename R, size_t M, size_t N, size_t P>
+constexpr MatrixCost gemm_cost() {
+    return { 2 * M * N * P + 3 * M * P, M * N * sizeof(T) + N * P * sizeof(T_) + 2 * M * P * sizeof(R) };
+}
+// Determinant of matrix(n,n) by Gaussian elimination of a copy: 2(n-1)n(n+1)/3
+// operations for elimination of the full matrix and n for the diagonal product
+template<typename T, size_t N>
+constexpr MatrixCost det_cost() {
+    return { 2 * (N - 1) * N * (N + 1) / 3 + N, 2 * N * N * sizeof(T) };
+}
+// Cholesky factorization of matrix(n,n): n^3/3 operations for the lower triangle
+// updates and n square roots
+template<typename T, size_t N>
+constexpr MatrixCost cholesky_cost() {
+    return { N * N * N / 3 + N, 2 * N * N * sizeof(T) };
+}
+// Householder QR factorization of matrix(m,n), m >= n
 template<typename T, size_t M, size_t N>
-class MatrixData<T, M, N, MatrixDataStorage::STACK> {
-  private:
-    T data_[M * N];
+constexpr MatrixCost qr_cost() {
+    return { 2 * M * N * N - 2 * N * N * N / 3, 2 * M * N * sizeof(T) };
+}
+// LU factorization of matrix(n,n) with partial pivoting
+template<typename T, size_t N>
+constexpr MatrixCost lu_cost() {
+    return { 2 * N * N * N / 3, 2 * N * N * sizeof(T) };
+}
+// Solution of two triangular systems with matrix(n,n) for p right-hand sides
+template<typename T, typename T_, size_t N, size_t P>
+constexpr MatrixCost triangular_solve_cost() {
+    return { 2 * N * N * P, N * N * sizeof(T) + 2 * N * P * sizeof(T_) };
+}
 
-  public:
-    MatrixData() {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK DATA constructor" << std::endl);
-    }
-    template<typename T_>
-    explicit MatrixData(T_ &&val) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK DATA constructor (val)" << std::endl);
-        for (size_t i = 0; i < M * N; ++i) {
-            data_[i] = static_cast<T>(val);
-        }
-    }
-    template<typename T_>
-    explicit MatrixData(T_ *arr) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK DATA constructor (arr)" << std::endl);
-        for (size_t i = 0; i < M * N; ++i) {
-            data_[i] = static_cast<T>(arr[i]);
-        }
-    }
-    template<typename T_>
-    explicit MatrixData(std::initializer_list<T_> init) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK DATA constructor (init)" << std::endl);
-        if (init.size() > M * N) {
-            auto end = init.begin();
-            std::advance(end, M * N); // prevent overflow
-            size_t i = 0;
-            for (auto it = init.begin(); it != end; ++it) {
-                data_[i++] = static_cast<T>(*it);
-            }
-        } else {
-            size_t i = 0;
-            for (auto &val : init) {
-                data_[i++] = static_cast<T>(val);
-            }
-            while (i < M * N) {
-                data_[i++] = T(); // fill with default elements
-            }
-        }
+// Counters of matrix data events. They are collected for every thread and every
+// storage type when "MATRIX_STATS" is defined, otherwise they always stay zero.
+// The counters allow to check that an expression doesn't allocate or copy.
+struct MatrixStats {
+    size_t allocations = 0;     // heap allocations
+    size_t deallocations = 0;   // heap deallocations
+    size_t bytes_allocated = 0; // total size of heap allocations
+    size_t copies = 0;          // deep copies of matrix data (constructions and assignments)
+    size_t moves = 0;           // moves of matrix data (constructions and assignments)
+    size_t shares = 0;          // copies of shared matrix data done by reference counting
+    size_t conversions = 0;     // copies with element type conversion
+    size_t flops = 0;           // arithmetic operations of library calls (see "MatrixCost")
+    size_t bytes_accessed = 0;  // compulsory memory traffic of library calls
+
+    MatrixStats& operator+=(const MatrixStats &other) {
+        allocations += other.allocations;
+        deallocations += other.deallocations;
+        bytes_allocated += other.bytes_allocated;
+        copies += other.copies;
+        moves += other.moves;
+        shares += other.shares;
+        conversions += other.conversions;
+        flops += other.flops;
+        bytes_accessed += other.bytes_accessed;
+        return *this;
     }
+};
 
-    ~MatrixData() = default;                                  // destructor
-    MatrixData(const MatrixData &other) = default;            // copy constructor
-    MatrixData(MatrixData &&other) = default;                 // move constructor
-    MatrixData& operator=(const MatrixData &other) = default; // copy assignment
-    MatrixData& operator=(MatrixData &&other) = default;      // move assignment
+namespace detail {
 
-    const T* const read() const { return data_; } // read-only access
-    T* write() { return data_; }                  // read and write access
-};
+// Counters of the current thread indexed by storage type
+inline MatrixStats* stats_table() {
+    thread_local MatrixStats table[5];
+    return table;
+}
+template<MatrixDataStorage S>
+MatrixStats& stats() {
+    return stats_table()[static_cast<size_t>(S)];
+}
 
-// Allocates matrix on heap. Suitable for large matrix size.
-template<typename T, size_t M, size_t N>
-class MatrixData<T, M, N, MatrixDataStorage::HEAP> {
-  private:
-    T *data_;
+// Storage where data of the matrix is placed
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+constexpr MatrixDataStorage data_storage() {
+    return (S == MatrixDataStorage::UNSPECIFIED) ? choose_matrix_data_storage(sizeof(T) * M * N) : S;
+}
+// Whether data of the matrix is placed on stack
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+using on_stack = std::integral_constant<bool, data_storage<T, M, N, S>() == MatrixDataStorage::STACK>;
 
-  public:
-    MatrixData() {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA constructor" << std::endl);
-        data_ = new T[M * N];
-    }
-    template<typename T_>
-    explicit MatrixData(T_ &&val) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA constructor (val)" << std::endl);
-        data_ = new T[M * N];
-        try {
-            for (size_t i = 0; i < M * N; ++i) {
-                data_[i] = static_cast<T>(val);
-            }
-        } catch (...) {
-            // Free critical resource in case of exception in constructor
-            delete[] data_;
-            throw;
-        }
-    }
-    template<typename T_>
-    explicit MatrixData(T_ *arr) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA constructor (arr)" << std::endl);
-        data_ = new T[M * N];
-        try {
-            for (size_t i = 0; i < M * N; ++i) {
-                data_[i] = static_cast<T>(arr[i]);
-            }
-        } catch (...) {
-            // Free critical resource in case of exception in constructor
-            delete[] data_;
-            throw;
-        }
-    }
-    template<typename T_>
-    explicit MatrixData(std::initializer_list<T_> init) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA constructor (init)" << std::endl);
-        data_ = new T[M * N];
-        try {
-            if (init.size() > M * N) {
-                auto end = init.begin();
-                std::advance(end, M * N); // prevent overflow
-                size_t i = 0;
-                for (auto it = init.begin(); it != end; ++it) {
-                    data_[i++] = static_cast<T>(*it);
-                }
-            } else {
-                size_t i = 0;
-                for (auto &val : init) {
-                    data_[i++] = static_cast<T>(val);
-                }
-                while (i < M * N) {
-                    data_[i++] = T(); // fill with default elements
-                }
-            }
-        } catch (...) {
-            // Free critical resource in case of exception in constructor
-            delete[] data_;
-            throw;
-        }
-    }
+// Accounts the cost of a library call on matrix(m,n) of type T placed in storage S
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+void count_cost(const MatrixCost cost) {
+    MatrixStats &s = stats<data_storage<T, M, N, S>()>();
+    s.flops += cost.flops;
+    s.bytes_accessed += cost.bytes;
+}
 
-    ~MatrixData() {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA destructor" << std::endl);
-        delete[] data_;
-    }
-    MatrixData(const MatrixData &other) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA copy constructor" << std::endl);
-        data_ = new T[M * N];
-        try {
-            for (size_t i = 0; i < M * N; ++i) {
-                data_[i] = other.data_[i];
-            }
-        } catch (...) {
-            // Free critical resource in case of exception in constructor
-            delete[] data_;
-            throw;
-        }
-    }
-    MatrixData(MatrixData &&other) : data_(other.data_) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA move constructor" << std::endl);
-        other.data_ = nullptr;
+// Accounts a copy of elements of type T_ into matrix data of type T placed in storage S
+template<typename T, typename T_, MatrixDataStorage S>
+void count_copy() {
+    MatrixStats &s = stats<S>();
+    ++s.copies;
+    if (!std::is_same<T, T_>::value) {
+        ++s.conversions;
     }
-    MatrixData& operator=(const MatrixData &other) {
-        // Just copy values, matrices have the same size
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA copy assignment" << std::endl);
-        if (this != &other) { // avoid self-copy
-            for (size_t i = 0; i < M * N; ++i) {
-                data_[i] = other.data_[i];
-            }
-        }
+}
+
+// Accounts copies and moves of stack data. Stack data uses default copy and
+// move operations, which invoke these ones of the empty base class.
+struct StackDataCounter {
+    StackDataCounter() = default;
+#ifdef MATRIX_STATS
+    StackDataCounter(const StackDataCounter &) { ++stats<MatrixDataStorage::STACK>().copies; }
+    StackDataCounter(StackDataCounter &&) { ++stats<MatrixDataStorage::STACK>().moves; }
+    StackDataCounter& operator=(const StackDataCounter &) {
+        ++stats<MatrixDataStorage::STACK>().copies;
         return *this;
     }
-    MatrixData& operator=(MatrixData &&other) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP DATA move assignment" << std::endl);
-        if (this != &other) { // prevent self-move
-            // Previous data from current matrix will be automatically destructed
-            std::swap(data_, other.data_);
-        }
+    StackDataCounter& operator=(StackDataCounter &&) {
+        ++stats<MatrixDataStorage::STACK>().moves;
         return *this;
     }
-
-    const T* const read() const { return data_; }
-    T* write() { return data_; }
+#endif
 };
 
-// Allocates matrix in the memory given by the pointer. Allocation, deallocation
-// and memory size should be handled by user himself.
-template<typename T, size_t M, size_t N>
-class MatrixData<T, M, N, MatrixDataStorage::USER> {
-  private:
-    T *data_;
+} // namespace detail
 
-  public:
-    explicit MatrixData(T *mem) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER DATA constructor" << std::endl);
-        data_ = mem;
-    }
-    template<typename T_>
-    MatrixData(T *mem, T_ &&val) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER DATA constructor (val)" << std::endl);
-        data_ = mem;
-        for (size_t i = 0; i < M * N; ++i) {
-            data_[i] = static_cast<T>(val);
-        }
+// Returns counters of the current thread for the matrix data placed in the given
+// storage. Data of UNSPECIFIED matrices is accounted in the storage chosen for it.
+inline MatrixStats matrix_stats(const MatrixDataStorage storage) {
+    return detail::stats_table()[static_cast<size_t>(storage)];
+}
+// Returns counters of the current thread summed over all storages
+inline MatrixStats matrix_stats() {
+    MatrixStats sum;
+    for (size_t i = 0; i < 5; ++i) {
+        sum += detail::stats_table()[i];
     }
-    template<typename T_>
-    MatrixData(T *mem, T_ *arr) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER DATA constructor (arr)" << std::endl);
-        data_ = mem;
-        for (size_t i = 0; i < M * N; ++i) {
-            data_[i] = static_cast<T>(arr[i]);
-        }
+    return sum;
+}
+// Zeroes all counters of the current thread
+inline void reset_matrix_stats() {
+    for (size_t i = 0; i < 5; ++i) {
+        detail::stats_table()[i] = MatrixStats();
     }
-    template<typename T_>
-    MatrixData(std::initializer_list<T_> init) = delete; // memory isn't specified
+}
 
-    ~MatrixData() {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER DATA destructor" << std::endl);
-    }
-    // Copy constructor is prohibited because the destination memory location
-    // isn't known.
-    MatrixData(const MatrixData &other) = delete;
-    MatrixData(MatrixData &&other) : data_(other.data_) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER DATA move constructor" << std::endl);
-    }
-    MatrixData& operator=(const MatrixData &other) {
-        // Just copy values, matrices have the same size
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER DATA copy assignment" << std::endl);
-        if (this != &other) { // avoid self-copy
-            for (size_t i = 0; i < M * N; ++i) {
-                data_[i] = other.data_[i];
-            }
-        }
-        return *this;
-    }
-    MatrixData& operator=(MatrixData &&other) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER DATA move assignment" << std::endl);
-        if (this != &other) { // prevent self-move
-            data_ = other.data_;
-        }
-        return *this;
-    }
 
-    const T* const read() const { return data_; }
-    T* write() { return data_; }
-};
 
+// Half precision element types
+namespace detail {
 
+inline uint32_t float_bits(const float val) {
+    uint32_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    return bits;
+}
+inline float bits_float(const uint32_t bits) {
+    float val;
+    std::memcpy(&val, &bits, sizeof(val));
+    return val;
+}
 
-// Matrix layout:
-//         N
-//   x - - - >
-//   |0,0 0,1
-// M |1,0 1,1
-//   v
-template<typename T, size_t M, size_t N, MatrixDataStorage S = MatrixDataStorage::UNSPECIFIED>
-class Matrix; // by default storage is automatically chosen based on matrix size
+// Layout of IEEE 754 numbers of floating point type T: unsigned integer type
+// of the same size, the number of bits of mantissa and the exponent bias
+template<typename T>
+struct ieee_layout {
+    using type = std::conditional_t<sizeof(T) == sizeof(uint32_t), uint32_t, uint64_t>;
+    static constexpr int kMantissa = std::numeric_limits<T>::digits - 1;
+    static constexpr int kBias = std::numeric_limits<T>::max_exponent - 1;
+};
 
-// Matrix on stack (explicitly set)
-template<typename T, size_t M, size_t N>
-class Matrix<T, M, N, MatrixDataStorage::STACK> {
-  private:
-    MatrixData<T, M, N, MatrixDataStorage::STACK> md_;
+// Bits of floating point number and back (loops with them are vectorized)
+template<typename T>
+typename ieee_layout<T>::type to_bits(const T val) {
+    typename ieee_layout<T>::type bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    return bits;
+}
+template<typename T>
+T from_bits(const typename ieee_layout<T>::type bits) {
+    T val;
+    std::memcpy(&val, &bits, sizeof(val));
+    return val;
+}
 
-  public:
-    Matrix() : md_() {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK constructor" << std::endl);
-    }
-    template<typename T_>
-    explicit Matrix(T_ &&val) : md_(std::forward<T_>(val)) { // perfect forwarding for large objects
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK constructor (val)" << std::endl);
+// Rounds float to IEEE 754 binary16 (to nearest, ties to even)
+inline uint16_t float_to_half(const float val) {
+#ifdef MATRIX_F16C_
+    return static_cast<uint16_t>(_cvtss_sh(val, _MM_FROUND_TO_NEAREST_INT));
+#else
+    uint32_t bits = float_bits(val);
+    const uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+    uint32_t res;
+    if (bits >= (127u + 16) << 23) { // infinity or NaN, overflow
+        res = (bits > 0x7f800000u) ? 0x7e00u : 0x7c00u;
+    } else if (bits < (127u - 14) << 23) { // subnormal or zero, the magic addend aligns mantissa by rounding
+        const uint32_t magic = (127u - 15 + 23 - 10 + 1) << 23;
+        res = float_bits(bits_float(bits) + bits_float(magic)) - magic;
+    } else {
+        const uint32_t odd = (bits >> 13) & 1;
+        bits += (uint32_t(15 - 127) << 23) + 0xfff + odd; // rebias exponent and round
+        res = bits >> 13;
     }
-    template<typename T_>
-    explicit Matrix(T_ *arr) : md_(arr) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK constructor (arr)" << std::endl);
+    return static_cast<uint16_t>(res | (sign >> 16));
+#endif
+}
+inline float half_to_float(const uint16_t val) {
+#ifdef MATRIX_F16C_
+    return _cvtsh_ss(val);
+#else
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    uint32_t bits = (val & 0x7fffu) << 13;
+    const uint32_t exp = bits & shifted_exp;
+    bits += (127u - 15) << 23;
+    if (exp == shifted_exp) { // infinity or NaN
+        bits += (128u - 16) << 23;
+    } else if (exp == 0) { // subnormal or zero, renormalize
+        bits = float_bits(bits_float(bits + (1u << 23)) - bits_float(113u << 23));
     }
-    template<typename T_>
-    Matrix(std::initializer_list<T_> init) : md_(init) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK constructor (init)" << std::endl);
+    return bits_float(bits | (uint32_t(val & 0x8000u) << 16));
+#endif
+}
+
+// Rounds float to bfloat16 (upper half of float, to nearest, ties to even)
+inline uint16_t float_to_bfloat(const float val) {
+    const uint32_t bits = float_bits(val);
+    if ((bits & 0x7fffffffu) > 0x7f800000u) { // quiet NaN
+        return static_cast<uint16_t>((bits >> 16) | 0x40u);
     }
+    return static_cast<uint16_t>((bits + 0x7fffu + ((bits >> 16) & 1)) >> 16);
+}
+inline float bfloat_to_float(const uint16_t val) {
+    return bits_float(uint32_t(val) << 16);
+}
 
-    ~Matrix() = default;
-    Matrix(const Matrix &other) = default;
-    Matrix(Matrix &&other) = default;
-    Matrix& operator=(const Matrix &other) = default;
-    Matrix& operator=(Matrix &&other) = default;
+// Storage-only floating point type computed in float. Arithmetic with another
+// arithmetic type is done in their common type (see "std::common_type").
+template<uint16_t (*ToBits)(float), float (*FromBits)(uint16_t)>
+class HalfFloat {
+  private:
+    uint16_t bits_;
 
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) : md_(other.read()) { // copy from UNSPECIFIED
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK <- UNSPECIFIED" << std::endl);
-    }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) : md_(other.read()) { // converts value type
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK type converter" << std::endl);
-    }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) : md_(other.read()) { // copy from HEAP
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK <- HEAP" << std::endl);
-    }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) : md_(other.read()) { // copy from USER
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  STACK <- USER" << std::endl);
+  public:
+    HalfFloat() = default; // uninitialized like built-in types
+    template<typename T, typename = std::enable_if_t<std::is_arithmetic<T>::value>>
+    HalfFloat(const T val) : bits_(ToBits(static_cast<float>(val))) {}
+    operator float() const { return FromBits(bits_); }
+
+    static HalfFloat from_bits(const uint16_t bits) {
+        HalfFloat ret;
+        ret.bits_ = bits;
+        return ret;
     }
+    uint16_t bits() const { return bits_; }
 
-    const T* const read() const { return md_.read(); } // read-only access
-    T* write() { return md_.write(); }                 // read and write access
+    HalfFloat operator+() const { return *this; }
+    HalfFloat operator-() const { return from_bits(bits_ ^ 0x8000u); }
+    template<typename T>
+    HalfFloat& operator+=(const T other) { return *this = HalfFloat(float(*this) + other); }
+    template<typename T>
+    HalfFloat& operator-=(const T other) { return *this = HalfFloat(float(*this) - other); }
+    template<typename T>
+    HalfFloat& operator*=(const T other) { return *this = HalfFloat(float(*this) * other); }
+    template<typename T>
+    HalfFloat& operator/=(const T other) { return *this = HalfFloat(float(*this) / other); }
+};
+
+} // namespace detail
+
+// IEEE 754 binary16: 5 bits of exponent and 10 bits of mantissa
+using float16 = detail::HalfFloat<detail::float_to_half, detail::half_to_float>;
+// Brain floating point: exponent of float and 7 bits of mantissa
+using bfloat16 = detail::HalfFloat<detail::float_to_bfloat, detail::bfloat_to_float>;
+
+namespace detail {
+
+template<typename T>
+struct is_half : std::false_type {};
+template<> struct is_half<float16> : std::true_type {};
+template<> struct is_half<bfloat16> : std::true_type {};
+
+// Type of arithmetic between a half precision type and type T
+template<typename H, typename T>
+struct half_common {
+    using type = std::conditional_t<std::is_floating_point<T>::value, std::common_type_t<float, T>, H>;
+};
+template<typename H>
+struct half_common<H, H> {
+    using type = H;
+};
+template<> struct half_common<float16, bfloat16> { using type = float; };
+template<> struct half_common<bfloat16, float16> { using type = float; };
+
+// Type of arithmetic between T and T_ if one of them is half precision type
+// and the other one is half precision or arithmetic type
+template<typename T, typename T_, bool = (is_half<T>::value && (is_half<T_>::value || std::is_arithmetic<T_>::value)) ||
+                                         (is_half<T_>::value && std::is_arithmetic<T>::value)>
+struct half_result {};
+template<typename T, typename T_>
+struct half_result<T, T_, true> {
+    using type = typename half_common<std::conditional_t<is_half<T>::value, T, T_>, std::conditional_t<is_half<T>::value, T_, T>>::type;
+};
+template<typename T, typename T_>
+using enable_if_half_t = typename half_result<T, T_>::type;
+
+// Arithmetic and comparisons of half precision types are done in float
+template<typename T, typename T_>
+detail::enable_if_half_t<T, T_> operator+(const T lhs, const T_ rhs) {
+    return detail::enable_if_half_t<T, T_>(static_cast<float>(lhs) + static_cast<float>(rhs));
+}
+template<typename T, typename T_>
+detail::enable_if_half_t<T, T_> operator-(const T lhs, const T_ rhs) {
+    return detail::enable_if_half_t<T, T_>(static_cast<float>(lhs) - static_cast<float>(rhs));
+}
+template<typename T, typename T_>
+detail::enable_if_half_t<T, T_> operator*(const T lhs, const T_ rhs) {
+    return detail::enable_if_half_t<T, T_>(static_cast<float>(lhs) * static_cast<float>(rhs));
+}
+template<typename T, typename T_>
+detail::enable_if_half_t<T, T_> operator/(const T lhs, const T_ rhs) {
+    return detail::enable_if_half_t<T, T_>(static_cast<float>(lhs) / static_cast<float>(rhs));
+}
+template<typename T, typename T_, typename = detail::enable_if_half_t<T, T_>>
+bool operator==(const T lhs, const T_ rhs) { return static_cast<float>(lhs) == static_cast<float>(rhs); }
+template<typename T, typename T_, typename = detail::enable_if_half_t<T, T_>>
+bool operator!=(const T lhs, const T_ rhs) { return static_cast<float>(lhs) != static_cast<float>(rhs); }
+template<typename T, typename T_, typename = detail::enable_if_half_t<T, T_>>
+bool operator<(const T lhs, const T_ rhs) { return static_cast<float>(lhs) < static_cast<float>(rhs); }
+template<typename T, typename T_, typename = detail::enable_if_half_t<T, T_>>
+bool operator>(const T lhs, const T_ rhs) { return static_cast<float>(lhs) > static_cast<float>(rhs); }
+template<typename T, typename T_, typename = detail::enable_if_half_t<T, T_>>
+bool operator<=(const T lhs, const T_ rhs) { return static_cast<float>(lhs) <= static_cast<float>(rhs); }
+template<typename T, typename T_, typename = detail::enable_if_half_t<T, T_>>
+bool operator>=(const T lhs, const T_ rhs) { return static_cast<float>(lhs) >= static_cast<float>(rhs); }
+
+// Converts "n" elements of array "src" to type T of array "dst". Conversions
+// between float and half precision types are done in bulk with vector
+// instructions (F16C, AVX-512) when they are available.
+template<typename T, typename T_>
+constexpr void convert(const T_ *src, T *dst, const size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = static_cast<T>(src[i]);
+    }
+}
+inline void convert(const float *src, float16 *dst, const size_t n) {
+    size_t i = 0;
+    uint16_t *bits = reinterpret_cast<uint16_t*>(dst);
+#if defined(__AVX512F__)
+    for ( ; i + 16 <= n; i += 16) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(bits + i), _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+#ifdef MATRIX_F16C_
+    for ( ; i + 8 <= n; i += 8) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bits + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    for ( ; i < n; ++i) {
+        bits[i] = float_to_half(src[i]);
+    }
+}
+inline void convert(const float16 *src, float *dst, const size_t n) {
+    size_t i = 0;
+    const uint16_t *bits = reinterpret_cast<const uint16_t*>(src);
+#if defined(__AVX512F__)
+    for ( ; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bits + i))));
+    }
+#endif
+#ifdef MATRIX_F16C_
+    for ( ; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bits + i))));
+    }
+#endif
+    for ( ; i < n; ++i) {
+        dst[i] = half_to_float(bits[i]);
+    }
+}
+// Conversions of bfloat16 are integer operations, which are vectorized by compiler
+inline void convert(const float *src, bfloat16 *dst, const size_t n) {
+    uint16_t *bits = reinterpret_cast<uint16_t*>(dst);
+    for (size_t i = 0; i < n; ++i) {
+        bits[i] = float_to_bfloat(src[i]);
+    }
+}
+inline void convert(const bfloat16 *src, float *dst, const size_t n) {
+    const uint16_t *bits = reinterpret_cast<const uint16_t*>(src);
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = bfloat_to_float(bits[i]);
+    }
+}
+
+} // namespace detail
+
+} // namespace matrix
+
+// Common types of half precision and arithmetic types
+namespace std {
+
+template<> struct common_type<matrix::float16, matrix::float16> { using type = matrix::float16; };
+template<> struct common_type<matrix::bfloat16, matrix::bfloat16> { using type = matrix::bfloat16; };
+template<> struct common_type<matrix::float16, matrix::bfloat16> { using type = float; };
+template<> struct common_type<matrix::bfloat16, matrix::float16> { using type = float; };
+template<typename T>
+struct common_type<matrix::float16, T> { using type = typename matrix::detail::half_common<matrix::float16, T>::type; };
+template<typename T>
+struct common_type<T, matrix::float16> { using type = typename matrix::detail::half_common<matrix::float16, T>::type; };
+template<typename T>
+struct common_type<matrix::bfloat16, T> { using type = typename matrix::detail::half_common<matrix::bfloat16, T>::type; };
+template<typename T>
+struct common_type<T, matrix::bfloat16> { using type = typename matrix::detail::half_common<matrix::bfloat16, T>::type; };
+
+} // namespace std
+
+namespace matrix {
+
+
+
+#ifdef MATRIX_TRACE
+namespace detail {
+
+// Names of element types in trace events
+template<typename T> const char* type_name() { return typeid(T).name(); }
+template<> inline const char* type_name<bool>() { return "bool"; }
+template<> inline const char* type_name<char>() { return "char"; }
+template<> inline const char* type_name<signed char>() { return "signed char"; }
+template<> inline const char* type_name<unsigned char>() { return "unsigned char"; }
+template<> inline const char* type_name<short>() { return "short"; }
+template<> inline const char* type_name<unsigned short>() { return "unsigned short"; }
+template<> inline const char* type_name<int>() { return "int"; }
+template<> inline const char* type_name<unsigned>() { return "unsigned"; }
+template<> inline const char* type_name<long>() { return "long"; }
+template<> inline const char* type_name<unsigned long>() { return "unsigned long"; }
+template<> inline const char* type_name<long long>() { return "long long"; }
+template<> inline const char* type_name<unsigned long long>() { return "unsigned long long"; }
+template<> inline const char* type_name<float>() { return "float"; }
+template<> inline const char* type_name<double>() { return "double"; }
+template<> inline const char* type_name<long double>() { return "long double"; }
+template<> inline const char* type_name<float16>() { return "float16"; }
+template<> inline const char* type_name<bfloat16>() { return "bfloat16"; }
+
+inline const char* storage_name(const MatrixDataStorage storage) {
+    switch (storage) {
+      case MatrixDataStorage::UNSPECIFIED: return "unspecified";
+      case MatrixDataStorage::STACK: return "stack";
+      case MatrixDataStorage::HEAP: return "heap";
+      case MatrixDataStorage::USER: return "user";
+      case MatrixDataStorage::SHARED: return "shared";
+    }
+    return "";
+}
+
+// One library call. Dimensions are M, N of the (left) operand and P of the
+// right operand of "mul()", P is zero for other calls.
+struct TraceEvent {
+    const char *name;
+    const char *type;      // element type of the result
+    size_t m, n, p;
+    MatrixDataStorage lhs; // storage of the (left) operand
+    MatrixDataStorage rhs; // storage of the right operand
+    bool binary;           // whether there is a right matrix operand
+    long long begin, end;  // nanoseconds of steady clock
+};
+
+// Slot of a ring buffer guarded by a sequence lock. The event is kept as atomic
+// words, so it may be read by dumping while the owner thread overwrites it.
+struct TraceSlot {
+    static constexpr size_t kWords = (sizeof(TraceEvent) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    std::atomic<size_t> seq{0}; // "2 * i + 1" while event "i" is written, "2 * i + 2" after
+    std::atomic<uint64_t> words[kWords];
+
+    void store(const size_t i, const TraceEvent &event) {
+        uint64_t w[kWords] = {};
+        std::memcpy(w, &event, sizeof(event));
+        seq.store(2 * i + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t k = 0; k < kWords; ++k) {
+            words[k].store(w[k], std::memory_order_relaxed);
+        }
+        seq.store(2 * i + 2, std::memory_order_release);
+    }
+    // Reads event "i", fails if the slot keeps another event or is being written
+    bool load(const size_t i, TraceEvent &event) const {
+        if (seq.load(std::memory_order_acquire) != 2 * i + 2) {
+            return false;
+        }
+        uint64_t w[kWords];
+        for (size_t k = 0; k < kWords; ++k) {
+            w[k] = words[k].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) != 2 * i + 2) {
+            return false;
+        }
+        std::memcpy(&event, w, sizeof(event));
+        return true;
+    }
+};
+
+// Ring buffer of a thread. Only the owner thread writes events, so writing is
+// lock-free: an event is stored and then published by incrementing "head".
+struct TraceBuffer {
+    static constexpr size_t kSize = MATRIX_TRACE_BUFFER_SIZE_;
+    TraceSlot events[kSize];
+    std::atomic<size_t> head{0};  // number of events ever written
+    std::atomic<size_t> first{0}; // index of the first event after clearing
+    size_t tid = 0;
+};
+
+// All thread buffers. Buffers are shared to outlive their threads until dumped.
+struct TraceRegistry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+};
+inline TraceRegistry& trace_registry() {
+    static TraceRegistry registry;
+    return registry;
+}
+
+inline TraceBuffer& trace_buffer() {
+    thread_local std::shared_ptr<TraceBuffer> buffer = [] {
+        auto b = std::make_shared<TraceBuffer>();
+        TraceRegistry &registry = trace_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        b->tid = registry.buffers.size();
+        registry.buffers.push_back(b);
+        return b;
+    }();
+    return *buffer;
+}
+
+inline long long trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Writes nanoseconds as microseconds (the unit of Chrome trace timestamps)
+inline void trace_write_us(std::ostream &out, const long long ns) {
+    const long long frac = ns % 1000;
+    out << ns / 1000 << '.' << frac / 100 << frac / 10 % 10 << frac % 10;
+}
+
+// Records the enclosing library call from construction till destruction
+class TraceScope {
+  private:
+    TraceBuffer &buffer_;
+    TraceEvent event_;
+
+  public:
+    TraceScope(const char *name, const char *type, size_t m, size_t n, size_t p, MatrixDataStorage lhs)
+        : buffer_(trace_buffer()), event_{ name, type, m, n, p, lhs, lhs, false, trace_now(), 0 } {}
+    TraceScope(const char *name, const char *type, size_t m, size_t n, size_t p, MatrixDataStorage lhs, MatrixDataStorage rhs)
+        : buffer_(trace_buffer()), event_{ name, type, m, n, p, lhs, rhs, true, trace_now(), 0 } {}
+    ~TraceScope() {
+        event_.end = trace_now();
+        const size_t head = buffer_.head.load(std::memory_order_relaxed);
+        buffer_.events[head % TraceBuffer::kSize].store(head, event_);
+        buffer_.head.store(head + 1, std::memory_order_release);
+    }
+    TraceScope(const TraceScope &other) = delete;
+    TraceScope& operator=(const TraceScope &other) = delete;
+};
+
+} // namespace detail
+
+// Writes all recorded calls of all threads in Chrome trace JSON format, which
+// is opened by chrome://tracing and Perfetto. Dumping may run concurrently with
+// traced threads: events which they overwrite meanwhile are skipped.
+inline void matrix_trace_dump(std::ostream &out) {
+    std::vector<std::shared_ptr<detail::TraceBuffer>> buffers;
+    {
+        detail::TraceRegistry &registry = detail::trace_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        buffers = registry.buffers;
+    }
+    const size_t size = detail::TraceBuffer::kSize;
+    bool comma = false;
+    out << "{\"traceEvents\":[";
+    for (auto &buffer : buffers) {
+        size_t head = buffer->head.load(std::memory_order_acquire);
+        size_t first = buffer->first.load(std::memory_order_relaxed);
+        first = (head - first > size) ? head - size : first;
+        for (size_t i = first; i < head; ++i) {
+            detail::TraceEvent e;
+            if (!buffer->events[i % size].load(i, e)) {
+                continue; // overwritten
+            }
+            out << (comma ? ",\n" : "\n") << "{\"name\":\"" << e.name << "\",\"cat\":\"matrix\",\"ph\":\"X\""
+                << ",\"pid\":0,\"tid\":" << buffer->tid << ",\"ts\":";
+            detail::trace_write_us(out, e.begin);
+            out << ",\"dur\":";
+            detail::trace_write_us(out, e.end - e.begin);
+            out << ",\"args\":{\"m\":" << e.m << ",\"n\":" << e.n << ",\"p\":" << e.p
+                << ",\"type\":\"" << e.type << "\",\"storage\":\"" << detail::storage_name(e.lhs);
+            if (e.binary) {
+                out << "," << detail::storage_name(e.rhs);
+            }
+            out << "\"}}";
+            comma = true;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}" << std::endl;
+}
+// Forgets all recorded calls
+inline void matrix_trace_clear() {
+    detail::TraceRegistry &registry = detail::trace_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (auto &buffer : registry.buffers) {
+        buffer->first.store(buffer->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
+#else
+// Tracing is disabled, nothing is recorded
+inline void matrix_trace_dump(std::ostream &out) {
+    out << "{\"traceEvents\":[],\"displayTimeUnit\":\"ns\"}" << std::endl;
+}
+inline void matrix_trace_clear() {}
+#endif // #ifdef MATRIX_TRACE
+
+
+
+// Parallel kernels
+namespace detail {
+
+inline std::atomic<size_t>& threads_setting() {
+    static std::atomic<size_t> threads{1};
+    return threads;
+}
+
+} // namespace detail
+
+// Sets the number of threads used by parallel kernels (one by default). Zero
+// means the number of hardware threads.
+inline void set_matrix_threads(const size_t threads) {
+    const size_t hardware = std::thread::hardware_concurrency();
+    detail::threads_setting() = (threads != 0) ? threads : std::max<size_t>(hardware, 1);
+}
+// Returns the number of threads used by parallel kernels
+inline size_t matrix_threads() {
+    return detail::threads_setting();
+}
+
+namespace detail {
+
+// Whether the current thread runs a chunk of "parallel_for()"
+inline bool& in_parallel_for() {
+    thread_local bool flag = false;
+    return flag;
+}
+
+// Calls "f(first, last)" for consecutive chunks of range [begin, end) split
+// between threads. The calling thread takes the first chunk. Small amount of
+// "work" (the number of operations) is done by the calling thread only, as
+// well as nested calls from the chunks.
+template<typename F>
+void parallel_for(const size_t begin, const size_t end, const size_t work, F &&f) {
+    const size_t threads = std::min(matrix_threads(), end - begin);
+    if ((end <= begin) || (threads <= 1) || (work < MATRIX_PARALLEL_WORK_MIN_) || in_parallel_for()) {
+        if (begin < end) {
+            f(begin, end);
+        }
+        return;
+    }
+    const size_t chunk = (end - begin + threads - 1) / threads;
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (size_t first = begin + chunk; first < end; first += chunk) {
+        const size_t last = std::min(end, first + chunk);
+        pool.emplace_back([&f, first, last] {
+            in_parallel_for() = true;
+            f(first, last);
+        });
+    }
+    in_parallel_for() = true;
+    f(begin, begin + chunk);
+    in_parallel_for() = false;
+    for (auto &thread : pool) {
+        thread.join();
+    }
+}
+
+// Dot product of arrays. Independent partial sums allow the compiler to
+// vectorize the loop without reordering of floating point operations.
+template<typename T>
+T dot(const T *lhs, const T *rhs, const size_t n) {
+    constexpr size_t kLanes = 8;
+    T acc[kLanes] = {};
+    size_t i = 0;
+    for ( ; i + kLanes <= n; i += kLanes) {
+        for (size_t j = 0; j < kLanes; ++j) {
+            acc[j] += lhs[i + j] * rhs[i + j];
+        }
+    }
+    T tail = 0;
+    for ( ; i < n; ++i) {
+        tail += lhs[i] * rhs[i];
+    }
+    return ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7])) + tail;
+}
+
+// y += alpha * x
+template<typename T>
+void axpy(T *y, const T *x, const T alpha, const size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+
+// Multiplies matrix(m,n) "a" by matrix(n,p) "b" and either writes or adds the
+// result to matrix(m,p) "c". Rows of the matrices are "lda", "ldb" and "ldc"
+// elements apart. Every product is converted to the result type and summed in
+// order of "n", so the result doesn't depend on blocking and threads. Rows of
+// "b" are processed in cache-sized blocks, rows of "c" are split between threads.
+// Elements of "a" are scaled by "alpha", "c" is scaled by "beta" before the
+// addition (c = alpha * a * b + beta * c), scaling by one is exact.
+template<typename T, typename T_, typename TT_>
+void gemm(const size_t m, const size_t n, const size_t p, const T *a, const size_t lda,
+          const T_ *b, const size_t ldb, TT_ *c, const size_t ldc, const bool accumulate,
+          const std::common_type_t<T, T_, TT_> alpha = 1, const TT_ beta = 1) {
+    using A = std::common_type_t<T, T_, TT_>;
+    constexpr size_t kBlockN = 128; // rows of "b" in a block
+    constexpr size_t kBlockP = 256; // columns of "b" in a block
+    parallel_for(0, m, 2 * m * n * p, [=](size_t first, size_t last) {
+        if (!accumulate) {
+            for (size_t i = first; i < last; ++i) {
+                std::fill(c + i * ldc, c + i * ldc + p, TT_(0));
+            }
+        } else if (beta != TT_(1)) {
+            for (size_t i = first; i < last; ++i) {
+                for (size_t j = 0; j < p; ++j) {
+                    c[i * ldc + j] *= beta;
+                }
+            }
+        }
+        for (size_t j0 = 0; j0 < p; j0 += kBlockP) {
+            const size_t j1 = std::min(p, j0 + kBlockP);
+            for (size_t k0 = 0; k0 < n; k0 += kBlockN) {
+                const size_t k1 = std::min(n, k0 + kBlockN);
+                size_t i = first;
+                for ( ; i + 4 <= last; i += 4) { // four rows share loaded elements of "b"
+                    const T *ai = a + i * lda;
+                    TT_ *c0 = c + i * ldc;
+                    TT_ *c1 = c0 + ldc;
+                    TT_ *c2 = c1 + ldc;
+                    TT_ *c3 = c2 + ldc;
+                    for (size_t k = k0; k < k1; ++k) {
+                        const A a0 = alpha * static_cast<A>(ai[k]);
+                        const A a1 = alpha * static_cast<A>(ai[lda + k]);
+                        const A a2 = alpha * static_cast<A>(ai[2 * lda + k]);
+                        const A a3 = alpha * static_cast<A>(ai[3 * lda + k]);
+                        const T_ *bk = b + k * ldb;
+                        for (size_t j = j0; j < j1; ++j) {
+                            const T_ bkj = bk[j];
+                            c0[j] += static_cast<TT_>(a0 * bkj);
+                            c1[j] += static_cast<TT_>(a1 * bkj);
+                            c2[j] += static_cast<TT_>(a2 * bkj);
+                            c3[j] += static_cast<TT_>(a3 * bkj);
+                        }
+                    }
+                }
+                for ( ; i < last; ++i) {
+                    const T *ai = a + i * lda;
+                    TT_ *ci = c + i * ldc;
+                    for (size_t k = k0; k < k1; ++k) {
+                        const A aik = alpha * static_cast<A>(ai[k]);
+                        const T_ *bk = b + k * ldb;
+                        for (size_t j = j0; j < j1; ++j) {
+                            ci[j] += static_cast<TT_>(aik * bk[j]);
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Dot product of arrays with elements converted to type A, the sum is kept
+// in type A. Integer products of narrow types are widened before summation,
+// which compilers turn into multiply-add instructions of packed integers.
+template<typename A, typename T, typename T_>
+A dot_widened(const T *lhs, const T_ *rhs, const size_t n) {
+    constexpr size_t kLanes = 8;
+    A acc[kLanes] = {};
+    const size_t end = n - n % kLanes; // a constant bound lets the loop be vectorized
+    for (size_t i = 0; i < end; i += kLanes) {
+        for (size_t j = 0; j < kLanes; ++j) {
+            acc[j] += static_cast<A>(lhs[i + j]) * static_cast<A>(rhs[i + j]);
+        }
+    }
+    A tail = 0;
+    for (size_t i = end; i < n; ++i) {
+        tail += static_cast<A>(lhs[i]) * static_cast<A>(rhs[i]);
+    }
+    return ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7])) + tail;
+}
+
+// Adds "val" to "sum" and the rounding error to "err" (branch free TwoSum)
+template<typename A>
+void two_sum(A &sum, A &err, const A val) {
+    const A res = sum + val;
+    const A virt = res - sum;
+    err += (sum - (res - virt)) + (val - virt);
+    sum = res;
+}
+
+// Dot product of arrays with elements converted to type A and compensated
+// summation: the rounding errors of additions are accumulated separately and
+// added to the result, so the error doesn't grow with "n". Products are still
+// rounded. Lanes of independent sums allow the loop to be vectorized.
+template<typename A, typename T, typename T_>
+A dot_compensated(const T *lhs, const T_ *rhs, const size_t n) {
+    constexpr size_t kLanes = 8;
+    A sum[kLanes] = {};
+    A err[kLanes] = {};
+    size_t i = 0;
+    for ( ; i + kLanes <= n; i += kLanes) {
+        for (size_t j = 0; j < kLanes; ++j) {
+            two_sum(sum[j], err[j], static_cast<A>(lhs[i + j]) * static_cast<A>(rhs[i + j]));
+        }
+    }
+    A res = 0;
+    A res_err = 0;
+    for ( ; i < n; ++i) {
+        two_sum(res, res_err, static_cast<A>(lhs[i]) * static_cast<A>(rhs[i]));
+    }
+    for (size_t j = 0; j < kLanes; ++j) {
+        two_sum(res, res_err, sum[j]);
+        res_err += err[j];
+    }
+    return res + res_err;
+}
+
+// Multiplies matrix(m,n) "a" by matrix(n,p) "b" into matrix(m,p) "c" with dot
+// products of "dot(row, column, n)" returning type A, results are converted to
+// type R. Columns of "b" are packed contiguously in blocks fitting in cache,
+// rows of "c" are split between threads.
+template<typename A, typename R, typename T, typename T_, typename Dot>
+void gemm_dot(const size_t m, const size_t n, const size_t p, const T *a, const T_ *b, R *c, Dot dot) {
+    constexpr size_t kBlockBytes = 256 * 1024;
+    const size_t block = std::max<size_t>(1, std::min(p, kBlockBytes / (sizeof(T_) * n + 1)));
+    std::vector<T_> packed(block * n);
+    for (size_t j0 = 0; j0 < p; j0 += block) {
+        const size_t j1 = std::min(p, j0 + block);
+        for (size_t j = j0; j < j1; ++j) { // transposed block of columns
+            for (size_t k = 0; k < n; ++k) {
+                packed[(j - j0) * n + k] = b[k * p + j];
+            }
+        }
+        const T_ *bt = packed.data();
+        parallel_for(0, m, 2 * m * n * (j1 - j0), [=](size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i) {
+                for (size_t j = j0; j < j1; ++j) {
+                    c[i * p + j] = static_cast<R>(dot(a + i * n, bt + (j - j0) * n, n));
+                }
+            }
+        });
+    }
+}
+
+// Instructions of "gemm_i8()": a vector has "kLanes" 32-bit sums of products
+// of "kGroup" adjacent 8-bit elements, elements are packed as type "Elem". VNNI
+// multiplies unsigned by signed bytes, so the left elements are biased by
+// "kBias" (and the products are corrected with sums of columns).
+#if defined(MATRIX_I8_AVX512_VNNI_)
+struct I8Kernel {
+    using Vec = __m512i;
+    using Elem = int8_t;
+    static constexpr size_t kLanes = 16;
+    static constexpr size_t kGroup = 4;
+    static constexpr size_t kRows = 8;
+    static constexpr int32_t kBias = 128;
+    static Elem lhs(const int8_t x) { return static_cast<Elem>(x ^ 0x80); }
+    static Elem rhs(const int8_t x) { return x; }
+    static Vec zero() { return _mm512_setzero_si512(); }
+    static Vec load(const void *p) { return _mm512_loadu_si512(p); }
+    static Vec broadcast(const int32_t x) { return _mm512_set1_epi32(x); }
+    static Vec madd(const Vec acc, const Vec a, const Vec b) { return _mm512_dpbusd_epi32(acc, a, b); }
+    static Vec sub(const Vec a, const Vec b) { return _mm512_sub_epi32(a, b); }
+    static void store(void *p, const Vec v) { _mm512_storeu_si512(p, v); }
+};
+#elif defined(MATRIX_I8_AVX512_)
+struct I8Kernel {
+    using Vec = __m512i;
+    using Elem = int16_t;
+    static constexpr size_t kLanes = 16;
+    static constexpr size_t kGroup = 2;
+    static constexpr size_t kRows = 8;
+    static constexpr int32_t kBias = 0;
+    static Elem lhs(const int8_t x) { return x; }
+    static Elem rhs(const int8_t x) { return x; }
+    static Vec zero() { return _mm512_setzero_si512(); }
+    static Vec load(const void *p) { return _mm512_loadu_si512(p); }
+    static Vec broadcast(const int32_t x) { return _mm512_set1_epi32(x); }
+    static Vec madd(const Vec acc, const Vec a, const Vec b) { return _mm512_add_epi32(acc, _mm512_madd_epi16(a, b)); }
+    static Vec sub(const Vec a, const Vec b) { return _mm512_sub_epi32(a, b); }
+    static void store(void *p, const Vec v) { _mm512_storeu_si512(p, v); }
+};
+#elif defined(MATRIX_I8_AVX2_)
+struct I8Kernel {
+    using Vec = __m256i;
+    using Elem = int16_t;
+    static constexpr size_t kLanes = 8;
+    static constexpr size_t kGroup = 2;
+    static constexpr size_t kRows = 4;
+    static constexpr int32_t kBias = 0;
+    static Elem lhs(const int8_t x) { return x; }
+    static Elem rhs(const int8_t x) { return x; }
+    static Vec zero() { return _mm256_setzero_si256(); }
+    static Vec load(const void *p) { return _mm256_loadu_si256(static_cast<const Vec*>(p)); }
+    static Vec broadcast(const int32_t x) { return _mm256_set1_epi32(x); }
+    static Vec madd(const Vec acc, const Vec a, const Vec b) { return _mm256_add_epi32(acc, _mm256_madd_epi16(a, b)); }
+    static Vec sub(const Vec a, const Vec b) { return _mm256_sub_epi32(a, b); }
+    static void store(void *p, const Vec v) { _mm256_storeu_si256(static_cast<Vec*>(p), v); }
+};
+#elif defined(MATRIX_I8_SSE2_)
+struct I8Kernel {
+    using Vec = __m128i;
+    using Elem = int16_t;
+    static constexpr size_t kLanes = 4;
+    static constexpr size_t kGroup = 2;
+    static constexpr size_t kRows = 4;
+    static constexpr int32_t kBias = 0;
+    static Elem lhs(const int8_t x) { return x; }
+    static Elem rhs(const int8_t x) { return x; }
+    static Vec zero() { return _mm_setzero_si128(); }
+    static Vec load(const void *p) { return _mm_loadu_si128(static_cast<const Vec*>(p)); }
+    static Vec broadcast(const int32_t x) { return _mm_set1_epi32(x); }
+    static Vec madd(const Vec acc, const Vec a, const Vec b) { return _mm_add_epi32(acc, _mm_madd_epi16(a, b)); }
+    static Vec sub(const Vec a, const Vec b) { return _mm_sub_epi32(a, b); }
+    static void store(void *p, const Vec v) { _mm_storeu_si128(static_cast<Vec*>(p), v); }
+};
+#endif
+
+#ifdef MATRIX_I8_
+// Computes "R" rows of a panel of 2 * kLanes columns of "c" with register
+// accumulators: "a" has rows of packed groups, "b" has groups of the panel
+// interleaved by columns, "bias" is subtracted from the sums of columns and
+// only "cols" leading columns are stored
+template<size_t R>
+void gemm_i8_block(const I8Kernel::Elem *a, const size_t lda, const I8Kernel::Elem *b, const size_t groups,
+                   const int32_t *bias, int32_t *c, const size_t ldc, const size_t cols) {
+    using K = I8Kernel;
+    constexpr size_t kStep = 2 * K::kLanes * K::kGroup;
+    K::Vec acc0[R];
+    K::Vec acc1[R];
+    for (size_t r = 0; r < R; ++r) {
+        acc0[r] = K::zero();
+        acc1[r] = K::zero();
+    }
+    for (size_t g = 0; g < groups; ++g) {
+        const K::Vec b0 = K::load(b + g * kStep);
+        const K::Vec b1 = K::load(b + g * kStep + kStep / 2);
+        for (size_t r = 0; r < R; ++r) {
+            int32_t x;
+            std::memcpy(&x, a + r * lda + g * K::kGroup, sizeof(x));
+            const K::Vec ar = K::broadcast(x);
+            acc0[r] = K::madd(acc0[r], ar, b0);
+            acc1[r] = K::madd(acc1[r], ar, b1);
+        }
+    }
+    const K::Vec bias0 = K::load(bias);
+    const K::Vec bias1 = K::load(bias + K::kLanes);
+    for (size_t r = 0; r < R; ++r) {
+        if (cols == 2 * K::kLanes) {
+            K::store(c + r * ldc, K::sub(acc0[r], bias0));
+            K::store(c + r * ldc + K::kLanes, K::sub(acc1[r], bias1));
+        } else {
+            int32_t tail[2 * K::kLanes];
+            K::store(tail, K::sub(acc0[r], bias0));
+            K::store(tail + K::kLanes, K::sub(acc1[r], bias1));
+            std::copy(tail, tail + cols, c + r * ldc);
+        }
+    }
+}
+
+// Dispatches "rows" (at most R) rows to "gemm_i8_block()" of a constant size
+template<typename... Args>
+void gemm_i8_rows(std::integral_constant<size_t, 0>, const size_t, Args...) {}
+
+template<size_t R, typename... Args>
+void gemm_i8_rows(std::integral_constant<size_t, R>, const size_t rows, Args... args) {
+    if (rows == R) {
+        gemm_i8_block<R>(args...);
+    } else {
+        gemm_i8_rows(std::integral_constant<size_t, R - 1>(), rows, args...);
+    }
+}
+
+// Multiplies 8-bit integer matrix(m,n) "a" by matrix(n,p) "b" into matrix(m,p)
+// "c" of exact 32-bit sums and computes sums of rows of "a" and columns of "b".
+// Both matrices are packed: rows of "a" are padded to whole groups, "b" is cut
+// to panels of 2 * kLanes columns with groups of rows interleaved, so a panel
+// is read sequentially. Rows of "c" are split between threads, every thread
+// sweeps its rows for every panel, which stays in cache.
+inline void gemm_i8(const size_t m, const size_t n, const size_t p, const int8_t *a, const int8_t *b,
+                    int32_t *c, int32_t *row_sums, int32_t *column_sums) {
+    using K = I8Kernel;
+    constexpr size_t kPanel = 2 * K::kLanes;
+    const size_t groups = (n + K::kGroup - 1) / K::kGroup;
+    const size_t lda = groups * K::kGroup;
+    const size_t panels = (p + kPanel - 1) / kPanel;
+    const size_t panel_size = groups * K::kGroup * kPanel;
+    std::vector<K::Elem> packed_a(m * lda, K::Elem());
+    std::vector<K::Elem> packed_b(panels * panel_size, K::Elem());
+    std::vector<int32_t> bias(panels * kPanel, 0);
+    for (size_t i = 0; i < m; ++i) {
+        int32_t sum = 0;
+        for (size_t k = 0; k < n; ++k) {
+            packed_a[i * lda + k] = K::lhs(a[i * n + k]);
+            sum += a[i * n + k];
+        }
+        row_sums[i] = sum;
+    }
+    std::fill(column_sums, column_sums + p, 0);
+    for (size_t k = 0; k < n; ++k) {
+        K::Elem *dst = packed_b.data() + (k / K::kGroup) * K::kGroup * kPanel + k % K::kGroup;
+        for (size_t j = 0; j < p; ++j) {
+            dst[(j / kPanel) * panel_size + (j % kPanel) * K::kGroup] = K::rhs(b[k * p + j]);
+            column_sums[j] += b[k * p + j];
+        }
+    }
+    for (size_t j = 0; j < p; ++j) {
+        bias[j] = K::kBias * column_sums[j];
+    }
+    const K::Elem *pa = packed_a.data();
+    const K::Elem *pb = packed_b.data();
+    const int32_t *pbias = bias.data();
+    parallel_for(0, m, 2 * m * n * p, [=](size_t first, size_t last) {
+        for (size_t q = 0; q < panels; ++q) {
+            const size_t cols = std::min(kPanel, p - q * kPanel);
+            for (size_t i = first; i < last; i += K::kRows) {
+                gemm_i8_rows(std::integral_constant<size_t, K::kRows>(), std::min(last - i, size_t(K::kRows)),
+                             pa + i * lda, lda, pb + q * panel_size, groups, pbias + q * kPanel,
+                             c + i * p + q * kPanel, p, cols);
+            }
+        }
+    });
+}
+#else
+// Multiplies 8-bit integer matrix(m,n) "a" by matrix(n,p) "b" into matrix(m,p)
+// "c" of exact 32-bit sums and computes sums of rows of "a" and columns of "b"
+inline void gemm_i8(const size_t m, const size_t n, const size_t p, const int8_t *a, const int8_t *b,
+                    int32_t *c, int32_t *row_sums, int32_t *column_sums) {
+    gemm_dot<int32_t>(m, n, p, a, b, c,
+                      [](const int8_t *x, const int8_t *y, size_t n) { return dot_widened<int32_t>(x, y, n); });
+    for (size_t i = 0; i < m; ++i) {
+        int32_t sum = 0;
+        for (size_t k = 0; k < n; ++k) {
+            sum += a[i * n + k];
+        }
+        row_sums[i] = sum;
+    }
+    std::fill(column_sums, column_sums + p, 0);
+    for (size_t k = 0; k < n; ++k) {
+        for (size_t j = 0; j < p; ++j) {
+            column_sums[j] += b[k * p + j];
+        }
+    }
+}
+#endif
+
+// Applies "r = f(x, y)" to elements of matrices(m,n), rows are split between threads
+template<typename R, typename T, typename T_, typename F>
+void combine(const size_t m, const size_t n, R *r, const size_t ldr,
+             const T *x, const size_t ldx, const T_ *y, const size_t ldy, F f) {
+    parallel_for(0, m, m * n, [=](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                r[i * ldr + j] = f(x[i * ldx + j], y[i * ldy + j]);
+            }
+        }
+    });
+}
+
+// The number of elements of workspace used by "winograd()"
+inline size_t winograd_workspace(const size_t m, const size_t n, const size_t p, const size_t crossover) {
+    if (std::min(m, std::min(n, p)) <= std::max<size_t>(crossover, 1)) {
+        return 0;
+    }
+    const size_t m2 = m / 2;
+    const size_t n2 = n / 2;
+    const size_t p2 = p / 2;
+    return m2 * n2 + n2 * p2 + m2 * p2 + winograd_workspace(m2, n2, p2, crossover);
+}
+
+// Multiplies matrix(m,n) "a" by matrix(n,p) "b" into matrix(m,p) "c" with the
+// Winograd variant of Strassen algorithm: 7 products of half sized blocks and
+// 15 additions instead of 8 products. Products are computed recursively until
+// a dimension is not greater than "crossover", then "gemm()" is used. Odd last
+// rows and columns are multiplied separately. Every level of recursion uses
+// "w" (see "winograd_workspace()") for three blocks holding sums of blocks of
+// "a", "b" and a product, the rest is passed to the next level. Blocks of "c"
+// hold intermediate products (Douglas et al. schedule):
+//   c21 = (a11 - a21)(b22 - b12)             = p7
+//   c22 = (a21 + a22)(b12 - b11)             = p5
+//   c12 = (a21 + a22 - a11)(b22 - b12 + b11) = p6
+//   c11 = (a12 - a21 - a22 + a11) b22        = p3
+//   z   = a11 b11                            = p1
+//   c12 = p1 + p6, c21 = c12 + p7, c12 += p5, c22 += c21, c12 += p3
+//   c11 = a22 (b22 - b12 + b11 - b21)        = p4, c21 -= p4
+//   c11 = a12 b21 + z                        = p2 + p1
+template<typename T, typename T_, typename R>
+void winograd(const size_t m, const size_t n, const size_t p, const T *a, const size_t lda,
+              const T_ *b, const size_t ldb, R *c, const size_t ldc, const size_t crossover, R *w) {
+    if (std::min(m, std::min(n, p)) <= std::max<size_t>(crossover, 1)) {
+        gemm(m, n, p, a, lda, b, ldb, c, ldc, false);
+        return;
+    }
+    const size_t m2 = m / 2;
+    const size_t n2 = n / 2;
+    const size_t p2 = p / 2;
+    R *x = w;            // matrix(m2,n2)
+    R *y = x + m2 * n2;  // matrix(n2,p2)
+    R *z = y + n2 * p2;  // matrix(m2,p2)
+    R *next = z + m2 * p2;
+    const T *a11 = a;
+    const T *a12 = a + n2;
+    const T *a21 = a + m2 * lda;
+    const T *a22 = a21 + n2;
+    const T_ *b11 = b;
+    const T_ *b12 = b + p2;
+    const T_ *b21 = b + n2 * ldb;
+    const T_ *b22 = b21 + p2;
+    R *c11 = c;
+    R *c12 = c + p2;
+    R *c21 = c + m2 * ldc;
+    R *c22 = c21 + p2;
+    const auto add = [](R lhs, R rhs) { return lhs + rhs; };
+    const auto sub = [](R lhs, R rhs) { return lhs - rhs; };
+    combine(m2, n2, x, n2, a11, lda, a21, lda, sub);
+    combine(n2, p2, y, p2, b22, ldb, b12, ldb, sub);
+    winograd(m2, n2, p2, x, n2, y, p2, c21, ldc, crossover, next);
+    combine(m2, n2, x, n2, a21, lda, a22, lda, add);
+    combine(n2, p2, y, p2, b12, ldb, b11, ldb, sub);
+    winograd(m2, n2, p2, x, n2, y, p2, c22, ldc, crossover, next);
+    combine(m2, n2, x, n2, x, n2, a11, lda, sub);
+    combine(n2, p2, y, p2, b22, ldb, y, p2, sub);
+    winograd(m2, n2, p2, x, n2, y, p2, c12, ldc, crossover, next);
+    combine(m2, n2, x, n2, a12, lda, x, n2, sub);
+    winograd(m2, n2, p2, x, n2, b22, ldb, c11, ldc, crossover, next);
+    winograd(m2, n2, p2, a11, lda, b11, ldb, z, p2, crossover, next);
+    combine(m2, p2, c12, ldc, c12, ldc, z, p2, add);
+    combine(m2, p2, c21, ldc, c21, ldc, c12, ldc, add);
+    combine(m2, p2, c12, ldc, c12, ldc, c22, ldc, add);
+    combine(m2, p2, c22, ldc, c22, ldc, c21, ldc, add);
+    combine(m2, p2, c12, ldc, c12, ldc, c11, ldc, add);
+    combine(n2, p2, y, p2, y, p2, b21, ldb, sub);
+    winograd(m2, n2, p2, a22, lda, y, p2, c11, ldc, crossover, next);
+    combine(m2, p2, c21, ldc, c21, ldc, c11, ldc, sub);
+    winograd(m2, n2, p2, a12, lda, b21, ldb, c11, ldc, crossover, next);
+    combine(m2, p2, c11, ldc, c11, ldc, z, p2, add);
+    if (n % 2 != 0) { // the last column of "a" by the last row of "b"
+        gemm(2 * m2, 1, 2 * p2, a + 2 * n2, lda, b + 2 * n2 * ldb, ldb, c, ldc, true);
+    }
+    if (p % 2 != 0) { // the last column of "c"
+        gemm(m, n, 1, a, lda, b + 2 * p2, ldb, c + 2 * p2, ldc, false);
+    }
+    if (m % 2 != 0) { // the last row of "c"
+        gemm(1, n, 2 * p2, a + 2 * m2 * lda, lda, b, ldb, c + 2 * m2 * ldc, ldc, false);
+    }
+}
+
+// Dot products of "kRows" rows of matrix "a" (rows are "n" elements apart) and
+// array "x" into "y". Every product is summed as by "dot_widened()", the rows
+// are independent chains of additions sharing loaded elements of "x".
+template<size_t kRows, typename R, typename T, typename T_>
+void dot_rows(const T *a, const T_ *x, const size_t n, R *y) {
+    constexpr size_t kLanes = 8;
+    R acc[kRows][kLanes] = {};
+    const size_t end = n - n % kLanes;
+    for (size_t k = 0; k < end; k += kLanes) {
+        for (size_t r = 0; r < kRows; ++r) {
+            for (size_t j = 0; j < kLanes; ++j) {
+                acc[r][j] += static_cast<R>(a[r * n + k + j]) * static_cast<R>(x[k + j]);
+            }
+        }
+    }
+    for (size_t r = 0; r < kRows; ++r) {
+        R tail = 0;
+        for (size_t k = end; k < n; ++k) {
+            tail += static_cast<R>(a[r * n + k]) * static_cast<R>(x[k]);
+        }
+        const R *lanes = acc[r];
+        y[r] = ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7])) + tail;
+    }
+}
+
+// Multiplies matrix(m,n) "a" by vector(n) "x" into vector(m) "y". Rows of "a"
+// are contiguous, so every element of "y" is a vectorized dot product, four
+// rows are processed at once. Rows are split between threads.
+template<typename R, typename T, typename T_>
+void gemv(const size_t m, const size_t n, const T *a, const T_ *x, R *y) {
+    parallel_for(0, m, 2 * m * n, [=](size_t first, size_t last) {
+        size_t i = first;
+        for ( ; i + 4 <= last; i += 4) {
+            dot_rows<4>(a + i * n, x, n, y + i);
+        }
+        for ( ; i < last; ++i) {
+            dot_rows<1>(a + i * n, x, n, y + i);
+        }
+    });
+}
+
+// Multiplies vector(m) "x" by matrix(m,n) "a" into vector(n) "y". Scaled rows
+// of "a" are added to "y" in order, four rows at once, so "a" is read
+// contiguously. Columns are split between threads.
+template<typename R, typename T, typename T_>
+void gevm(const size_t m, const size_t n, const T *x, const T_ *a, R *y) {
+    parallel_for(0, n, 2 * m * n, [=](size_t first, size_t last) {
+        std::fill(y + first, y + last, R(0));
+        size_t i = 0;
+        for ( ; i + 4 <= m; i += 4) {
+            const R x0 = static_cast<R>(x[i]);
+            const R x1 = static_cast<R>(x[i + 1]);
+            const R x2 = static_cast<R>(x[i + 2]);
+            const R x3 = static_cast<R>(x[i + 3]);
+            const T_ *a0 = a + i * n;
+            const T_ *a1 = a0 + n;
+            const T_ *a2 = a1 + n;
+            const T_ *a3 = a2 + n;
+            for (size_t j = first; j < last; ++j) {
+                y[j] = (((y[j] + x0 * static_cast<R>(a0[j])) + x1 * static_cast<R>(a1[j])) +
+                        x2 * static_cast<R>(a2[j])) + x3 * static_cast<R>(a3[j]);
+            }
+        }
+        for ( ; i < m; ++i) {
+            const R xi = static_cast<R>(x[i]);
+            const T_ *ai = a + i * n;
+            for (size_t j = first; j < last; ++j) {
+                y[j] += xi * static_cast<R>(ai[j]);
+            }
+        }
+    });
+}
+
+// Multiplies matrix(m,n) "a" by k vectors(n) being rows of "x" into k vectors(m)
+// being rows of "y". Blocks of rows of "a" fitting in cache are multiplied by
+// all vectors, so the matrix is read from memory once instead of k times.
+template<typename R, typename T, typename T_>
+void gemv_batched(const size_t m, const size_t n, const size_t k, const T *a, const T_ *x, R *y) {
+    constexpr size_t kBlockBytes = 256 * 1024;
+    const size_t block = std::max<size_t>(1, kBlockBytes / (sizeof(T) * n + 1));
+    parallel_for(0, m, 2 * m * n * k, [=](size_t first, size_t last) {
+        for (size_t i0 = first; i0 < last; i0 += block) {
+            const size_t i1 = std::min(last, i0 + block);
+            for (size_t v = 0; v < k; ++v) {
+                size_t i = i0;
+                for ( ; i + 4 <= i1; i += 4) {
+                    dot_rows<4>(a + i * n, x + v * n, n, y + v * m + i);
+                }
+                for ( ; i < i1; ++i) {
+                    dot_rows<1>(a + i * n, x + v * n, n, y + v * m + i);
+                }
+            }
+        }
+    });
+}
+
+// Applies "y[i] = f(x[i], y[i])" to arrays of "n" elements split between threads
+template<typename R, typename T, typename F>
+void update(const size_t n, const T *x, R *y, F f) {
+    parallel_for(0, n, 2 * n, [=](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            y[i] = f(x[i], y[i]);
+        }
+    });
+}
+// Applies "y[i] = f(x[i])" to arrays of "n" elements split between threads.
+// Blocks of results are written into a local buffer first: it can't overlap
+// "x", so loops are vectorized without checks of aliasing.
+template<typename R, typename T, typename F>
+void transform(const size_t n, const T *x, R *y, F f) {
+    parallel_for(0, n, n, [=](size_t first, size_t last) {
+        constexpr size_t kBlock = 64;
+        R block[kBlock];
+        size_t i = first;
+        for (; i + kBlock <= last; i += kBlock) {
+            for (size_t j = 0; j < kBlock; ++j) {
+                block[j] = f(x[i + j]);
+            }
+            std::copy(block, block + kBlock, y + i);
+        }
+        for (; i < last; ++i) {
+            y[i] = f(x[i]);
+        }
+    });
+}
+// Applies "r[i] = f(x[i], y[i])" to arrays of "n" elements the same way
+template<typename R, typename T, typename T_, typename F>
+void transform(const size_t n, const T *x, const T_ *y, R *r, F f) {
+    parallel_for(0, n, n, [=](size_t first, size_t last) {
+        constexpr size_t kBlock = 64;
+        R block[kBlock];
+        size_t i = first;
+        for (; i + kBlock <= last; i += kBlock) {
+            for (size_t j = 0; j < kBlock; ++j) {
+                block[j] = f(x[i + j], y[i + j]);
+            }
+            std::copy(block, block + kBlock, r + i);
+        }
+        for (; i < last; ++i) {
+            r[i] = f(x[i], y[i]);
+        }
+    });
+}
+
+// Copies "n" elements of array "src" into heap or user data of type T. Elements
+// of the same trivially copyable type are moved in bulk by "memmove" (the C
+// library switches to non-temporal stores for large arrays itself). Arithmetic
+// types are converted by vectorized "transform()", other ones by "convert()".
+template<typename T, typename T_>
+void convert_bulk(const T_ *src, T *dst, const size_t n, std::true_type /*arithmetic*/) {
+    transform(n, src, dst, [](const T_ x) { return static_cast<T>(x); });
+}
+template<typename T, typename T_>
+void convert_bulk(const T_ *src, T *dst, const size_t n, std::false_type /*arithmetic*/) {
+    convert(src, dst, n);
+}
+template<typename T>
+void copy(const T *src, T *dst, const size_t n, std::true_type /*bulk*/) {
+    if (n) {
+        std::memmove(dst, src, sizeof(T) * n);
+    }
+}
+template<typename T, typename T_>
+void copy(const T_ *src, T *dst, const size_t n, std::false_type /*bulk*/) {
+    convert_bulk(src, dst, n, std::integral_constant<bool, std::is_arithmetic<T>::value && std::is_arithmetic<T_>::value>());
+}
+template<typename T, typename T_>
+void copy(const T_ *src, T *dst, const size_t n) {
+    copy(src, dst, n, std::integral_constant<bool, std::is_same<T, T_>::value && std::is_trivially_copyable<T>::value>());
+}
+
+#ifdef MATRIX_STREAM_
+// Fills array of "n" elements with "val" by non-temporal stores of 16 bytes
+template<typename T>
+void stream_fill(T *dst, const size_t n, const T &val) {
+    constexpr size_t kLanes = 16 / sizeof(T);
+    size_t i = 0;
+    for (; (i < n) && (reinterpret_cast<uintptr_t>(dst + i) % 16); ++i) {
+        dst[i] = val; // till the aligned address
+    }
+    T lanes[kLanes];
+    for (size_t j = 0; j < kLanes; ++j) {
+        lanes[j] = val;
+    }
+    const __m128i pattern = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes));
+    for (; i + kLanes <= n; i += kLanes) {
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i), pattern);
+    }
+    _mm_sfence(); // make the stores visible to other threads
+    for (; i < n; ++i) {
+        dst[i] = val;
+    }
+}
+#endif
+
+// Fills data of "n" elements with "val". Trivially copyable values made of the
+// same bytes (e.g. zeros) are set by "memset", other ones by blocks of known
+// size, which are vectorized. Large matrices placed in the memory which was in
+// use before ("resident") are filled by non-temporal stores. Pages which were
+// just allocated are zeroed by the system on the first touch and stay in the
+// cache, so regular stores are faster for them.
+template<typename T>
+void fill(T *dst, const size_t n, const T &val, const bool resident, std::true_type /*trivial*/) {
+#ifdef MATRIX_STREAM_
+    if (resident && (16 % sizeof(T) == 0) && (sizeof(T) * n >= MATRIX_STREAM_BYTES_MIN_)) {
+        stream_fill(dst, n, val);
+        return;
+    }
+#endif
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, &val, sizeof(T));
+    if (std::all_of(bytes, bytes + sizeof(T), [&](unsigned char b) { return b == bytes[0]; })) {
+        std::memset(dst, bytes[0], sizeof(T) * n);
+        return;
+    }
+    constexpr size_t kBlock = 64;
+    const T v = val;
+    const size_t blocks = n / kBlock;
+    for (size_t b = 0; b < blocks; ++b) {
+        for (size_t j = 0; j < kBlock; ++j) {
+            dst[b * kBlock + j] = v;
+        }
+    }
+    for (size_t i = blocks * kBlock; i < n; ++i) {
+        dst[i] = v;
+    }
+}
+template<typename T>
+void fill(T *dst, const size_t n, const T &val, const bool /*resident*/, std::false_type /*trivial*/) {
+    for (size_t i = 0; i < n; ++i) {
+        dst[i] = val;
+    }
+}
+template<typename T>
+void fill(T *dst, const size_t n, const T &val, const bool resident) {
+    fill(dst, n, val, resident, std::is_trivially_copyable<T>());
+}
+
+// Floating point type used by factorizations of matrices with elements of type T
+template<typename T>
+using floating_t = std::conditional_t<std::is_floating_point<T>::value, T, double>;
+
+} // namespace detail
+
+
+
+// Allocation policies
+//
+// Policy of heap allocations of large matrices (at least one huge page of 2 MB)
+// with elements of trivial types. The policy actually applied to the matrix is
+// returned by "allocation_policy()" of the HEAP matrix: it falls back when the
+// system doesn't support the requested one (policies are implemented on Linux).
+enum class MatrixAllocationPolicy {
+    DEFAULT,                // memory of the C library
+    TRANSPARENT_HUGE_PAGES, // fresh pages advised to be backed by transparent huge pages
+    EXPLICIT_HUGE_PAGES,    // huge pages of the reserved pool (see "vm.nr_hugepages"),
+                            // TRANSPARENT_HUGE_PAGES are used when the pool is exhausted
+    INTERLEAVE,             // fresh pages interleaved between NUMA nodes
+    FIRST_TOUCH             // fresh pages touched in parallel by the chunks of rows of parallel
+                            // kernels, so they are spread between NUMA nodes of the threads
+                            // (which aren't pinned to processors, so a page isn't guaranteed
+                            // to be local to the thread later processing its rows)
+};
+
+namespace detail {
+
+constexpr size_t kHugePageSize = size_t(2) << 20;
+
+inline std::atomic<MatrixAllocationPolicy>& allocation_policy_setting() {
+    static std::atomic<MatrixAllocationPolicy> policy{ MatrixAllocationPolicy::DEFAULT };
+    return policy;
+}
+
+// Size of the mapping of whole huge pages for "bytes" of data
+constexpr size_t mapping_size(const size_t bytes) {
+    return (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+}
+
+#ifdef MATRIX_MMAP_
+// Maps fresh zeroed pages aligned to the huge page size, so that they may be
+// backed by huge pages. Returns "nullptr" on failure.
+inline void* map_aligned(const size_t size) {
+    void *mem = mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(mem);
+    const uintptr_t aligned = (addr + kHugePageSize - 1) & ~static_cast<uintptr_t>(kHugePageSize - 1);
+    if (aligned != addr) {
+        munmap(mem, aligned - addr);
+    }
+    if (aligned - addr != kHugePageSize) {
+        munmap(reinterpret_cast<void*>(aligned + size), kHugePageSize - (aligned - addr));
+    }
+    return reinterpret_cast<void*>(aligned);
+}
+
+// Maps "size" bytes (whole huge pages) of zeroed memory by the policy. The
+// policy is replaced by the applied one. Returns "nullptr" on failure.
+inline void* map(const size_t size, MatrixAllocationPolicy &policy) {
+    using P = MatrixAllocationPolicy;
+#ifdef MAP_HUGETLB
+    if (policy == P::EXPLICIT_HUGE_PAGES) {
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            return mem;
+        }
+    }
+#endif
+    if (policy == P::EXPLICIT_HUGE_PAGES) {
+        policy = P::TRANSPARENT_HUGE_PAGES;
+    }
+    void *mem = map_aligned(size);
+    if (!mem) {
+        policy = P::DEFAULT;
+        return nullptr;
+    }
+    bool applied = true;
+    if (policy == P::TRANSPARENT_HUGE_PAGES) {
+#ifdef MADV_HUGEPAGE
+        applied = (madvise(mem, size, MADV_HUGEPAGE) == 0);
+#else
+        applied = false;
+#endif
+    } else if (policy == P::INTERLEAVE) {
+#ifdef SYS_mbind
+        // All nodes are requested, the system leaves the allowed ones. The mask
+        // has a spare zero word since the system skips the last given bit.
+        const unsigned long nodes[2] = { ~0UL, 0UL };
+        const int kInterleave = 3; // MPOL_INTERLEAVE
+        applied = (syscall(SYS_mbind, mem, size, kInterleave, nodes, sizeof(nodes[0]) * 8 + 1, 0) == 0);
+#else
+        applied = false;
+#endif
+    }
+    if (!applied) {
+        policy = P::DEFAULT; // the pages are left as they are
+    }
+    return mem;
+}
+
+// Touches pages of matrix of "n" elements in "rows" rows by the chunks of rows
+// of "parallel_for()", which split rows as parallel kernels do. A page spanning
+// two chunks is touched by the thread of the chunk where it starts.
+template<typename T>
+void touch(T *data, const size_t n, const size_t rows) {
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t row_bytes = sizeof(T) * (n / rows);
+    char *bytes = reinterpret_cast<char*>(data);
+    parallel_for(0, rows, MATRIX_PARALLEL_WORK_MIN_, [=](size_t first, size_t last) {
+        for (size_t i = (first * row_bytes + page - 1) / page * page; i < last * row_bytes; i += page) {
+            bytes[i] = 0; // the memory is zeroed already
+        }
+    });
+}
+#endif // #ifdef MATRIX_MMAP_
+
+// Whether all bytes of the value are zero. Such values are the ones of zeroed
+// memory (e.g. integer and floating point zeros, but not negative zero).
+template<typename T>
+bool zero_bytes(const T &val, std::true_type /*trivial*/) {
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, &val, sizeof(T));
+    return std::all_of(bytes, bytes + sizeof(T), [](unsigned char b) { return b == 0; });
+}
+template<typename T>
+bool zero_bytes(const T &, std::false_type /*trivial*/) {
+    return false;
+}
+
+// Memory of the C library ("calloc" if zeroed) of "bytes" aligned to
+// "alignment". Blocks of types aligned beyond "std::max_align_t" have a margin,
+// the offset of the aligned address is stored right before it. Returns
+// "nullptr" on failure, the memory is freed by "aligned_free()".
+inline void* aligned_malloc(const size_t bytes, const size_t alignment, const bool zero) {
+    if (alignment <= alignof(std::max_align_t)) {
+        return zero ? std::calloc(bytes, 1) : std::malloc(bytes);
+    }
+    if (bytes > std::numeric_limits<size_t>::max() - alignment) {
+        return nullptr;
+    }
+    void *raw = zero ? std::calloc(bytes + alignment, 1) : std::malloc(bytes + alignment);
+    if (!raw) {
+        return nullptr;
+    }
+    // the margin is at least "alignof(std::max_align_t)" bytes, enough for the offset
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(raw);
+    const uintptr_t aligned = (addr + alignment) & ~static_cast<uintptr_t>(alignment - 1);
+    const size_t offset = aligned - addr;
+    std::memcpy(reinterpret_cast<char*>(aligned) - sizeof(offset), &offset, sizeof(offset));
+    return reinterpret_cast<void*>(aligned);
+}
+inline void aligned_free(void *mem, const size_t alignment) {
+    if ((alignment <= alignof(std::max_align_t)) || !mem) {
+        std::free(mem);
+        return;
+    }
+    size_t offset;
+    std::memcpy(&offset, static_cast<char*>(mem) - sizeof(offset), sizeof(offset));
+    std::free(static_cast<char*>(mem) - offset);
+}
+
+// Whether "new" doesn't align type T (before C++17)
+template<typename T>
+using over_aligned = std::integral_constant<bool, (alignof(T) > alignof(std::max_align_t))>;
+
+// Array of "n" default constructed elements, over-aligned types are
+// constructed in place in aligned memory
+template<typename T>
+T* new_array(const size_t n, std::false_type /*over-aligned*/) {
+    return new T[n];
+}
+template<typename T>
+T* new_array(const size_t n, std::true_type /*over-aligned*/) {
+    if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+        throw std::bad_alloc();
+    }
+    T *mem = static_cast<T*>(aligned_malloc(sizeof(T) * n, alignof(T), false));
+    if (!mem && n) {
+        throw std::bad_alloc();
+    }
+    size_t i = 0;
+    try {
+        for ( ; i < n; ++i) {
+            new (mem + i) T;
+        }
+    } catch (...) {
+        while (i > 0) {
+            mem[--i].~T();
+        }
+        aligned_free(mem, alignof(T));
+        throw;
+    }
+    return mem;
+}
+template<typename T>
+void delete_array(T *mem, const size_t /*n*/, std::false_type /*over-aligned*/) {
+    delete[] mem;
+}
+template<typename T>
+void delete_array(T *mem, size_t n, std::true_type /*over-aligned*/) {
+    if (mem) {
+        while (n > 0) {
+            mem[--n].~T();
+        }
+        aligned_free(mem, alignof(T));
+    }
+}
+
+// Heap memory for "n" elements of type T in "rows" rows (see "touch()")
+// allocated by the policy, which is replaced by the applied one. Trivial
+// elements of small matrices are allocated by the C library and aren't
+// initialized. Zeroed memory is allocated by "calloc": large blocks are fresh
+// pages mapped by the system, which are zeroed lazily on the first touch.
+// Other elements are default constructed by "new[]".
+// Memory of over-aligned types is aligned by "aligned_malloc()".
+template<typename T>
+T* allocate(const size_t n, const size_t rows, const bool zero, MatrixAllocationPolicy &policy, std::true_type /*trivial*/) {
+    if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+        throw std::bad_alloc();
+    }
+#ifdef MATRIX_MMAP_
+    if ((policy != MatrixAllocationPolicy::DEFAULT) && (sizeof(T) * n >= kHugePageSize)) {
+        if (T *mem = static_cast<T*>(map(mapping_size(sizeof(T) * n), policy))) {
+            if (policy == MatrixAllocationPolicy::FIRST_TOUCH) {
+                touch(mem, n, rows);
+            }
+            return mem;
+        }
+    }
+#endif
+    policy = MatrixAllocationPolicy::DEFAULT;
+    void *mem = aligned_malloc(sizeof(T) * n, alignof(T), zero);
+    if (!mem && n) {
+        throw std::bad_alloc();
+    }
+    return static_cast<T*>(mem);
+}
+template<typename T>
+T* allocate(const size_t n, const size_t /*rows*/, const bool /*zero*/, MatrixAllocationPolicy &policy, std::false_type /*trivial*/) {
+    policy = MatrixAllocationPolicy::DEFAULT;
+    return new_array<T>(n, over_aligned<T>());
+}
+template<typename T>
+T* allocate(const size_t n, const size_t rows, const bool zero, MatrixAllocationPolicy &policy) {
+    return allocate<T>(n, rows, zero, policy, std::is_trivial<T>());
+}
+template<typename T>
+void deallocate(T *mem, const size_t n, const MatrixAllocationPolicy policy, std::true_type /*trivial*/) {
+#ifdef MATRIX_MMAP_
+    if (policy != MatrixAllocationPolicy::DEFAULT) {
+        if (mem) {
+            munmap(mem, mapping_size(sizeof(T) * n));
+        }
+        return;
+    }
+#endif
+    aligned_free(mem, alignof(T));
+}
+template<typename T>
+void deallocate(T *mem, const size_t n, const MatrixAllocationPolicy /*policy*/, std::false_type /*trivial*/) {
+    delete_array(mem, n, over_aligned<T>());
+}
+template<typename T>
+void deallocate(T *mem, const size_t n, const MatrixAllocationPolicy policy) {
+    deallocate(mem, n, policy, std::is_trivial<T>());
+}
+
+// Tag of constructors leaving elements of trivial types uninitialized
+struct Uninitialized {};
+
+} // namespace detail
+
+// Sets the policy of heap allocations of large matrices made by all threads
+// ("DEFAULT" by default). Matrices allocated before keep their policies.
+inline void set_matrix_allocation_policy(const MatrixAllocationPolicy policy) {
+    detail::allocation_policy_setting().store(policy, std::memory_order_relaxed);
+}
+// Returns the requested policy of heap allocations
+inline MatrixAllocationPolicy matrix_allocation_policy() {
+    return detail::allocation_policy_setting().load(std::memory_order_relaxed);
+}
+
+
+
+// Memory managemant of a matrix
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+class MatrixData; // only stack, heap, user and shared types of memory are allowed
+
+// Allocates matrix on stack. Suitable for small matrix size. Elements are
+// initialized (with default values by default), so the matrix is usable in
+// constant expressions.
+template<typename T, size_t M, size_t N>
+class MatrixData<T, M, N, MatrixDataStorage::STACK> : private detail::StackDataCounter {
+  private:
+    T data_[M * N];
+
+  public:
+    constexpr MatrixData() : data_() {}
+    explicit MatrixData(detail::Uninitialized) {}
+    template<typename T_>
+    constexpr explicit MatrixData(T_ &&val) : data_() {
+        for (size_t i = 0; i < M * N; ++i) {
+            data_[i] = static_cast<T>(val);
+        }
+    }
+    template<typename T_>
+    constexpr explicit MatrixData(T_ *arr) : data_() {
+        detail::convert(arr, data_, M * N);
+    }
+    template<typename T_>
+    constexpr explicit MatrixData(std::initializer_list<T_> init) : data_() {
+        const T_ *it = init.begin();
+        const size_t size = std::min(init.size(), M * N); // prevent overflow
+        for (size_t i = 0; i < size; ++i) {
+            data_[i] = static_cast<T>(it[i]);
+        } // the rest is filled with default elements
+    }
+
+    ~MatrixData() = default;                                  // destructor
+    MatrixData(const MatrixData &other) = default;            // copy constructor
+    MatrixData(MatrixData &&other) = default;                 // move constructor
+    MatrixData& operator=(const MatrixData &other) = default; // copy assignment
+    MatrixData& operator=(MatrixData &&other) = default;      // move assignment
+
+    constexpr const T* const read() const { return data_; } // read-only access
+    constexpr T* write() { return data_; }                  // read and write access
+};
+
+// Allocates matrix on heap. Suitable for large matrix size.
+template<typename T, size_t M, size_t N>
+class MatrixData<T, M, N, MatrixDataStorage::HEAP> {
+  private:
+    T *data_;
+    MatrixAllocationPolicy policy_; // applied policy of the allocation
+
+    void allocate(const bool zero = false) {
+        policy_ = matrix_allocation_policy();
+        data_ = detail::allocate<T>(M * N, M, zero, policy_);
+        MATRIX_STATS_(++detail::stats<MatrixDataStorage::HEAP>().allocations);
+        MATRIX_STATS_(detail::stats<MatrixDataStorage::HEAP>().bytes_allocated += sizeof(T) * M * N);
+    }
+
+  public:
+    MatrixData() {
+        allocate();
+    }
+    explicit MatrixData(detail::Uninitialized) : MatrixData() {}
+    template<typename T_>
+    explicit MatrixData(T_ &&val) {
+        const T v = static_cast<T>(val);
+        const bool zero = detail::zero_bytes(v, std::is_trivial<T>()); // zeroed memory is already filled
+        allocate(zero);
+        try {
+            if (!zero) {
+                detail::fill(data_, M * N, v, false);
+            }
+        } catch (...) {
+            // Free critical resource in case of exception in constructor
+            detail::deallocate(data_, M * N, policy_);
+            throw;
+        }
+    }
+    template<typename T_>
+    explicit MatrixData(T_ *arr) {
+        allocate();
+        try {
+            detail::copy(arr, data_, M * N);
+        } catch (...) {
+            // Free critical resource in case of exception in constructor
+            detail::deallocate(data_, M * N, policy_);
+            throw;
+        }
+    }
+    template<typename T_>
+    explicit MatrixData(std::initializer_list<T_> init) {
+        allocate();
+        try {
+            if (init.size() > M * N) {
+                auto end = init.begin();
+                std::advance(end, M * N); // prevent overflow
+                size_t i = 0;
+                for (auto it = init.begin(); it != end; ++it) {
+                    data_[i++] = static_cast<T>(*it);
+                }
+            } else {
+                size_t i = 0;
+                for (auto &val : init) {
+                    data_[i++] = static_cast<T>(val);
+                }
+                std::fill(data_ + i, data_ + M * N, T()); // fill with default elements
+            }
+        } catch (...) {
+            // Free critical resource in case of exception in constructor
+            detail::deallocate(data_, M * N, policy_);
+            throw;
+        }
+    }
+
+    ~MatrixData() {
+        MATRIX_STATS_(if (data_) { ++detail::stats<MatrixDataStorage::HEAP>().deallocations; });
+        detail::deallocate(data_, M * N, policy_);
+    }
+    MatrixData(const MatrixData &other) {
+        MATRIX_STATS_((detail::count_copy<T, T, MatrixDataStorage::HEAP>()));
+        allocate();
+        try {
+            detail::copy(other.data_, data_, M * N);
+        } catch (...) {
+            // Free critical resource in case of exception in constructor
+            detail::deallocate(data_, M * N, policy_);
+            throw;
+        }
+    }
+    MatrixData(MatrixData &&other) : data_(other.data_), policy_(other.policy_) {
+        MATRIX_STATS_(++detail::stats<MatrixDataStorage::HEAP>().moves);
+        other.data_ = nullptr;
+    }
+    MatrixData& operator=(const MatrixData &other) {
+        // Just copy values, matrices have the same size
+        if (this != &other) { // avoid self-copy
+            MATRIX_STATS_((detail::count_copy<T, T, MatrixDataStorage::HEAP>()));
+            detail::copy(other.data_, data_, M * N);
+        }
+        return *this;
+    }
+    MatrixData& operator=(MatrixData &&other) {
+        if (this != &other) { // prevent self-move
+            MATRIX_STATS_(++detail::stats<MatrixDataStorage::HEAP>().moves);
+            // Previous data from current matrix will be automatically destructed
+            std::swap(data_, other.data_);
+            std::swap(policy_, other.policy_);
+        }
+        return *this;
+    }
+
+    const T* const read() const { return data_; }
+    T* write() { return data_; }
+    MatrixAllocationPolicy policy() const { return policy_; }
+};
+
+// Allocates matrix in the memory given by the pointer. Allocation, deallocation
+// and memory size should be handled by user himself.
+template<typename T, size_t M, size_t N>
+class MatrixData<T, M, N, MatrixDataStorage::USER> {
+  private:
+    T *data_;
+
+  public:
+    explicit MatrixData(T *mem) {
+        data_ = mem;
+    }
+    template<typename T_>
+    MatrixData(T *mem, T_ &&val) {
+        data_ = mem;
+        detail::fill(data_, M * N, static_cast<T>(val), true);
+    }
+    template<typename T_>
+    MatrixData(T *mem, T_ *arr) {
+        data_ = mem;
+        detail::copy(arr, data_, M * N);
+    }
+    template<typename T_>
+    MatrixData(std::initializer_list<T_> init) = delete; // memory isn't specified
+
+    ~MatrixData() = default;
+    // Copy constructor is prohibited because the destination memory location
+    // isn't known.
+    MatrixData(const MatrixData &other) = delete;
+    MatrixData(MatrixData &&other) : data_(other.data_) {
+        MATRIX_STATS_(++detail::stats<MatrixDataStorage::USER>().moves);
+    }
+    MatrixData& operator=(const MatrixData &other) {
+        // Just copy values, matrices have the same size
+        if (this != &other) { // avoid self-copy
+            MATRIX_STATS_((detail::count_copy<T, T, MatrixDataStorage::USER>()));
+            detail::copy(other.data_, data_, M * N);
+        }
+        return *this;
+    }
+    MatrixData& operator=(MatrixData &&other) {
+        if (this != &other) { // prevent self-move
+            MATRIX_STATS_(++detail::stats<MatrixDataStorage::USER>().moves);
+            data_ = other.data_;
+        }
+        return *this;
+    }
+
+    const T* const read() const { return data_; }
+    T* write() { return data_; }
+};
+
+// Allocates matrix on heap together with an atomic reference counter. Copies
+// share the data, so copying is O(1) and the same memory may be read by several
+// threads. The data is copied on "write()" of a matrix sharing it with others,
+// so a pointer returned by "write()" is valid until the matrix is copied.
+template<typename T, size_t M, size_t N>
+class MatrixData<T, M, N, MatrixDataStorage::SHARED> {
+  private:
+    struct Block {
+        std::atomic<size_t> refs{ 1 };
+        T data[M * N];
+
+        // "new" doesn't align over-aligned types before C++17
+        static void* operator new(const size_t size) {
+            void *mem = detail::aligned_malloc(size, alignof(Block), false);
+            if (!mem) {
+                throw std::bad_alloc();
+            }
+            return mem;
+        }
+        static void operator delete(void *mem) {
+            detail::aligned_free(mem, alignof(Block));
+        }
+    };
+    Block *block_;
+
+    static Block* allocate() {
+        Block *block = new Block;
+        MATRIX_STATS_(++detail::stats<MatrixDataStorage::SHARED>().allocations);
+        MATRIX_STATS_(detail::stats<MatrixDataStorage::SHARED>().bytes_allocated += sizeof(Block));
+        return block;
+    }
+    // Drops the reference to the data, the last one frees it
+    void release() {
+        if (block_ && (block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)) {
+            MATRIX_STATS_(++detail::stats<MatrixDataStorage::SHARED>().deallocations);
+            delete block_;
+        }
+    }
+
+  public:
+    MatrixData() {
+        block_ = allocate();
+    }
+    explicit MatrixData(detail::Uninitialized) : MatrixData() {}
+    template<typename T_>
+    explicit MatrixData(T_ &&val) {
+        block_ = allocate();
+        try {
+            detail::fill(block_->data, M * N, static_cast<T>(val), false);
+        } catch (...) {
+            // Free critical resource in case of exception in constructor
+            delete block_;
+            throw;
+        }
+    }
+    template<typename T_>
+    explicit MatrixData(T_ *arr) {
+        block_ = allocate();
+        try {
+            detail::copy(arr, block_->data, M * N);
+        } catch (...) {
+            // Free critical resource in case of exception in constructor
+            delete block_;
+            throw;
+        }
+    }
+    template<typename T_>
+    explicit MatrixData(std::initializer_list<T_> init) {
+        block_ = allocate();
+        try {
+            const T_ *it = init.begin();
+            const size_t size = std::min(init.size(), M * N); // prevent overflow
+            size_t i = 0;
+            for (; i < size; ++i) {
+                block_->data[i] = static_cast<T>(it[i]);
+            }
+            for (; i < M * N; ++i) {
+                block_->data[i] = T(); // fill with default elements
+            }
+        } catch (...) {
+            // Free critical resource in case of exception in constructor
+            delete block_;
+            throw;
+        }
+    }
+
+    ~MatrixData() {
+        release();
+    }
+    MatrixData(const MatrixData &other) : block_(other.block_) {
+        MATRIX_STATS_(++detail::stats<MatrixDataStorage::SHARED>().shares);
+        block_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    MatrixData(MatrixData &&other) : block_(other.block_) {
+        MATRIX_STATS_(++detail::stats<MatrixDataStorage::SHARED>().moves);
+        other.block_ = nullptr;
+    }
+    MatrixData& operator=(const MatrixData &other) {
+        // Share the data instead of copying values
+        if (block_ != other.block_) { // avoid self-copy
+            MATRIX_STATS_(++detail::stats<MatrixDataStorage::SHARED>().shares);
+            other.block_->refs.fetch_add(1, std::memory_order_relaxed);
+            release();
+            block_ = other.block_;
+        }
+        return *this;
+    }
+    MatrixData& operator=(MatrixData &&other) {
+        if (this != &other) { // prevent self-move
+            MATRIX_STATS_(++detail::stats<MatrixDataStorage::SHARED>().moves);
+            // Previous data from current matrix will be automatically released
+            std::swap(block_, other.block_);
+        }
+        return *this;
+    }
+
+    const T* const read() const { return block_->data; }
+    T* write() {
+        // The acquire load pairs with the release of the other copies, so the
+        // last owner may safely write without copying
+        if (block_->refs.load(std::memory_order_acquire) != 1) {
+            MATRIX_STATS_((detail::count_copy<T, T, MatrixDataStorage::SHARED>()));
+            Block *block = allocate();
+            try {
+                detail::copy(block_->data, block->data, M * N);
+            } catch (...) {
+                delete block;
+                throw;
+            }
+            release();
+            block_ = block;
+        }
+        return block_->data;
+    }
+};
+
+
+
+// Matrix layout:
+//         N
+//   x - - - >
+//   |0,0 0,1
+// M |1,0 1,1
+//   v
+template<typename T, size_t M, size_t N, MatrixDataStorage S = MatrixDataStorage::UNSPECIFIED>
+class Matrix; // by default storage is automatically chosen based on matrix size
+
+// Matrix on stack (explicitly set)
+template<typename T, size_t M, size_t N>
+class Matrix<T, M, N, MatrixDataStorage::STACK> {
+  private:
+    MatrixData<T, M, N, MatrixDataStorage::STACK> md_;
+
+    explicit Matrix(detail::Uninitialized tag) : md_(tag) {}
+
+  public:
+    constexpr Matrix() : md_() {}
+    template<typename T_>
+    constexpr explicit Matrix(T_ &&val) : md_(std::forward<T_>(val)) {} // perfect forwarding for large objects
+    template<typename T_>
+    constexpr explicit Matrix(T_ *arr) : md_(arr) {}
+    template<typename T_>
+    constexpr Matrix(std::initializer_list<T_> init) : md_(init) {}
+    // Elements of trivial types are left uninitialized, their values should be
+    // written before they are read
+    static Matrix uninitialized() { return Matrix(detail::Uninitialized()); }
+
+    ~Matrix() = default;
+    Matrix(const Matrix &other) = default;
+    Matrix(Matrix &&other) = default;
+    Matrix& operator=(const Matrix &other) = default;
+    Matrix& operator=(Matrix &&other) = default;
+
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) : md_(other.read()) { // copy from UNSPECIFIED
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::STACK>()));
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) : md_(other.read()) { // converts value type
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::STACK>()));
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) : md_(other.read()) { // copy from HEAP
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::STACK>()));
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) : md_(other.read()) { // copy from USER
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::STACK>()));
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::SHARED> &other) : md_(other.read()) { // copy from SHARED
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::STACK>()));
+    }
+
+    constexpr const T* const read() const { return md_.read(); } // read-only access
+    constexpr T* write() { return md_.write(); }                 // read and write access
+    void print() {
+        const T* const arr = read();
+        for (size_t i = 0; i < M * N; ) {
+            std::cout << arr[i];
+            std::cout << (!(++i % N) ? '\n' : ' ');
+        }
+        std::cout << std::endl;
+    }
+
+    template<typename T_, MatrixDataStorage S_>
+    MATRIX_CONSTEXPR_ Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("add_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::STACK, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::STACK>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] += static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_, MatrixDataStorage S_>
+    MATRIX_CONSTEXPR_ Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("sub_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::STACK, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::STACK>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] -= static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix& operator*=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("scale_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::STACK));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::STACK>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] *= static_cast<T>(other);
+        }
+        return *this;
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix& operator/=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("div_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::STACK));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::STACK>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] /= static_cast<T>(other);
+        }
+        return *this;
+    }
+};
+
+// Matrix on heap (explicitly set)
+template<typename T, size_t M, size_t N>
+class Matrix<T, M, N, MatrixDataStorage::HEAP> {
+  private:
+    MatrixData<T, M, N, MatrixDataStorage::HEAP> md_;
+
+    explicit Matrix(detail::Uninitialized tag) : md_(tag) {}
+
+  public:
+    Matrix() : md_() {}
+    template<typename T_>
+    explicit Matrix(T_ &&val) : md_(std::forward<T_>(val)) {}
+    template<typename T_>
+    explicit Matrix(T_ *arr) : md_(arr) {}
+    template<typename T_>
+    Matrix(std::initializer_list<T_> init) : md_(init) {}
+    static Matrix uninitialized() { return Matrix(detail::Uninitialized()); }
+
+    ~Matrix() = default;
+    Matrix(const Matrix &other) = default;
+    Matrix(Matrix &&other) = default;
+    Matrix& operator=(const Matrix &other) = default;
+    Matrix& operator=(Matrix &&other) = default;
+
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::HEAP>()));
+    }
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::HEAP>()));
+    }
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::HEAP>()));
+    }
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::HEAP>()));
+    }
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::SHARED> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::HEAP>()));
+    }
+
+    const T* const read() const { return md_.read(); }
+    T* write() { return md_.write(); }
+    // Policy applied to the allocation of data (see "set_matrix_allocation_policy()")
+    MatrixAllocationPolicy allocation_policy() const { return md_.policy(); }
+    void print() {
+        const T* const arr = read();
+        for (size_t i = 0; i < M * N; ) {
+            std::cout << arr[i];
+            std::cout << (!(++i % N) ? '\n' : ' ');
+        }
+        std::cout << std::endl;
+    }
+
+    template<typename T_, MatrixDataStorage S_>
+    Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("add_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::HEAP, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::HEAP>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] += static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_, MatrixDataStorage S_>
+    Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("sub_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::HEAP, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::HEAP>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] -= static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_>
+    Matrix& operator*=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("scale_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::HEAP));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::HEAP>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] *= static_cast<T>(other);
+        }
+        return *this;
+    }
+    template<typename T_>
+    Matrix& operator/=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("div_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::HEAP));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::HEAP>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] /= static_cast<T>(other);
+        }
+        return *this;
+    }
+};
+
+// Matrix in user-defined memory. Template parameter should be set explicitly.
+template<typename T, size_t M, size_t N>
+class Matrix<T, M, N, MatrixDataStorage::USER> {
+  private:
+    MatrixData<T, M, N, MatrixDataStorage::USER> md_;
+
+  public:
+    // First constructor parameter is user memory for matrix data placement. The
+    // amount of memory should be big enough to carry M * N * sizeof(T) bytes.
+    // Memory is explicitly managed by user himself.
+    explicit Matrix(T *mem) : md_(mem) {}
+    template<typename T_>
+    Matrix(T *mem, T_ &&val) : md_(mem, std::forward<T_>(val)) {}
+    template<typename T_>
+    Matrix(T *mem, T_ *arr) : md_(mem, arr) {}
+    template<typename T_>
+    Matrix(std::initializer_list<T_> init) = delete; // memory isn't specified
+
+    ~Matrix() = default;
+    // Creating a copy of metrix with user-defined memory is prohibited due to
+    // a lack of pointer to memory location for the new matrix. Other copy-like
+    // constructors from another storage type or another data type are prohibited
+    // for the same reason.
+    Matrix(const Matrix &other) = delete;
+    Matrix(Matrix &&other) = default;
+    Matrix& operator=(const Matrix &other) = default;
+    Matrix& operator=(Matrix &&other) = default;
+
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) = delete;
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) = delete;
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) = delete;
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) = delete;
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::SHARED> &other) = delete;
+
+    const T* const read() const { return md_.read(); }
+    T* write() { return md_.write(); }
+    void print() {
+        const T* const arr = read();
+        for (size_t i = 0; i < M * N; ) {
+            std::cout << arr[i];
+            std::cout << (!(++i % N) ? '\n' : ' ');
+        }
+        std::cout << std::endl;
+    }
+
+    template<typename T_, MatrixDataStorage S_>
+    Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("add_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::USER, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::USER>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] += static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_, MatrixDataStorage S_>
+    Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("sub_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::USER, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::USER>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] -= static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_>
+    Matrix& operator*=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("scale_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::USER));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::USER>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] *= static_cast<T>(other);
+        }
+        return *this;
+    }
+    template<typename T_>
+    Matrix& operator/=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("div_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::USER));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::USER>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] /= static_cast<T>(other);
+        }
+        return *this;
+    }
+};
+
+// Matrix on heap shared by its copies (explicitly set). Copies of the same
+// element type are O(1), the data is copied on the first write to a shared one.
+template<typename T, size_t M, size_t N>
+class Matrix<T, M, N, MatrixDataStorage::SHARED> {
+  private:
+    MatrixData<T, M, N, MatrixDataStorage::SHARED> md_;
+
+    explicit Matrix(detail::Uninitialized tag) : md_(tag) {}
+
+  public:
+    Matrix() : md_() {}
+    template<typename T_>
+    explicit Matrix(T_ &&val) : md_(std::forward<T_>(val)) {}
+    template<typename T_>
+    explicit Matrix(T_ *arr) : md_(arr) {}
+    template<typename T_>
+    Matrix(std::initializer_list<T_> init) : md_(init) {}
+    static Matrix uninitialized() { return Matrix(detail::Uninitialized()); }
+
+    ~Matrix() = default;
+    Matrix(const Matrix &other) = default;
+    Matrix(Matrix &&other) = default;
+    Matrix& operator=(const Matrix &other) = default;
+    Matrix& operator=(Matrix &&other) = default;
+
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::SHARED>()));
+    }
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::SHARED>()));
+    }
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::SHARED>()));
+    }
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::SHARED>()));
+    }
+    template<typename T_>
+    Matrix(const Matrix<T_, M, N, MatrixDataStorage::SHARED> &other) : md_(other.read()) { // converts value type
+        MATRIX_STATS_((detail::count_copy<T, T_, MatrixDataStorage::SHARED>()));
+    }
+
+    const T* const read() const { return md_.read(); }
+    T* write() { return md_.write(); }
+    void print() {
+        const T* const arr = read();
+        for (size_t i = 0; i < M * N; ) {
+            std::cout << arr[i];
+            std::cout << (!(++i % N) ? '\n' : ' ');
+        }
+        std::cout << std::endl;
+    }
+
+    template<typename T_, MatrixDataStorage S_>
+    Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("add_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::SHARED, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::SHARED>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] += static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_, MatrixDataStorage S_>
+    Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("sub_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::SHARED, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::SHARED>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] -= static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_>
+    Matrix& operator*=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("scale_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::SHARED));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::SHARED>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] *= static_cast<T>(other);
+        }
+        return *this;
+    }
+    template<typename T_>
+    Matrix& operator/=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("div_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::SHARED));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::SHARED>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] /= static_cast<T>(other);
+        }
+        return *this;
+    }
+};
+
+// Matrix memory will be chosen based on metrix size. This type of matrix will
+// be created by default, but it also could be created explicitly.
+template<typename T, size_t M, size_t N>
+class Matrix<T, M, N, MatrixDataStorage::UNSPECIFIED> {
+  private:
+    MatrixData<T, M, N, choose_matrix_data_storage(sizeof(T) * M * N)> md_;
+
+    explicit Matrix(detail::Uninitialized tag) : md_(tag) {}
+
+  public:
+    constexpr Matrix() : md_() {}
+    template<typename T_>
+    constexpr explicit Matrix(T_ &&val) : md_(std::forward<T_>(val)) {}
+    template<typename T_>
+    constexpr explicit Matrix(T_ *arr) : md_(arr) {}
+    template<typename T_>
+    constexpr Matrix(std::initializer_list<T_> init) : md_(init) {}
+    static Matrix uninitialized() { return Matrix(detail::Uninitialized()); }
+
+    ~Matrix() = default;
+    Matrix(const Matrix &other) = default;
+    Matrix(Matrix &&other) = default;
+    Matrix& operator=(const Matrix &other) = default;
+    Matrix& operator=(Matrix &&other) = default;
+
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, choose_matrix_data_storage(sizeof(T) * M * N)>()));
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, choose_matrix_data_storage(sizeof(T) * M * N)>()));
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, choose_matrix_data_storage(sizeof(T) * M * N)>()));
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, choose_matrix_data_storage(sizeof(T) * M * N)>()));
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix(const Matrix<T_, M, N, MatrixDataStorage::SHARED> &other) : md_(other.read()) {
+        MATRIX_STATS_((detail::count_copy<T, T_, choose_matrix_data_storage(sizeof(T) * M * N)>()));
+    }
+
+    constexpr const T* const read() const { return md_.read(); }
+    constexpr T* write() { return md_.write(); }
     void print() {
         const T* const arr = read();
         for (size_t i = 0; i < M * N; ) {
             std::cout << arr[i];
             std::cout << (!(++i % N) ? '\n' : ' ');
         }
-        std::cout << std::endl;
+        std::cout << std::endl;
+    }
+
+    template<typename T_, MatrixDataStorage S_>
+    MATRIX_CONSTEXPR_ Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("add_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::UNSPECIFIED, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::UNSPECIFIED>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] += static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_, MatrixDataStorage S_>
+    MATRIX_CONSTEXPR_ Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("sub_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::UNSPECIFIED, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::UNSPECIFIED>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(T)))));
+        T *arr = write();
+        const T_* const other_arr = other.read();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] -= static_cast<T>(other_arr[i]);
+        }
+        return *this;
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix& operator*=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("scale_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::UNSPECIFIED));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::UNSPECIFIED>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] *= static_cast<T>(other);
+        }
+        return *this;
+    }
+    template<typename T_>
+    MATRIX_CONSTEXPR_ Matrix& operator/=(const T_ &other) {
+        MATRIX_TRACE_(detail::TraceScope trace_("div_assign", detail::type_name<T>(), M, N, 0, MatrixDataStorage::UNSPECIFIED));
+        MATRIX_STATS_((detail::count_cost<T, M, N, MatrixDataStorage::UNSPECIFIED>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+        T *arr = write();
+        for (size_t i = 0; i < M * N; ++i) {
+            arr[i] /= static_cast<T>(other);
+        }
+        return *this;
+    }
+};
+
+
+
+// Arithmetic operators are implemented without passing matrix by value to avoid
+// copying. As a result elements are created inside function that avoids extra
+// algorithmic complexity. But it forbids to use corresponding assignment operators
+// from class effectivelly.
+// "+matrix"
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+MATRIX_CONSTEXPR_ Matrix<T, M, N, result_matrix_data_storage(S)> operator+(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("pos", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), sizeof(T), 0))));
+    return Matrix<T, M, N, result_matrix_data_storage(S)>(val); // creates a copy
+}
+// "-matrix"
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+MATRIX_CONSTEXPR_ Matrix<T, M, N, result_matrix_data_storage(S)> operator-(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("neg", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+    Matrix<T, M, N, result_matrix_data_storage(S)> ret;
+    T *arr = ret.write();
+    const T* const val_arr = val.read();
+    for (size_t i = 0; i < M * N; ++i) {
+        arr[i] = -val_arr[i];
+    }
+    return ret;
+}
+// "matrix + matrix"
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+MATRIX_CONSTEXPR_ Matrix<std::common_type_t<T, T_>, M, N, result_matrix_data_storage(S, S_)> operator+(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
+    using TT_ = std::common_type_t<T, T_>;
+    MATRIX_TRACE_(detail::TraceScope trace_("add", detail::type_name<TT_>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(TT_)))));
+    Matrix<TT_, M, N, result_matrix_data_storage(S, S_)> ret;
+    TT_ *arr = ret.write();
+    const T* const lhs_arr = lhs.read();
+    const T_* const rhs_arr = rhs.read();
+    for (size_t i = 0; i < M * N; ++i) {
+        arr[i] = static_cast<TT_>(lhs_arr[i] + rhs_arr[i]);
+    }
+    return ret;
+}
+// "matrix - matrix"
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+MATRIX_CONSTEXPR_ Matrix<std::common_type_t<T, T_>, M, N, result_matrix_data_storage(S, S_)> operator-(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
+    using TT_ = std::common_type_t<T, T_>;
+    MATRIX_TRACE_(detail::TraceScope trace_("sub", detail::type_name<TT_>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(TT_)))));
+    Matrix<TT_, M, N, result_matrix_data_storage(S, S_)> ret;
+    TT_ *arr = ret.write();
+    const T* const lhs_arr = lhs.read();
+    const T_* const rhs_arr = rhs.read();
+    for (size_t i = 0; i < M * N; ++i) {
+        arr[i] = static_cast<TT_>(lhs_arr[i] - rhs_arr[i]);
+    }
+    return ret;
+}
+// "matrix * scalar"
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S>
+MATRIX_CONSTEXPR_ Matrix<T, M, N, result_matrix_data_storage(S)> operator*(const Matrix<T, M, N, S> &lhs, const T_ &rhs) {
+    MATRIX_TRACE_(detail::TraceScope trace_("scale", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+    Matrix<T, M, N, result_matrix_data_storage(S)> ret;
+    T *arr = ret.write();
+    const T* const lhs_arr = lhs.read();
+    for (size_t i = 0; i < M * N; ++i) {
+        arr[i] = lhs_arr[i] * static_cast<T>(rhs);
+    }
+    return ret;
+}
+// "scalar * matrix"
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S>
+MATRIX_CONSTEXPR_ Matrix<T, M, N, result_matrix_data_storage(S)> operator*(const T_ &lhs, const Matrix<T, M, N, S> &rhs) {
+    // Another arguments order of "matrix * scalar"
+    return (rhs * lhs);
+}
+// "matrix / scalar"
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S>
+MATRIX_CONSTEXPR_ Matrix<T, M, N, result_matrix_data_storage(S)> operator/(const Matrix<T, M, N, S> &lhs, const T_ &rhs) {
+    MATRIX_TRACE_(detail::TraceScope trace_("div", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+    Matrix<T, M, N, result_matrix_data_storage(S)> ret;
+    T *arr = ret.write();
+    const T* const lhs_arr = lhs.read();
+    for (size_t i = 0; i < M * N; ++i) {
+        arr[i] = lhs_arr[i] / static_cast<T>(rhs);
+    }
+    return ret;
+}
+
+// Comparison operators
+namespace detail {
+
+// Whether "pred(i)" is false for every "i" in [0, n). Blocks are checked by
+// vectorized loops without exits, the search stops after the first block
+// where "pred" is true.
+template<typename F>
+bool none_of(const size_t n, F pred) {
+    constexpr size_t kBlock = 64;
+    size_t i = 0;
+    for (; i + kBlock <= n; i += kBlock) {
+        int found = 0;
+        for (size_t j = 0; j < kBlock; ++j) {
+            found |= static_cast<int>(pred(i + j));
+        }
+        if (found) {
+            return false;
+        }
+    }
+    for (; i < n; ++i) {
+        if (pred(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether every element is equal to itself (no NaN)
+template<typename T>
+bool reflexive(const T *arr, const size_t n, std::true_type) {
+    return none_of(n, [arr](size_t i) { return arr[i] != arr[i]; });
+}
+template<typename T>
+bool reflexive(const T *, const size_t, std::false_type) {
+    return true;
+}
+
+// Matrices on stack are compared by a simple loop usable in constant expressions
+template<typename T, typename T_>
+constexpr bool equal(const size_t n, const T *lhs, const T_ *rhs, std::true_type) {
+    for (size_t i = 0; i < n; ++i) {
+        if (lhs[i] != rhs[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+// Other matrices are compared by blocks. Elements of the same array are equal
+// without comparison unless they are floating point numbers (NaN is not equal
+// to itself, the array is only checked for NaN).
+template<typename T, typename T_>
+bool equal(const size_t n, const T *lhs, const T_ *rhs, std::false_type) {
+    if (static_cast<const void *>(lhs) == static_cast<const void *>(rhs) && std::is_same<T, T_>::value) {
+        return reflexive(lhs, n, std::integral_constant<bool, std::is_floating_point<T>::value || is_half<T>::value>());
+    }
+    return none_of(n, [lhs, rhs](size_t i) { return lhs[i] != rhs[i]; });
+}
+
+// Distance between floating point numbers in units in the last place (the
+// number of representable numbers between them, zeros of both signs are equal)
+template<typename F>
+typename ieee_layout<F>::type ulp_distance(const F lhs, const F rhs) {
+    using U = typename ieee_layout<F>::type;
+    const U sign = U(1) << (sizeof(U) * 8 - 1);
+    // magnitudes are ordered as their bits, negative numbers are mirrored below
+    // "sign" (the magnitude is negated by masks, so loops are vectorized)
+    const U lhs_bits = to_bits(lhs);
+    const U rhs_bits = to_bits(rhs);
+    const U lhs_mask = U(0) - (lhs_bits >> (sizeof(U) * 8 - 1));
+    const U rhs_mask = U(0) - (rhs_bits >> (sizeof(U) * 8 - 1));
+    const U lhs_ordered = sign + (((lhs_bits & ~sign) ^ lhs_mask) - lhs_mask);
+    const U rhs_ordered = sign + (((rhs_bits & ~sign) ^ rhs_mask) - rhs_mask);
+    return (lhs_ordered > rhs_ordered) ? (lhs_ordered - rhs_ordered) : (rhs_ordered - lhs_ordered);
+}
+
+} // namespace detail
+
+// "matrix == matrix", elements are compared exactly (see "approx_equal()" for
+// floating point results). The comparison stops at the first block of
+// different elements, matrices sharing the same memory are equal without
+// comparison of elements.
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+MATRIX_CONSTEXPR_ bool operator==(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
+    MATRIX_TRACE_(detail::TraceScope trace_("eq", detail::type_name<T>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), 0))));
+    using on_stack = std::integral_constant<bool, detail::on_stack<T, M, N, S>::value && detail::on_stack<T_, M, N, S_>::value>;
+    return detail::equal(M * N, lhs.read(), rhs.read(), on_stack());
+}
+// "matrix != matrix"
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+MATRIX_CONSTEXPR_ bool operator!=(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
+    // Opposite to "matrix == matrix"
+    return !(lhs == rhs);
+}
+
+// Whether matrices are equal within tolerances. Elements a and b are close if
+// |a - b| <= max(atol, rtol * max(|a|, |b|)) or if there are at most "ulps"
+// representable numbers between them. Equal infinities are close, NaN isn't
+// close to anything. Elements are compared in floating point type (double for
+// integers), the comparison stops at the first block with distant elements.
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+bool approx_equal(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs,
+                  const detail::floating_t<std::common_type_t<T, T_>> rtol = std::sqrt(std::numeric_limits<detail::floating_t<std::common_type_t<T, T_>>>::epsilon()),
+                  const detail::floating_t<std::common_type_t<T, T_>> atol = 0, const size_t ulps = 0) {
+    using F = detail::floating_t<std::common_type_t<T, T_>>;
+    MATRIX_TRACE_(detail::TraceScope trace_("approx_equal", detail::type_name<F>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), 0, 4))));
+    using U = typename detail::ieee_layout<F>::type;
+    const U max_ulps = static_cast<U>(std::min<size_t>(ulps, std::numeric_limits<U>::max()));
+    const T *lhs_arr = lhs.read();
+    const T_ *rhs_arr = rhs.read();
+    return detail::none_of(M * N, [=](size_t i) {
+        const F a = static_cast<F>(lhs_arr[i]);
+        const F b = static_cast<F>(rhs_arr[i]);
+        const F diff = std::abs(a - b);
+        const F magnitude = std::abs(a) > std::abs(b) ? std::abs(a) : std::abs(b);
+        const int finite = (diff <= std::numeric_limits<F>::max());
+        const int equal = (a == b);
+        const int within_tolerance = (diff <= atol) | (diff <= rtol * magnitude);
+        const int within_ulps = (detail::ulp_distance(a, b) <= max_ulps);
+        return !(equal | (finite & (within_tolerance | within_ulps)));
+    });
+}
+
+
+
+// Other matrix functions
+// Accumulation policies of "mul()" selecting the type of dot products. Elements
+// are converted to type A, their products are summed in type A and the result
+// matrix has elements of type R. Narrow integers are widened to prevent
+// overflow (e.g. "Accumulate<int32_t>" for int8_t or int16_t matrices), float
+// dot products are summed in double with "Accumulate<double, float>".
+template<typename A, typename R = A>
+struct Accumulate {};
+// Summation of dot products in type A is compensated: rounding errors of the
+// additions are summed separately, so the error doesn't grow with the length
+// of dot products. It costs about four times more additions.
+template<typename A, typename R = A>
+struct CompensatedAccumulate {};
+
+// Algorithms of "mul()" for large matrices
+enum class MatrixMulPolicy {
+    BLOCKED, // blocked kernel only (default)
+    STRASSEN // Strassen-Winograd for floating point matrices greater than the crossover
+};
+// Strassen-Winograd multiplication (forced by "mul(lhs, rhs, Strassen())" or
+// selected by "MatrixMulPolicy::STRASSEN") takes O(n^2.81) operations and is
+// faster for matrices several times greater than the crossover, but it's less
+// accurate. The error of the blocked kernel is bounded for every element by
+// its dot product: |c_ij - r_ij| <= n * eps * sum(|a_ik| * |b_kj|). The error
+// of Strassen-Winograd is bounded only by norms of the whole matrices and grows
+// up to 18 times with every level of recursion, so elements much smaller than
+// the others may lose all correct digits. Integer products are exact unless
+// intermediate sums overflow. Workspace of about (m*n + n*p + m*p) / 3
+// elements is allocated once for all levels of recursion.
+struct Strassen {};
+
+namespace detail {
+
+inline std::atomic<MatrixMulPolicy>& mul_policy_setting() {
+    static std::atomic<MatrixMulPolicy> policy{MatrixMulPolicy::BLOCKED};
+    return policy;
+}
+
+inline std::atomic<size_t>& strassen_crossover_setting() {
+    static std::atomic<size_t> crossover{MATRIX_STRASSEN_CROSSOVER_};
+    return crossover;
+}
+
+// Multiplies matrices with Strassen-Winograd algorithm, see "winograd()"
+template<typename T, typename T_, typename R>
+void strassen(const size_t m, const size_t n, const size_t p, const T *a, const T_ *b, R *c) {
+    const size_t crossover = strassen_crossover_setting();
+    std::vector<R> workspace(winograd_workspace(m, n, p, crossover));
+    winograd(m, n, p, a, n, b, p, c, p, crossover, workspace.data());
+}
+
+// Multiplies matrices on stack, usable in constant expressions. Products are
+// summed in the same order as by "gemm()", so results are the same.
+template<typename T, typename T_, typename TT_>
+constexpr void mul(const size_t m, const size_t n, const size_t p, const T *a, const T_ *b, TT_ *c, std::true_type) {
+    for (size_t i = 0; i < m; ++i) {
+        for (size_t k = 0; k < n; ++k) {
+            for (size_t j = 0; j < p; ++j) {
+                c[i * p + j] += static_cast<TT_>(a[i * n + k] * b[k * p + j]);
+            }
+        }
+    }
+}
+// Multiplies large matrices by the algorithm selected with "MatrixMulPolicy"
+template<typename T, typename T_, typename TT_>
+void mul(const size_t m, const size_t n, const size_t p, const T *a, const T_ *b, TT_ *c, std::false_type) {
+    if (std::is_floating_point<TT_>::value && (mul_policy_setting() == MatrixMulPolicy::STRASSEN) &&
+        (std::min(m, std::min(n, p)) > strassen_crossover_setting())) {
+        strassen(m, n, p, a, b, c);
+    } else {
+        gemm(m, n, p, a, n, b, p, c, p, false);
+    }
+}
+
+} // namespace detail
+
+// Sets the algorithm of "mul()" for large matrices
+inline void set_matrix_mul_policy(const MatrixMulPolicy policy) {
+    detail::mul_policy_setting() = policy;
+}
+// Returns the algorithm of "mul()" for large matrices
+inline MatrixMulPolicy matrix_mul_policy() {
+    return detail::mul_policy_setting();
+}
+// Sets the size of matrices below which Strassen-Winograd multiplication
+// switches to the blocked kernel, zero means the default
+inline void set_matrix_strassen_crossover(const size_t crossover) {
+    detail::strassen_crossover_setting() = (crossover != 0) ? crossover : MATRIX_STRASSEN_CROSSOVER_;
+}
+// Returns the size of matrices below which Strassen-Winograd multiplication
+// switches to the blocked kernel
+inline size_t matrix_strassen_crossover() {
+    return detail::strassen_crossover_setting();
+}
+
+// Multiplies matrix(m,n) by matrix(n,p)
+//     < N >       < P >     < P >
+// ^ (a a a a)   ^ (b b)   ^ (r r)
+// M (a a a a) x N (b b) = M (r r)
+// v (a a a a)   v (b b)   v (r r)
+//                 (b b)
+// Matrices on stack are multiplied by a simple loop usable in constant
+// expressions, the policy is applied to the others.
+template<typename T, typename T_, size_t M, size_t N, size_t P, MatrixDataStorage S, MatrixDataStorage S_>
+MATRIX_CONSTEXPR_ Matrix<std::common_type_t<T, T_>, M, P, result_matrix_data_storage(S, S_)> mul(const Matrix<T, M, N, S> &lhs, const Matrix<T_, N, P, S_> &rhs) {
+    using TT_ = std::common_type_t<T, T_>;
+    MATRIX_TRACE_(detail::TraceScope trace_("mul", detail::type_name<TT_>(), M, N, P, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(mul_cost<T, T_, M, N, P>())));
+    Matrix<TT_, M, P, result_matrix_data_storage(S, S_)> ret;
+    using on_stack = std::integral_constant<bool, detail::on_stack<T, M, N, S>::value && detail::on_stack<T_, N, P, S_>::value &&
+                                                  detail::on_stack<TT_, M, P, result_matrix_data_storage(S, S_)>::value>;
+    detail::mul(M, N, P, lhs.read(), rhs.read(), ret.write(), on_stack());
+    return ret;
+}
+
+// Multiplies matrix(m,n) by matrix(n,p) with Strassen-Winograd algorithm
+template<typename T, typename T_, size_t M, size_t N, size_t P, MatrixDataStorage S, MatrixDataStorage S_>
+Matrix<std::common_type_t<T, T_>, M, P, result_matrix_data_storage(S, S_)> mul(const Matrix<T, M, N, S> &lhs, const Matrix<T_, N, P, S_> &rhs, Strassen) {
+    using TT_ = std::common_type_t<T, T_>;
+    MATRIX_TRACE_(detail::TraceScope trace_("mul", detail::type_name<TT_>(), M, N, P, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(mul_cost<T, T_, M, N, P>())));
+    Matrix<TT_, M, P, result_matrix_data_storage(S, S_)> ret;
+    detail::strassen(M, N, P, lhs.read(), rhs.read(), ret.write());
+    return ret;
+}
+
+// Multiplies matrix(m,n) by matrix(n,p) with the given accumulation policy
+template<typename T, typename T_, size_t M, size_t N, size_t P, MatrixDataStorage S, MatrixDataStorage S_, typename A, typename R>
+Matrix<R, M, P, result_matrix_data_storage(S, S_)> mul(const Matrix<T, M, N, S> &lhs, const Matrix<T_, N, P, S_> &rhs, Accumulate<A, R>) {
+    MATRIX_TRACE_(detail::TraceScope trace_("mul", detail::type_name<A>(), M, N, P, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(mul_cost<T, T_, M, N, P>())));
+    Matrix<R, M, P, result_matrix_data_storage(S, S_)> ret;
+    detail::gemm_dot<A>(M, N, P, lhs.read(), rhs.read(), ret.write(),
+                        [](const T *a, const T_ *b, size_t n) { return detail::dot_widened<A>(a, b, n); });
+    return ret;
+}
+template<typename T, typename T_, size_t M, size_t N, size_t P, MatrixDataStorage S, MatrixDataStorage S_, typename A, typename R>
+Matrix<R, M, P, result_matrix_data_storage(S, S_)> mul(const Matrix<T, M, N, S> &lhs, const Matrix<T_, N, P, S_> &rhs, CompensatedAccumulate<A, R>) {
+    MATRIX_TRACE_(detail::TraceScope trace_("mul", detail::type_name<A>(), M, N, P, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(mul_cost<T, T_, M, N, P>())));
+    Matrix<R, M, P, result_matrix_data_storage(S, S_)> ret;
+    detail::gemm_dot<A>(M, N, P, lhs.read(), rhs.read(), ret.write(),
+                        [](const T *a, const T_ *b, size_t n) { return detail::dot_compensated<A>(a, b, n); });
+    return ret;
+}
+
+namespace detail {
+
+// Solves the matrix chain ordering problem for matrices with dimensions
+// D0 x D1, D1 x D2, ..., returns the index of the last matrix of the left
+// operand of the product of matrices [first, last]. Orders are compared by the
+// number of multiplications, then by the number of elements of intermediate
+// products.
+template<size_t... D>
+constexpr size_t chain_split(const size_t first, const size_t last) {
+    constexpr size_t K = sizeof...(D) - 1; // the number of matrices
+    const size_t d[] = { D... };
+    unsigned long long ops[K][K] = {};
+    unsigned long long memory[K][K] = {};
+    size_t split[K][K] = {};
+    for (size_t len = 1; len < K; ++len) {
+        for (size_t i = 0; i + len < K; ++i) {
+            const size_t j = i + len;
+            for (size_t k = i; k < j; ++k) {
+                const unsigned long long op = ops[i][k] + ops[k + 1][j] + 1ULL * d[i] * d[k + 1] * d[j + 1];
+                const unsigned long long mem = memory[i][k] + memory[k + 1][j] + 1ULL * d[i] * d[j + 1];
+                if ((k == i) || (op < ops[i][j]) || ((op == ops[i][j]) && (mem < memory[i][j]))) {
+                    ops[i][j] = op;
+                    memory[i][j] = mem;
+                    split[i][j] = k;
+                }
+            }
+        }
+    }
+    return split[first][last];
+}
+
+// Whether columns of every matrix match rows of the next one
+template<size_t K>
+constexpr bool chain_conformable(const size_t (&rows)[K], const size_t (&cols)[K]) {
+    for (size_t i = 0; i + 1 < K; ++i) {
+        if (cols[i] != rows[i + 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Product of matrices [I, J] of tuple "args" in the optimal order
+template<size_t I, size_t J, size_t... D>
+struct ChainProduct {
+    template<typename Tuple>
+    static auto eval(const Tuple &args) {
+        constexpr size_t K = chain_split<D...>(I, J);
+        return mul(ChainProduct<I, K, D...>::eval(args), ChainProduct<K + 1, J, D...>::eval(args));
+    }
+};
+template<size_t I, size_t... D>
+struct ChainProduct<I, I, D...> {
+    template<typename Tuple>
+    static const auto& eval(const Tuple &args) {
+        return std::get<I>(args);
+    }
+};
+
+} // namespace detail
+
+// Multiplies matrices "mul(a, b, c, ...)" in the order taking the least number
+// of operations (e.g. "(a * b) * c" for a(10,100), b(100,5), c(5,50) takes ten
+// times less than "a * (b * c)"). The order is found at compile time.
+template<typename... T, size_t... M, size_t... N, MatrixDataStorage... S>
+auto mul_chain(const Matrix<T, M, N, S>&... args) {
+    static_assert(sizeof...(args) >= 2, "At least two matrices are multiplied");
+    static constexpr size_t rows[] = { M... };
+    static constexpr size_t cols[] = { N... };
+    static_assert(detail::chain_conformable(rows, cols), "Matrices of the chain can't be multiplied");
+    return detail::ChainProduct<0, sizeof...(args) - 1, M..., cols[sizeof...(args) - 1]>::eval(std::forward_as_tuple(args...));
+}
+
+
+
+// Vectors
+// Column vector(n) is matrix(n,1), row vector(n) is matrix(1,n). They are
+// accepted by all matrix functions, "gemv()" and "gevm()" multiply them by
+// matrices faster than "mul()".
+template<typename T, size_t N, MatrixDataStorage S = MatrixDataStorage::UNSPECIFIED>
+using Vector = Matrix<T, N, 1, S>;
+template<typename T, size_t N, MatrixDataStorage S = MatrixDataStorage::UNSPECIFIED>
+using RowVector = Matrix<T, 1, N, S>;
+
+// Multiplies matrix(m,n) by vector(n). Elements of the result are dot products
+// of rows, which are summed in several independent parts (so results may
+// differ from "mul()" in the last bits).
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+Vector<std::common_type_t<T, T_>, M, result_matrix_data_storage(S, S_)> gemv(const Matrix<T, M, N, S> &lhs, const Vector<T_, N, S_> &rhs) {
+    using TT_ = std::common_type_t<T, T_>;
+    MATRIX_TRACE_(detail::TraceScope trace_("gemv", detail::type_name<TT_>(), M, N, 1, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(mul_cost<T, T_, M, N, 1>())));
+    Vector<TT_, M, result_matrix_data_storage(S, S_)> ret;
+    detail::gemv(M, N, lhs.read(), rhs.read(), ret.write());
+    return ret;
+}
+
+// Multiplies row vector(m) by matrix(m,n)
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+RowVector<std::common_type_t<T, T_>, N, result_matrix_data_storage(S, S_)> gevm(const RowVector<T, M, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
+    using TT_ = std::common_type_t<T, T_>;
+    MATRIX_TRACE_(detail::TraceScope trace_("gevm", detail::type_name<TT_>(), 1, M, N, S, S_));
+    MATRIX_STATS_((detail::count_cost<T_, M, N, S_>(mul_cost<T, T_, 1, M, N>())));
+    RowVector<TT_, N, result_matrix_data_storage(S, S_)> ret;
+    detail::gevm(M, N, lhs.read(), rhs.read(), ret.write());
+    return ret;
+}
+
+// Multiplies matrix(m,n) by k vectors(n) given as rows of matrix(k,n), the
+// results are rows of matrix(k,m). The matrix is read from memory once for all
+// vectors, results are the same as of "gemv()" for every vector.
+template<typename T, typename T_, size_t M, size_t N, size_t K, MatrixDataStorage S, MatrixDataStorage S_>
+Matrix<std::common_type_t<T, T_>, K, M, result_matrix_data_storage(S, S_)> gemv_batched(const Matrix<T, M, N, S> &lhs, const Matrix<T_, K, N, S_> &rhs) {
+    using TT_ = std::common_type_t<T, T_>;
+    MATRIX_TRACE_(detail::TraceScope trace_("gemv_batched", detail::type_name<TT_>(), M, N, K, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(mul_cost<T, T_, M, N, K>())));
+    Matrix<TT_, K, M, result_matrix_data_storage(S, S_)> ret;
+    detail::gemv_batched(M, N, K, lhs.read(), rhs.read(), ret.write());
+    return ret;
+}
+
+
+
+// Fused updates
+// The result is written into existing matrix of any storage without temporary
+// matrices, every element is read and written once. The result must not
+// overlap the operands. Scalars are converted to the type of the result.
+
+// "c = alpha * a * b + beta * c" for matrix(m,n) "a", matrix(n,p) "b" and
+// matrix(m,p) "c". The product is computed as by "mul()", "c" isn't read if
+// "beta" is zero (NaN elements are overwritten).
+template<typename U, typename T, typename T_, typename U_, typename R, size_t M, size_t N, size_t P,
+         MatrixDataStorage S, MatrixDataStorage S_, MatrixDataStorage S__>
+void gemm(const U alpha, const Matrix<T, M, N, S> &a, const Matrix<T_, N, P, S_> &b, const U_ beta, Matrix<R, M, P, S__> &c) {
+    MATRIX_TRACE_(detail::TraceScope trace_("gemm", detail::type_name<R>(), M, N, P, S, S_));
+    MATRIX_STATS_((detail::count_cost<R, M, P, S__>(gemm_cost<T, T_, R, M, N, P>())));
+    const R beta_ = static_cast<R>(beta);
+    detail::gemm(M, N, P, a.read(), N, b.read(), P, c.write(), P, beta_ != R(0),
+                 static_cast<std::common_type_t<T, T_, R>>(alpha), beta_);
+}
+
+// "y = alpha * x + y" for matrices(m,n) "x" and "y"
+template<typename U, typename T, typename R, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+void axpy(const U alpha, const Matrix<T, M, N, S> &x, Matrix<R, M, N, S_> &y) {
+    MATRIX_TRACE_(detail::TraceScope trace_("axpy", detail::type_name<R>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<R, M, N, S_>(elementwise_cost(M * N, sizeof(T) + sizeof(R), sizeof(R), 2))));
+    const R alpha_ = static_cast<R>(alpha);
+    detail::update(M * N, x.read(), y.write(), [alpha_](const T xi, const R yi) { return static_cast<R>(alpha_ * static_cast<R>(xi) + yi); });
+}
+
+// "y = alpha * x + beta * y" for matrices(m,n) "x" and "y", "y" isn't read if
+// "beta" is zero
+template<typename U, typename T, typename U_, typename R, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+void scale_add(const U alpha, const Matrix<T, M, N, S> &x, const U_ beta, Matrix<R, M, N, S_> &y) {
+    MATRIX_TRACE_(detail::TraceScope trace_("scale_add", detail::type_name<R>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<R, M, N, S_>(elementwise_cost(M * N, sizeof(T) + sizeof(R), sizeof(R), 3))));
+    const R alpha_ = static_cast<R>(alpha);
+    const R beta_ = static_cast<R>(beta);
+    if (beta_ == R(0)) {
+        detail::transform(M * N, x.read(), y.write(), [alpha_](const T xi) { return static_cast<R>(alpha_ * static_cast<R>(xi)); });
+    } else {
+        detail::update(M * N, x.read(), y.write(),
+                       [alpha_, beta_](const T xi, const R yi) { return static_cast<R>(alpha_ * static_cast<R>(xi) + beta_ * yi); });
+    }
+}
+
+
+
+// Reductions
+namespace detail {
+
+// Type of sums of elements of type T (half precision numbers are summed in float)
+template<typename T>
+using accumulator_t = std::conditional_t<is_half<T>::value, float, T>;
+
+// Absolute value of arithmetic type
+template<typename T>
+T absolute(const T val) {
+    return (val < T(0)) ? -val : val;
+}
+
+// Sum of "f(i)" for "i" in [first, last) in type A. Blocks of up to 1024 terms
+// are summed in 8 independent lanes (the loop is vectorized), sums of blocks
+// are added pairwise, so the rounding error grows as log(n) instead of n.
+template<typename A, typename F>
+A sum_pairwise(const size_t first, const size_t last, F &&f) {
+    constexpr size_t kLanes = 8;
+    constexpr size_t kBlock = 1024;
+    if (last - first > kBlock) {
+        const size_t middle = first + (last - first) / 2 / kLanes * kLanes;
+        return sum_pairwise<A>(first, middle, f) + sum_pairwise<A>(middle, last, f);
+    }
+    A acc[kLanes] = {};
+    const size_t end = first + (last - first) / kLanes * kLanes;
+    for (size_t i = first; i < end; i += kLanes) {
+        for (size_t j = 0; j < kLanes; ++j) {
+            acc[j] += static_cast<A>(f(i + j));
+        }
+    }
+    A tail = 0;
+    for (size_t i = end; i < last; ++i) {
+        tail += static_cast<A>(f(i));
+    }
+    return ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7])) + tail;
+}
+
+// The same as "sum_pairwise()" for [0, n) split between threads by chunks of
+// fixed size, so the result doesn't depend on the number of threads
+template<typename A, typename F>
+A sum_parallel(const size_t n, F f) {
+    constexpr size_t kChunk = 65536;
+    const size_t chunks = (n + kChunk - 1) / kChunk;
+    if (chunks <= 1) {
+        return sum_pairwise<A>(0, n, f);
+    }
+    std::vector<A> partial(chunks);
+    parallel_for(0, chunks, n, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; ++c) {
+            partial[c] = sum_pairwise<A>(c * kChunk, std::min(n, (c + 1) * kChunk), f);
+        }
+    });
+    return sum_pairwise<A>(0, chunks, [&](size_t c) { return partial[c]; });
+}
+
+// Whether "val" replaces "best" as the minimum (or the maximum if "kMax"). Any
+// value replaces NaN, so NaN is selected only if all values are NaN.
+template<bool kMax, typename T>
+bool better(const T val, const T best) {
+    return (kMax ? (best < val) : (val < best)) | (best != best);
+}
+
+// Minimum (or maximum if "kMax") of "n" elements of array "x" found in 8
+// independent lanes (the loop is vectorized)
+template<bool kMax, typename T>
+T extremum(const T *x, const size_t n) {
+    constexpr size_t kLanes = 8;
+    T lanes[kLanes];
+    std::fill(lanes, lanes + kLanes, x[0]);
+    const size_t end = n / kLanes * kLanes;
+    for (size_t i = 0; i < end; i += kLanes) {
+        for (size_t j = 0; j < kLanes; ++j) {
+            lanes[j] = better<kMax>(x[i + j], lanes[j]) ? x[i + j] : lanes[j];
+        }
+    }
+    T best = x[0];
+    for (size_t i = end; i < n; ++i) {
+        best = better<kMax>(x[i], best) ? x[i] : best;
+    }
+    for (size_t j = 0; j < kLanes; ++j) {
+        best = better<kMax>(lanes[j], best) ? lanes[j] : best;
+    }
+    return best;
+}
+
+// Index of the first element of array "x" equal to "val" ("n" if not found).
+// Blocks are checked with vectorized loops without exits.
+template<typename T>
+size_t find(const T *x, const size_t n, const T val) {
+    constexpr size_t kBlock = 64;
+    for (size_t i0 = 0; i0 < n; i0 += kBlock) {
+        const size_t i1 = std::min(n, i0 + kBlock);
+        int found = 0;
+        for (size_t i = i0; i < i1; ++i) {
+            found |= (x[i] == val);
+        }
+        if (found) {
+            return std::find(x + i0, x + i1, val) - x;
+        }
+    }
+    return n;
+}
+
+// Index of the minimum (or maximum if "kMax") of "n" elements of array "x".
+// Extremums of chunks are found by threads, then the first index of the
+// extremum is found (NaN is the extremum only if all elements are NaN).
+template<bool kMax, typename T>
+size_t arg_extremum(const T *x, const size_t n) {
+    constexpr size_t kChunk = 65536;
+    const size_t chunks = (n + kChunk - 1) / kChunk;
+    std::vector<T> partial(chunks);
+    parallel_for(0, chunks, n, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; ++c) {
+            partial[c] = extremum<kMax>(x + c * kChunk, std::min(n, (c + 1) * kChunk) - c * kChunk);
+        }
+    });
+    const T val = extremum<kMax>(partial.data(), chunks);
+    return (val == val) ? find(x, n, val) : 0;
+}
+
+// Sums of "f(a_ij)" over rows [first, last) of matrix "a" with "n" columns for
+// columns [col0, col1) into "out". Rows are added to "out" in vectorized loops
+// by blocks of 16, sums of blocks are added pairwise with "work" holding
+// (col1 - col0) elements for every level of recursion.
+template<typename A, typename T, typename F>
+void sum_columns(const T *a, const size_t n, const size_t first, const size_t last,
+                 const size_t col0, const size_t col1, A *out, A *work, F &f) {
+    constexpr size_t kBlock = 16;
+    if (last - first > kBlock) {
+        const size_t middle = first + (last - first) / 2;
+        sum_columns(a, n, first, middle, col0, col1, out, work + (col1 - col0), f);
+        sum_columns(a, n, middle, last, col0, col1, work, work + (col1 - col0), f);
+        for (size_t j = 0; j < col1 - col0; ++j) {
+            out[j] += work[j];
+        }
+        return;
+    }
+    std::fill(out, out + (col1 - col0), A(0));
+    for (size_t i = first; i < last; ++i) {
+        const T *ai = a + i * n;
+        for (size_t j = col0; j < col1; ++j) {
+            out[j - col0] += static_cast<A>(f(ai[j]));
+        }
+    }
+}
+
+// Sums of "f(a_ij)" for every column of matrix(m,n) "a" into "out", columns
+// are split between threads
+template<typename A, typename T, typename F>
+void sum_columns(const T *a, const size_t m, const size_t n, A *out, F f) {
+    size_t levels = 1;
+    for (size_t rows = m; rows > 16; rows = (rows + 1) / 2) {
+        ++levels;
+    }
+    parallel_for(0, n, m * n, [&](size_t first, size_t last) {
+        std::vector<A> work(levels * (last - first));
+        sum_columns(a, n, 0, m, first, last, out + first, work.data(), f);
+    });
+}
+
+// Minimums (or maximums if "kMax") of every column of matrix(m,n) "a" into
+// "out", columns are split between threads
+template<bool kMax, typename T>
+void extremum_columns(const T *a, const size_t m, const size_t n, T *out) {
+    parallel_for(0, n, m * n, [&](size_t first, size_t last) {
+        std::copy(a + first, a + last, out + first);
+        for (size_t i = 1; i < m; ++i) {
+            const T *ai = a + i * n;
+            for (size_t j = first; j < last; ++j) {
+                out[j] = better<kMax>(ai[j], out[j]) ? ai[j] : out[j];
+            }
+        }
+    });
+}
+
+} // namespace detail
+
+// Sum of elements. Floating point elements are summed pairwise in several
+// independent parts: the rounding error grows as log(n) and the loop is
+// vectorized. The result doesn't depend on the number of threads.
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+T sum(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("sum", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    const T *arr = val.read();
+    return static_cast<T>(detail::sum_parallel<detail::accumulator_t<T>>(M * N, [arr](size_t i) { return arr[i]; }));
+}
+// Sum of elements converted to type A, the result is converted to type R
+template<typename T, size_t M, size_t N, MatrixDataStorage S, typename A, typename R>
+R sum(const Matrix<T, M, N, S> &val, Accumulate<A, R>) {
+    MATRIX_TRACE_(detail::TraceScope trace_("sum", detail::type_name<A>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    const T *arr = val.read();
+    return static_cast<R>(detail::sum_parallel<A>(M * N, [arr](size_t i) { return static_cast<A>(arr[i]); }));
+}
+
+// Inner product of matrices(m,n): sum of products of elements (summed as by "sum()")
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
+std::common_type_t<T, T_> dot(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
+    using TT_ = std::common_type_t<T, T_>;
+    MATRIX_TRACE_(detail::TraceScope trace_("dot", detail::type_name<TT_>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), 0, 2))));
+    using A = detail::accumulator_t<TT_>;
+    const T *lhs_arr = lhs.read();
+    const T_ *rhs_arr = rhs.read();
+    return static_cast<TT_>(detail::sum_parallel<A>(M * N, [lhs_arr, rhs_arr](size_t i) {
+        return static_cast<A>(lhs_arr[i]) * static_cast<A>(rhs_arr[i]);
+    }));
+}
+// Inner product of matrices(m,n) with products summed in type A, the result is converted to type R
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_, typename A, typename R>
+R dot(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs, Accumulate<A, R>) {
+    MATRIX_TRACE_(detail::TraceScope trace_("dot", detail::type_name<A>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), 0, 2))));
+    const T *lhs_arr = lhs.read();
+    const T_ *rhs_arr = rhs.read();
+    return static_cast<R>(detail::sum_parallel<A>(M * N, [lhs_arr, rhs_arr](size_t i) {
+        return static_cast<A>(lhs_arr[i]) * static_cast<A>(rhs_arr[i]);
+    }));
+}
+
+// Sum of diagonal elements of matrix(n,n)
+template<typename T, size_t N, MatrixDataStorage S>
+T trace(const Matrix<T, N, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("trace", detail::type_name<T>(), N, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, N, N, S>(elementwise_cost(N, sizeof(T), 0))));
+    const T *arr = val.read();
+    return static_cast<T>(detail::sum_pairwise<detail::accumulator_t<T>>(0, N, [arr](size_t i) { return arr[i * (N + 1)]; }));
+}
+
+// Frobenius norm: square root of the sum of squares of elements
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+detail::floating_t<T> norm_frobenius(const Matrix<T, M, N, S> &val) {
+    using F = detail::floating_t<T>;
+    MATRIX_TRACE_(detail::TraceScope trace_("norm_frobenius", detail::type_name<F>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0, 2))));
+    const T *arr = val.read();
+    return std::sqrt(detail::sum_parallel<F>(M * N, [arr](size_t i) { return static_cast<F>(arr[i]) * static_cast<F>(arr[i]); }));
+}
+// L1 norm: the maximal sum of absolute values of a column (of elements for a column vector)
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+detail::floating_t<T> norm_l1(const Matrix<T, M, N, S> &val) {
+    using F = detail::floating_t<T>;
+    MATRIX_TRACE_(detail::TraceScope trace_("norm_l1", detail::type_name<F>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0, 2))));
+    std::vector<F> sums(N);
+    detail::sum_columns(val.read(), M, N, sums.data(), [](const T x) { return detail::absolute(static_cast<F>(x)); });
+    return detail::extremum<true>(sums.data(), N);
+}
+// L-infinity norm: the maximal sum of absolute values of a row (the maximal
+// absolute value of an element for a column vector)
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+detail::floating_t<T> norm_linf(const Matrix<T, M, N, S> &val) {
+    using F = detail::floating_t<T>;
+    MATRIX_TRACE_(detail::TraceScope trace_("norm_linf", detail::type_name<F>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0, 2))));
+    const T *arr = val.read();
+    std::vector<F> sums(M);
+    detail::parallel_for(0, M, M * N, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            const T *row = arr + i * N;
+            sums[i] = detail::sum_pairwise<F>(0, N, [row](size_t j) { return detail::absolute(static_cast<F>(row[j])); });
+        }
+    });
+    return detail::extremum<true>(sums.data(), M);
+}
+
+// Element with its position
+template<typename T>
+struct MatrixExtremum {
+    T value;
+    size_t row;
+    size_t column;
+};
+// The minimal element, the first one if there are several. NaN is returned only
+// if all elements are NaN.
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+MatrixExtremum<T> min(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("min", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    const size_t i = detail::arg_extremum<false>(val.read(), M * N);
+    return { val.read()[i], i / N, i % N };
+}
+// The maximal element, the first one if there are several. NaN is returned only
+// if all elements are NaN.
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+MatrixExtremum<T> max(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("max", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    const size_t i = detail::arg_extremum<true>(val.read(), M * N);
+    return { val.read()[i], i / N, i % N };
+}
+
+// Sums of rows (summed as by "sum()")
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+Vector<T, M, result_matrix_data_storage(S)> sum_rows(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("sum_rows", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    Vector<T, M, result_matrix_data_storage(S)> ret;
+    const T *arr = val.read();
+    T *out = ret.write();
+    detail::parallel_for(0, M, M * N, [=](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            const T *row = arr + i * N;
+            out[i] = static_cast<T>(detail::sum_pairwise<detail::accumulator_t<T>>(0, N, [row](size_t j) { return row[j]; }));
+        }
+    });
+    return ret;
+}
+// Sums of columns (blocks of rows are summed pairwise)
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+RowVector<T, N, result_matrix_data_storage(S)> sum_columns(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("sum_columns", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    using A = detail::accumulator_t<T>;
+    std::vector<A> sums(N);
+    detail::sum_columns(val.read(), M, N, sums.data(), [](const T x) { return static_cast<A>(x); });
+    return RowVector<T, N, result_matrix_data_storage(S)>(sums.data());
+}
+// Minimums of rows
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+Vector<T, M, result_matrix_data_storage(S)> min_rows(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("min_rows", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    Vector<T, M, result_matrix_data_storage(S)> ret;
+    for (size_t i = 0; i < M; ++i) {
+        ret.write()[i] = detail::extremum<false>(val.read() + i * N, N);
+    }
+    return ret;
+}
+// Maximums of rows
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+Vector<T, M, result_matrix_data_storage(S)> max_rows(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("max_rows", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    Vector<T, M, result_matrix_data_storage(S)> ret;
+    for (size_t i = 0; i < M; ++i) {
+        ret.write()[i] = detail::extremum<true>(val.read() + i * N, N);
+    }
+    return ret;
+}
+// Minimums of columns
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+RowVector<T, N, result_matrix_data_storage(S)> min_columns(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("min_columns", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    RowVector<T, N, result_matrix_data_storage(S)> ret;
+    detail::extremum_columns<false>(val.read(), M, N, ret.write());
+    return ret;
+}
+// Maximums of columns
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+RowVector<T, N, result_matrix_data_storage(S)> max_columns(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("max_columns", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    RowVector<T, N, result_matrix_data_storage(S)> ret;
+    detail::extremum_columns<true>(val.read(), M, N, ret.write());
+    return ret;
+}
+
+
+
+// Elementwise functions
+namespace detail {
+
+// 1.5 * 2^(digits - 1): the sum of it and "val" (|val| < 2^(digits - 2)) is
+// "val" rounded to the nearest integer in the low bits of mantissa
+template<typename T>
+T round_magic() {
+    return T(1.5) * static_cast<T>(typename ieee_layout<T>::type(1) << ieee_layout<T>::kMantissa);
+}
+
+// "cond ? lhs : rhs" for floating point numbers by masking bits, so compilers
+// don't move the computation of the operands under conditions (it prevents
+// vectorization of loops with floating point operations that may trap)
+template<typename T>
+T select(const bool cond, const T lhs, const T rhs) {
+    using U = typename ieee_layout<T>::type;
+    const U mask = U(0) - static_cast<U>(cond);
+    return from_bits<T>((to_bits(lhs) & mask) | (to_bits(rhs) & ~mask));
+}
+
+// Whether single precision polynomials are enough for type T
+template<typename T>
+using is_single = std::integral_constant<bool, (std::numeric_limits<T>::digits <= 24)>;
+
+// e^r for |r| <= ln(2) / 2 by Taylor polynomial of degree 7 (float) or 13 (double)
+template<typename T>
+T exp_reduced(const T r, std::true_type) {
+    return T(1) + r * (T(1) + r * (T(1) / 2 + r * (T(1) / 6 + r * (T(1) / 24 + r * (T(1) / 120 +
+           r * (T(1) / 720 + r * (T(1) / 5040)))))));
+}
+template<typename T>
+T exp_reduced(const T r, std::false_type) {
+    return T(1) + r * (T(1) + r * (T(1) / 2 + r * (T(1) / 6 + r * (T(1) / 24 + r * (T(1) / 120 +
+           r * (T(1) / 720 + r * (T(1) / 5040 + r * (T(1) / 40320 + r * (T(1) / 362880 +
+           r * (T(1) / 3628800 + r * (T(1) / 39916800 + r * (T(1) / 479001600 + r * (T(1) / 6227020800)))))))))))));
+}
+
+// Sum of s^(2k) / (2k + 1) for s^2 <= 0.0295 (atanh(s) / s)
+template<typename T>
+T atanh_series(const T s2, std::true_type) {
+    return T(1) + s2 * (T(1) / 3 + s2 * (T(1) / 5 + s2 * (T(1) / 7 + s2 * (T(1) / 9))));
+}
+template<typename T>
+T atanh_series(const T s2, std::false_type) {
+    return T(1) + s2 * (T(1) / 3 + s2 * (T(1) / 5 + s2 * (T(1) / 7 + s2 * (T(1) / 9 + s2 * (T(1) / 11 +
+           s2 * (T(1) / 13 + s2 * (T(1) / 15 + s2 * (T(1) / 17 + s2 * (T(1) / 19)))))))));
+}
+
+// tanh(x) = sinh(x) / cosh(x) by their series for x^2 <= 0.3025, so the
+// relative error is bounded near zero
+template<typename T>
+T tanh_series(const T x, std::true_type) {
+    const T x2 = x * x;
+    const T sinh = x + x * x2 * (T(1) / 6 + x2 * (T(1) / 120 + x2 * (T(1) / 5040 + x2 * (T(1) / 362880))));
+    const T cosh = T(1) + x2 * (T(1) / 2 + x2 * (T(1) / 24 + x2 * (T(1) / 720 + x2 * (T(1) / 40320))));
+    return sinh / cosh;
+}
+template<typename T>
+T tanh_series(const T x, std::false_type) {
+    const T x2 = x * x;
+    const T sinh = x + x * x2 * (T(1) / 6 + x2 * (T(1) / 120 + x2 * (T(1) / 5040 + x2 * (T(1) / 362880 +
+                   x2 * (T(1) / 39916800 + x2 * (T(1) / 6227020800 + x2 * (T(1) / 1307674368000)))))));
+    const T cosh = T(1) + x2 * (T(1) / 2 + x2 * (T(1) / 24 + x2 * (T(1) / 720 + x2 * (T(1) / 40320 +
+                   x2 * (T(1) / 3628800 + x2 * (T(1) / 479001600 + x2 * (T(1) / 87178291200)))))));
+    return sinh / cosh;
+}
+
+} // namespace detail
+
+// Approximations of elementary functions of float or double without branches
+// and calls to the library, so loops with them are vectorized. The relative
+// error is within a few units in the last place of the type. Special values
+// (infinities, NaN, zeros, negative arguments of log() and sqrt()) are handled
+// as by the standard library.
+template<typename T>
+inline T approx_exp(const T x) {
+    static_assert(std::is_floating_point<T>::value, "approx_exp() requires floating point type");
+    using B = detail::ieee_layout<T>;
+    using U = typename B::type;
+    const T max = std::log(std::numeric_limits<T>::max());
+    const T min = std::log(std::numeric_limits<T>::denorm_min());
+    const T ln2_hi = T(0.693145751953125); // ln(2) = ln2_hi + ln2_lo, ln2_hi * n is exact
+    const T ln2_lo = T(1.42860682030941723212e-6);
+    // x = n * ln(2) + r, |r| <= ln(2) / 2. Values out of range are computed
+    // without conditions (and replaced at the end), so loops are vectorized.
+    const T magic = detail::round_magic<T>();
+    const T t = x * T(1.44269504088896340736) + magic;
+    const T n = t - magic;
+    const T r = (x - n * ln2_hi) - n * ln2_lo;
+    // 2^n is split into two factors, so subnormal results and 2^(bias + 1) are
+    // representable. Integers are in the low bits of sums with "magic".
+    const U k = detail::to_bits(t) - detail::to_bits(magic);
+    const U k0 = detail::to_bits(n * T(0.5) + magic) - detail::to_bits(magic);
+    const T scale0 = detail::from_bits<T>((k0 + static_cast<U>(B::kBias)) << B::kMantissa);
+    const T scale1 = detail::from_bits<T>((k - k0 + static_cast<U>(B::kBias)) << B::kMantissa);
+    const T res = detail::exp_reduced(r, detail::is_single<T>()) * scale0 * scale1;
+    return detail::select(x < min, T(0), detail::select(x > max, std::numeric_limits<T>::infinity(), detail::select(x != x, x, res)));
+}
+template<typename T>
+inline T approx_log(const T x) {
+    static_assert(std::is_floating_point<T>::value, "approx_log() requires floating point type");
+    using B = detail::ieee_layout<T>;
+    using U = typename B::type;
+    // subnormal numbers are scaled to normal ones
+    const bool subnormal = (x < std::numeric_limits<T>::min());
+    const T xs = x * detail::select(subnormal, static_cast<T>(U(1) << B::kMantissa), T(1));
+    // x = m * 2^e, m in [sqrt(1/2), sqrt(2)), the exponent of x / sqrt(1/2) is e
+    const U offset = detail::to_bits(T(0.707106781186547524401));
+    const U bits = detail::to_bits(xs) + ((static_cast<U>(B::kBias) << B::kMantissa) - offset);
+    const T m = detail::from_bits<T>((bits & ((U(1) << B::kMantissa) - 1)) + offset);
+    // e is converted to T by adding to the bits of a number with unit in the last place
+    const U e_bits = (bits >> B::kMantissa) - static_cast<U>(B::kBias) - static_cast<U>(subnormal) * B::kMantissa;
+    const T magic = detail::round_magic<T>();
+    const T e = detail::from_bits<T>(detail::to_bits(magic) + e_bits) - magic;
+    // ln(m) = 2 * atanh(s), s = (m - 1) / (m + 1)
+    const T s = (m - T(1)) / (m + T(1));
+    const T res = e * T(0.693147180559945309417) + T(2) * s * detail::atanh_series(s * s, detail::is_single<T>());
+    return detail::select((x != x) || (x == std::numeric_limits<T>::infinity()), x,
+                          detail::select(x < T(0), std::numeric_limits<T>::quiet_NaN(),
+                                         detail::select(x == T(0), -std::numeric_limits<T>::infinity(), res)));
+}
+template<typename T>
+inline T approx_tanh(const T x) {
+    static_assert(std::is_floating_point<T>::value, "approx_tanh() requires floating point type");
+    // tanh(|x|) = 1 - 2 / (e^(2|x|) + 1), which cancels for small |x|, where
+    // the series are used instead
+    const T ax = std::abs(x);
+    const T res = detail::select(ax < T(0.55), detail::tanh_series(ax, detail::is_single<T>()),
+                                 T(1) - T(2) / (approx_exp(T(2) * ax) + T(1)));
+    return detail::select(x < T(0), -res, detail::select(x > T(0), res, x));
+}
+template<typename T>
+inline T approx_sqrt(const T x) {
+    static_assert(std::is_floating_point<T>::value, "approx_sqrt() requires floating point type");
+    using B = detail::ieee_layout<T>;
+    using U = typename B::type;
+    // subnormal numbers are scaled by an even power of two to normal ones
+    const bool subnormal = (x < std::numeric_limits<T>::min());
+    const int shift = (B::kMantissa + 1) / 2 * 2;
+    const T xs = x * detail::select(subnormal, static_cast<T>(U(1) << shift), T(1));
+    // 1 / sqrt(x) is estimated by halving the exponent, the error of about 3.5%
+    // is squared by every Newton iteration
+    T y = detail::from_bits<T>((static_cast<U>(3 * B::kBias) << (B::kMantissa - 1)) - (detail::to_bits(xs) >> 1));
+    for (int i = 0; i < (detail::is_single<T>::value ? 3 : 4); ++i) {
+        y = y * (T(1.5) - T(0.5) * xs * y * y);
+    }
+    // the last step computes sqrt(x) = x / sqrt(x) correcting the rounding
+    const T r = xs * y;
+    const T res = (r + T(0.5) * y * (xs - r * r)) * detail::select(subnormal, T(1) / static_cast<T>(U(1) << (shift / 2)), T(1));
+    return detail::select((x != x) || (x == std::numeric_limits<T>::infinity()) || (x == T(0)), x,
+                          detail::select(x < T(0), std::numeric_limits<T>::quiet_NaN(), res));
+}
+
+// Matrix of "f(a_ij)" with elements of type returned by "f". Loops are
+// vectorized if "f" is (e.g. arithmetic, "std::abs", "approx_exp"), large
+// matrices are split between threads.
+template<typename T, size_t M, size_t N, MatrixDataStorage S, typename F>
+Matrix<std::decay_t<decltype(std::declval<F &>()(std::declval<const T &>()))>, M, N, result_matrix_data_storage(S)>
+map(const Matrix<T, M, N, S> &val, F f) {
+    using R = std::decay_t<decltype(f(std::declval<const T &>()))>;
+    MATRIX_TRACE_(detail::TraceScope trace_("map", detail::type_name<R>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), sizeof(R)))));
+    Matrix<R, M, N, result_matrix_data_storage(S)> ret;
+    detail::transform(M * N, val.read(), ret.write(), f);
+    return ret;
+}
+// Matrix of "f(a_ij, b_ij)" with elements of type returned by "f"
+template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_, typename F>
+Matrix<std::decay_t<decltype(std::declval<F &>()(std::declval<const T &>(), std::declval<const T_ &>()))>, M, N, result_matrix_data_storage(S, S_)>
+zip(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs, F f) {
+    using R = std::decay_t<decltype(f(std::declval<const T &>(), std::declval<const T_ &>()))>;
+    MATRIX_TRACE_(detail::TraceScope trace_("zip", detail::type_name<R>(), M, N, 0, S, S_));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T) + sizeof(T_), sizeof(R)))));
+    Matrix<R, M, N, result_matrix_data_storage(S, S_)> ret;
+    detail::transform(M * N, lhs.read(), rhs.read(), ret.write(), f);
+    return ret;
+}
+// Replaces elements a_ij by "f(a_ij)" in place, returns the matrix
+template<typename T, size_t M, size_t N, MatrixDataStorage S, typename F>
+Matrix<T, M, N, S> &apply(Matrix<T, M, N, S> &val, F f) {
+    MATRIX_TRACE_(detail::TraceScope trace_("apply", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), sizeof(T)))));
+    T *arr = val.write();
+    detail::transform(M * N, arr, arr, [f](const T x) { return static_cast<T>(f(x)); });
+    return val;
+}
+
+// Elementwise approximations of elementary functions (see "approx_exp()"),
+// integer matrices give double results
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+Matrix<detail::floating_t<T>, M, N, result_matrix_data_storage(S)> approx_exp(const Matrix<T, M, N, S> &val) {
+    return map(val, [](const T x) { return approx_exp(static_cast<detail::floating_t<T>>(x)); });
+}
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+Matrix<detail::floating_t<T>, M, N, result_matrix_data_storage(S)> approx_log(const Matrix<T, M, N, S> &val) {
+    return map(val, [](const T x) { return approx_log(static_cast<detail::floating_t<T>>(x)); });
+}
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+Matrix<detail::floating_t<T>, M, N, result_matrix_data_storage(S)> approx_tanh(const Matrix<T, M, N, S> &val) {
+    return map(val, [](const T x) { return approx_tanh(static_cast<detail::floating_t<T>>(x)); });
+}
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+Matrix<detail::floating_t<T>, M, N, result_matrix_data_storage(S)> approx_sqrt(const Matrix<T, M, N, S> &val) {
+    return map(val, [](const T x) { return approx_sqrt(static_cast<detail::floating_t<T>>(x)); });
+}
+
+namespace detail {
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef __int128 int128_t;
+#endif
+
+// Whether integer "val" is representable by integer type W
+template<typename W, typename T>
+constexpr bool representable(const T val) {
+    const W res = static_cast<W>(val);
+    return (static_cast<T>(res) == val) && ((res < W(0)) == (val < T(0)));
+}
+
+// Checked arithmetic of signed integers, returns false on overflow
+template<typename W>
+constexpr bool checked_mul(const W lhs, const W rhs, W &res) {
+#if defined(__GNUC__) || defined(__clang__)
+    return !__builtin_mul_overflow(lhs, rhs, &res);
+#else
+    const W max = std::numeric_limits<W>::max();
+    const W min = std::numeric_limits<W>::min();
+    if ((lhs > 0) ? ((rhs > 0) ? (lhs > max / rhs) : (rhs < min / lhs))
+                  : ((rhs > 0) ? (lhs < min / rhs) : ((lhs != 0) && (rhs < max / lhs)))) {
+        return false;
+    }
+    res = lhs * rhs;
+    return true;
+#endif
+}
+template<typename W>
+constexpr bool checked_sub(const W lhs, const W rhs, W &res) {
+#if defined(__GNUC__) || defined(__clang__)
+    return !__builtin_sub_overflow(lhs, rhs, &res);
+#else
+    if (((rhs > 0) && (lhs < std::numeric_limits<W>::min() + rhs)) ||
+        ((rhs < 0) && (lhs > std::numeric_limits<W>::max() + rhs))) {
+        return false;
+    }
+    res = lhs - rhs;
+    return true;
+#endif
+}
+
+// Computes determinant of integer matrix(n,n) by Bareiss fraction-free
+// elimination in signed integer type W using workspace "a" of n * n elements.
+// Every division is exact, intermediate elements are minors of the matrix.
+// Returns false on overflow of W.
+template<typename W, typename T>
+constexpr bool det_bareiss(const T *arr, const size_t n, W *a, W &res) {
+    for (size_t i = 0; i < n * n; ++i) {
+        if (!representable<W>(arr[i])) {
+            return false;
+        }
+        a[i] = static_cast<W>(arr[i]);
+    }
+    bool negative = false;
+    W prev = 1; // pivot of the previous step
+    for (size_t k = 0; k + 1 < n; ++k) {
+        if (a[k * n + k] == 0) { // swap with a row having non-zero element
+            size_t i = k + 1;
+            while ((i < n) && (a[i * n + k] == 0)) {
+                ++i;
+            }
+            if (i == n) {
+                res = 0;
+                return true;
+            }
+            for (size_t j = k; j < n; ++j) {
+                const W tmp = a[k * n + j];
+                a[k * n + j] = a[i * n + j];
+                a[i * n + j] = tmp;
+            }
+            negative = !negative;
+        }
+        const W pivot = a[k * n + k];
+        for (size_t i = k + 1; i < n; ++i) {
+            for (size_t j = k + 1; j < n; ++j) { // (a_ij * a_kk - a_ik * a_kj) / prev
+                W lhs = 0;
+                W rhs = 0;
+                W diff = 0;
+                if (!checked_mul(a[i * n + j], pivot, lhs) || !checked_mul(a[i * n + k], a[k * n + j], rhs) ||
+                    !checked_sub(lhs, rhs, diff) || ((prev == -1) && (diff == std::numeric_limits<W>::min()))) {
+                    return false;
+                }
+                a[i * n + j] = diff / prev;
+            }
+        }
+        prev = pivot;
+    }
+    res = a[n * n - 1];
+    if (negative) {
+        if (res == std::numeric_limits<W>::min()) {
+            return false;
+        }
+        res = -res;
+    }
+    return true;
+}
+
+// Arithmetic modulo prime p < 2^31
+inline uint64_t pow_mod(uint64_t base, uint64_t exp, const uint64_t p) {
+    uint64_t res = 1;
+    for (base %= p; exp != 0; exp >>= 1) {
+        if (exp & 1) {
+            res = res * base % p;
+        }
+        base = base * base % p;
+    }
+    return res;
+}
+// Deterministic Miller-Rabin test of 32-bit numbers
+inline bool is_prime(const uint64_t n) {
+    if (n < 2) {
+        return false;
+    }
+    for (uint64_t d : { 2, 3, 5, 7, 61 }) {
+        if (n % d == 0) {
+            return n == d;
+        }
+    }
+    uint64_t d = n - 1;
+    size_t r = 0;
+    for ( ; (d & 1) == 0; d >>= 1) {
+        ++r;
+    }
+    for (uint64_t a : { 2, 7, 61 }) {
+        uint64_t x = pow_mod(a, d, n);
+        if ((x == 1) || (x == n - 1)) {
+            continue;
+        }
+        size_t i = 1;
+        for ( ; i < r; ++i) {
+            x = x * x % n;
+            if (x == n - 1) {
+                break;
+            }
+        }
+        if (i == r) {
+            return false;
+        }
+    }
+    return true;
+}
+// Absolute value of integer "val"
+template<typename T>
+uint64_t magnitude(const T val) {
+    return (val < T(0)) ? (uint64_t(0) - static_cast<uint64_t>(val)) : static_cast<uint64_t>(val);
+}
+// Residue of integer "val" modulo p
+template<typename T>
+uint64_t residue(const T val, const uint64_t p) {
+    return (val < T(0)) ? (p - magnitude(val) % p) % p : magnitude(val) % p;
+}
+
+// Computes determinant of integer matrix(n,n) modulo prime p by Gaussian elimination
+template<typename T>
+uint64_t det_mod(const T *arr, const size_t n, const uint64_t p, std::vector<uint64_t> &a) {
+    a.resize(n * n);
+    for (size_t i = 0; i < n * n; ++i) {
+        a[i] = residue(arr[i], p);
+    }
+    uint64_t res = 1;
+    for (size_t k = 0; k < n; ++k) {
+        size_t i = k;
+        while ((i < n) && (a[i * n + k] == 0)) {
+            ++i;
+        }
+        if (i == n) {
+            return 0;
+        }
+        if (i != k) {
+            std::swap_ranges(a.begin() + k * n, a.begin() + k * n + n, a.begin() + i * n);
+            res = p - res;
+        }
+        res = res * a[k * n + k] % p;
+        const uint64_t inv = pow_mod(a[k * n + k], p - 2, p);
+        for (i = k + 1; i < n; ++i) {
+            const uint64_t factor = a[i * n + k] * inv % p;
+            for (size_t j = k + 1; j < n; ++j) {
+                a[i * n + j] = (a[i * n + j] + (p - factor) * a[k * n + j]) % p;
+            }
+        }
+    }
+    return res % p;
+}
+
+// Value of mixed radix number "digits" with radices "primes", returns false
+// if it doesn't fit in 64 bits
+inline bool mixed_radix_value(const std::vector<uint64_t> &digits, const std::vector<uint64_t> &primes, uint64_t &res) {
+    res = 0;
+    for (size_t i = digits.size(); i-- > 0; ) { // Horner scheme
+        if ((res != 0) && (res > (std::numeric_limits<uint64_t>::max() - digits[i]) / primes[i])) {
+            return false;
+        }
+        res = res * primes[i] + digits[i];
+    }
+    return true;
+}
+
+// Computes determinant of integer matrix(n,n) by Chinese remainder theorem.
+// Determinant is found modulo enough primes to exceed twice Hadamard-like bound
+// (product of maximal elements of rows times n) and reconstructed by Garner's
+// algorithm. Returns false if the determinant isn't representable by T.
+template<typename T>
+bool det_crt(const T *arr, const size_t n, T &res) {
+    size_t bits = 2; // sign and margin
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t max = 0;
+        for (size_t j = 0; j < n; ++j) {
+            max = std::max(max, magnitude(arr[i * n + j]));
+        }
+        for ( ; max != 0; max >>= 1) {
+            ++bits;
+        }
+        for (size_t m = n; m != 0; m >>= 1) {
+            ++bits;
+        }
+    }
+    const size_t count = std::max<size_t>(3, bits / 30 + 1); // every prime exceeds 2^30
+    std::vector<uint64_t> primes;
+    std::vector<uint64_t> digits;
+    std::vector<uint64_t> work;
+    for (uint64_t p = (uint64_t(1) << 31) - 1; primes.size() < count; p -= 2) {
+        if (!is_prime(p)) {
+            continue;
+        }
+        uint64_t r = det_mod(arr, n, p, work);
+        for (size_t i = 0; i < primes.size(); ++i) { // Garner: (r - c_i) / p_i for every previous digit
+            r = (r + p - digits[i] % p) % p * pow_mod(primes[i] % p, p - 2, p) % p;
+        }
+        primes.push_back(p);
+        digits.push_back(r);
+    }
+    // Symmetric range: the value "v" or "v - M" is small, M - 1 - v has digits p_i - 1 - c_i
+    uint64_t val;
+    if (mixed_radix_value(digits, primes, val)) {
+        if (!representable<T>(val)) {
+            return false;
+        }
+        res = static_cast<T>(val);
+        return true;
+    }
+    for (size_t i = 0; i < digits.size(); ++i) {
+        digits[i] = primes[i] - 1 - digits[i];
+    }
+    if (!mixed_radix_value(digits, primes, val) || (val == std::numeric_limits<uint64_t>::max()) ||
+        (val + 1 > uint64_t(1) << 63) || !std::is_signed<T>::value) {
+        return false;
+    }
+    const long long neg = (val + 1 == uint64_t(1) << 63) ? std::numeric_limits<long long>::min() : -static_cast<long long>(val + 1);
+    if (!representable<T>(neg)) {
+        return false;
+    }
+    res = static_cast<T>(neg);
+    return true;
+}
+
+// Computes exact determinant of integer matrix(n,n) in O(n^3) without floating
+// point: Bareiss elimination in 64-bit integers, in 128-bit integers on
+// overflow and determinant modulo primes as the last resort. Returns false if
+// the determinant isn't representable by T.
+template<typename T>
+bool det_integer(const T *arr, const size_t n, T &res) {
+    std::vector<long long> work(n * n);
+    long long res64;
+    if (det_bareiss(arr, n, work.data(), res64)) {
+        res = static_cast<T>(res64);
+        return representable<T>(res64);
+    }
+#ifdef __SIZEOF_INT128__
+    std::vector<int128_t> work128(n * n);
+    int128_t res128;
+    if (det_bareiss(arr, n, work128.data(), res128)) {
+        res = static_cast<T>(res128);
+        return representable<T>(res128);
+    }
+#endif
+    return det_crt(arr, n, res);
+}
+// The same for matrices on stack with workspace on stack, it's usable in
+// constant expressions unless determinant modulo primes is needed.
+template<size_t N, typename T>
+constexpr bool det_integer(const T *arr, T &res, std::true_type) {
+    long long work[N * N] = {};
+    long long res64 = 0;
+    if (det_bareiss(arr, N, work, res64)) {
+        res = static_cast<T>(res64);
+        return representable<T>(res64);
+    }
+#ifdef __SIZEOF_INT128__
+    int128_t work128[N * N] = {};
+    int128_t res128 = 0;
+    if (det_bareiss(arr, N, work128, res128)) {
+        res = static_cast<T>(res128);
+        return representable<T>(res128);
+    }
+#endif
+    return det_crt(arr, N, res);
+}
+template<size_t N, typename T>
+bool det_integer(const T *arr, T &res, std::false_type) {
+    return det_integer(arr, N, res);
+}
+
+// Gaussian elimination method is used to obtain something close to lower
+// triangular matrix (LTM), thus the complexity is O(n^3).
+template<typename T, size_t N, MatrixDataStorage S>
+constexpr T det_elimination(const Matrix<T, N, N, S> &val) {
+    Matrix<T, N, N, result_matrix_data_storage(S)> ltm(val); // will be transformed to almost-LTM
+    T *arr = ltm.write();
+
+    T factor = 1; // accumulates intermediate multiplyers
+    // Since transposed matrix has the same determinant as original we transform
+    // given matrix to almost-LTM because of C-style array location in memory.
+    for (size_t i = 0; i < N; ++i) { // rows
+        size_t iN = i * N; // use const inside a row values
+        if (arr[iN + i] == 0) { // diagonal elenment is zero, need to swap columns
+            size_t j = i + 1;
+            for ( ; j < N; ++j) { // search for not-zero element further in the same row
+                if (arr[iN + j] != 0) { // non-zero element found, swap columns (actually, lower parts only)
+                    for (size_t k = i; k < N; ++k) {
+                        const T tmp = arr[k * N + i];
+                        arr[k * N + i] = arr[k * N + j];
+                        arr[k * N + j] = tmp;
+                    }
+                    factor = -factor; // column swap inverts determinant
+                    j = i; // used as flag that matrix is nondegenerate
+                    break;
+                }
+            }
+            if (j != i) { // determinant of degenerate matrix is zero
+                return T(0);
+            }
+        }
+        for (size_t j = i + 1; j < N; ++j) { // further columns
+            if (arr[iN + j] != 0) {
+                T multiplier = arr[iN + i] / arr[iN + j];
+                factor *= multiplier; // column multiplication changes determinant
+                for (size_t k = i + 1; k < N; ++k) { // subtract lower part of column
+                    arr[k * N + j] = arr[k * N + j] * multiplier - arr[k * N + i];
+                }
+            }
+        }
+    }
+    T res = arr[0];
+    for (size_t i = 1; i < N; ++i) { // diagonal elements represent determinant
+        res *= arr[i * N + i];
+    }
+    res /= factor;
+    return res;
+}
+
+template<typename T, size_t N, MatrixDataStorage S>
+constexpr T det(const Matrix<T, N, N, S> &val, std::false_type) {
+    return det_elimination(val);
+}
+template<typename T, size_t N, MatrixDataStorage S>
+constexpr T det(const Matrix<T, N, N, S> &val, std::true_type) {
+    T res = 0;
+    return det_integer<N>(val.read(), res, on_stack<T, N, N, S>()) ? res :
+           throw std::overflow_error("determinant isn't representable by the element type");
+}
+
+template<typename T>
+using is_integer = std::integral_constant<bool, std::is_integral<T>::value && !std::is_same<T, bool>::value>;
+
+} // namespace detail
+
+// Computes determinant of matrix(n,n) in O(n^3). Matrices with floating point
+// elements are reduced by Gaussian elimination. Determinant of integer matrices
+// is computed exactly without floating point (see "detail::det_integer()"),
+// "std::overflow_error" is thrown if it isn't representable by T.
+template<typename T, size_t N, MatrixDataStorage S>
+MATRIX_CONSTEXPR_ T det(const Matrix<T, N, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("det", detail::type_name<T>(), N, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, N, N, S>(det_cost<T, N>())));
+    return detail::det(val, detail::is_integer<T>());
+}
+// Computes exact determinant of integer matrix(n,n) into "res". Returns false
+// if the determinant isn't representable by T.
+template<typename T, size_t N, MatrixDataStorage S, typename = std::enable_if_t<detail::is_integer<T>::value>>
+MATRIX_CONSTEXPR_ bool det(const Matrix<T, N, N, S> &val, T &res) {
+    MATRIX_TRACE_(detail::TraceScope trace_("det", detail::type_name<T>(), N, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, N, N, S>(det_cost<T, N>())));
+    return detail::det_integer<N>(val.read(), res, detail::on_stack<T, N, N, S>());
+}
+
+
+
+// Memoization
+// Counters of the memoization cache (see "matrix_cache_stats()")
+struct MatrixCacheStats {
+    size_t hits = 0;      // results found in the cache
+    size_t misses = 0;    // results not found (computed and saved)
+    size_t evictions = 0; // least recently used results removed to fit the capacity
+    size_t entries = 0;   // results in the cache
+    size_t bytes = 0;     // total size of results and copies of their operands
+};
+
+namespace detail {
+
+// Constants of xxHash32 rounds
+constexpr uint32_t kHashPrime1 = 2654435761u;
+constexpr uint32_t kHashPrime2 = 2246822519u;
+
+inline uint32_t rotl32(const uint32_t val, const int shift) {
+    return (val << shift) | (val >> (32 - shift));
+}
+
+// Mixes bits of 64-bit number (the finalizer of splitmix64)
+inline uint64_t mix64(uint64_t val) {
+    val = (val ^ (val >> 30)) * 0xbf58476d1ce4e5b9u;
+    val = (val ^ (val >> 27)) * 0x94d049bb133111ebu;
+    return val ^ (val >> 31);
+}
+
+// Hash of "n" bytes. Blocks of 128 bytes are hashed in 32 independent lanes
+// of 32-bit words by rounds of xxHash32 (the loop is vectorized, several
+// vectors hide the latency of multiplications), then the lanes and the tail
+// are mixed into 64 bits.
+inline uint64_t hash_bytes(const void *data, const size_t n, const uint64_t seed) {
+    constexpr size_t kLanes = 32;
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    uint32_t acc[kLanes];
+    for (size_t j = 0; j < kLanes; ++j) {
+        acc[j] = static_cast<uint32_t>(seed) + kHashPrime1 * static_cast<uint32_t>(j + 1);
+    }
+    const size_t blocks = n / sizeof(acc);
+    for (size_t i = 0; i < blocks; ++i) {
+        uint32_t words[kLanes];
+        std::memcpy(words, bytes + i * sizeof(acc), sizeof(words));
+        for (size_t j = 0; j < kLanes; ++j) {
+            acc[j] = rotl32(acc[j] + words[j] * kHashPrime2, 13) * kHashPrime1;
+        }
+    }
+    uint64_t res = mix64(seed ^ n);
+    for (size_t j = 0; j < kLanes; ++j) {
+        res = mix64(res ^ acc[j]);
+    }
+    for (size_t i = blocks * sizeof(acc); i < n; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        std::memcpy(&word, bytes + i, std::min(n - i, sizeof(word)));
+        res = mix64(res ^ word);
+    }
+    return res;
+}
+
+// Hash of elements of trivially copyable type is the hash of their bits,
+// other elements are hashed by "std::hash"
+template<typename T>
+uint64_t hash(const T *arr, const size_t n, const uint64_t seed, std::true_type) {
+    return hash_bytes(arr, n * sizeof(T), seed);
+}
+template<typename T>
+uint64_t hash(const T *arr, const size_t n, const uint64_t seed, std::false_type) {
+    uint64_t res = mix64(seed ^ n);
+    for (size_t i = 0; i < n; ++i) {
+        res = mix64(res ^ static_cast<uint64_t>(std::hash<T>()(arr[i])));
+    }
+    return res;
+}
+
+// Identifier of type T unique within the program (the address of a variable)
+template<typename T>
+struct TypeId {
+    static const char id;
+};
+template<typename T>
+const char TypeId<T>::id = 0;
+template<typename T>
+uint64_t type_id() {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&TypeId<T>::id));
+}
+
+// Memory of an operand or a result of memoized operation
+struct MemoBytes {
+    const void *data;
+    size_t size;
+};
+
+// Least recently used results of operations with copies of their operands.
+// Operands of an entry found by the key are compared with the given ones, so
+// collisions of hashes give misses instead of wrong results.
+class MemoCache {
+  public:
+    static MemoCache &instance() {
+        static MemoCache cache;
+        return cache;
     }
 
-    template<typename T_, MatrixDataStorage S_>
-    Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
-        T *arr = write();
-        const T_* const other_arr = other.read();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] += static_cast<T>(other_arr[i]);
-        }
-        return *this;
+    bool enabled() const {
+        return capacity_ != 0;
     }
-    template<typename T_, MatrixDataStorage S_>
-    Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
-        T *arr = write();
-        const T_* const other_arr = other.read();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] -= static_cast<T>(other_arr[i]);
+
+    // Copies the result of the operation into "res" if it's found
+    bool find(const uint64_t key, const std::initializer_list<MemoBytes> operands, void *res, const size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto it = index_.find(key);
+        if ((it == index_.end()) || !same(it->second->operands, operands) || (it->second->result.size() != size)) {
+            ++stats_.misses;
+            return false;
         }
-        return *this;
+        std::memcpy(res, it->second->result.data(), size);
+        entries_.splice(entries_.begin(), entries_, it->second);
+        ++stats_.hits;
+        return true;
     }
-    template<typename T_>
-    Matrix& operator*=(const T_ &other) {
-        T *arr = write();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] *= static_cast<T>(other);
+
+    // Saves the result of the operation, the least recently used results are
+    // evicted to fit the capacity. Results greater than the capacity aren't saved.
+    void insert(const uint64_t key, const std::initializer_list<MemoBytes> operands, const void *res, const size_t size) {
+        Entry entry;
+        entry.key = key;
+        for (const MemoBytes &operand : operands) {
+            const unsigned char *bytes = static_cast<const unsigned char *>(operand.data);
+            entry.operands.insert(entry.operands.end(), bytes, bytes + operand.size);
         }
-        return *this;
-    }
-    template<typename T_>
-    Matrix& operator/=(const T_ &other) {
-        T *arr = write();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] /= static_cast<T>(other);
+        entry.result.assign(static_cast<const unsigned char *>(res), static_cast<const unsigned char *>(res) + size);
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto it = index_.find(key);
+        if (it != index_.end()) {
+            erase(it->second);
         }
-        return *this;
+        if (entry.bytes() > capacity_) {
+            return;
+        }
+        stats_.bytes += entry.bytes();
+        ++stats_.entries;
+        entries_.push_front(std::move(entry));
+        index_[key] = entries_.begin();
+        shrink();
     }
-};
 
-// Matrix on heap (explicitly set)
-template<typename T, size_t M, size_t N>
-class Matrix<T, M, N, MatrixDataStorage::HEAP> {
-  private:
-    MatrixData<T, M, N, MatrixDataStorage::HEAP> md_;
+    void set_capacity(const size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+        shrink();
+    }
+    size_t capacity() const {
+        return capacity_;
+    }
 
-  public:
-    Matrix() : md_() {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP constructor" << std::endl);
+    MatrixCacheStats stats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
     }
-    template<typename T_>
-    explicit Matrix(T_ &&val) : md_(std::forward<T_>(val)) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP constructor (val)" << std::endl);
+
+    // Removes all results and resets the counters
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        index_.clear();
+        stats_ = MatrixCacheStats();
     }
-    template<typename T_>
-    explicit Matrix(T_ *arr) : md_(arr) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP constructor (arr)" << std::endl);
+
+  private:
+    struct Entry {
+        uint64_t key;
+        std::vector<unsigned char> operands;
+        std::vector<unsigned char> result;
+
+        size_t bytes() const {
+            return operands.size() + result.size();
+        }
+    };
+
+    static bool same(const std::vector<unsigned char> &saved, const std::initializer_list<MemoBytes> operands) {
+        size_t offset = 0;
+        for (const MemoBytes &operand : operands) {
+            if ((saved.size() < offset + operand.size) || (std::memcmp(saved.data() + offset, operand.data, operand.size) != 0)) {
+                return false;
+            }
+            offset += operand.size;
+        }
+        return offset == saved.size();
     }
-    template<typename T_>
-    Matrix(std::initializer_list<T_> init) : md_(init) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP constructor (init)" << std::endl);
+
+    void erase(const std::list<Entry>::iterator it) {
+        stats_.bytes -= it->bytes();
+        --stats_.entries;
+        index_.erase(it->key);
+        entries_.erase(it);
     }
 
-    ~Matrix() = default;
-    Matrix(const Matrix &other) = default;
-    Matrix(Matrix &&other) = default;
-    Matrix& operator=(const Matrix &other) = default;
-    Matrix& operator=(Matrix &&other) = default;
+    void shrink() {
+        while (stats_.bytes > capacity_) {
+            erase(std::prev(entries_.end()));
+            ++stats_.evictions;
+        }
+    }
 
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) : md_(other.read()) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP <- UNSPECIFIED" << std::endl);
+    std::mutex mutex_;
+    std::atomic<size_t> capacity_{0};
+    std::list<Entry> entries_; // the most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+    MatrixCacheStats stats_;
+};
+
+// Key of memoized operation "op" on operands with the given hashes
+template<typename T, typename T_>
+uint64_t memo_key(const uint64_t op, const uint64_t lhs_hash, const uint64_t rhs_hash) {
+    return mix64(mix64(mix64(mix64(op) ^ type_id<T>()) ^ type_id<T_>() ^ lhs_hash) ^ rhs_hash);
+}
+
+} // namespace detail
+
+// Hash of the contents of matrix(m,n). Bits of trivially copyable elements
+// are hashed by a vectorized loop (so equal floating point matrices with zeros
+// of different signs have different hashes), other elements are hashed by
+// "std::hash". Hashes aren't stable between versions of the library.
+template<typename T, size_t M, size_t N, MatrixDataStorage S>
+uint64_t hash(const Matrix<T, M, N, S> &val) {
+    MATRIX_TRACE_(detail::TraceScope trace_("hash", detail::type_name<T>(), M, N, 0, S));
+    MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(T), 0))));
+    return detail::hash(val.read(), M * N, detail::mix64(M) ^ N, std::is_trivially_copyable<T>());
+}
+
+// Memoization of expensive operations ("mul(lhs, rhs, Memoize())" and
+// "det(val, Memoize())") in a cache of least recently used results shared by
+// threads. It's disabled until its capacity is set: results are kept with
+// copies of their operands (so a hit never returns a result of different
+// operands) while their total size fits the capacity. A hit costs hashing and
+// comparison of the operands.
+struct Memoize {};
+
+// Sets the capacity of the memoization cache in bytes (zero disables it)
+inline void set_matrix_cache_capacity(const size_t bytes) {
+    detail::MemoCache::instance().set_capacity(bytes);
+}
+// Returns the capacity of the memoization cache in bytes
+inline size_t matrix_cache_capacity() {
+    return detail::MemoCache::instance().capacity();
+}
+// Returns counters of the memoization cache
+inline MatrixCacheStats matrix_cache_stats() {
+    return detail::MemoCache::instance().stats();
+}
+// Removes all results from the memoization cache and resets its counters
+inline void clear_matrix_cache() {
+    detail::MemoCache::instance().clear();
+}
+
+// Multiplies matrix(m,n) by matrix(n,p), the result is memoized
+template<typename T, typename T_, size_t M, size_t N, size_t P, MatrixDataStorage S, MatrixDataStorage S_>
+Matrix<std::common_type_t<T, T_>, M, P, result_matrix_data_storage(S, S_)> mul(const Matrix<T, M, N, S> &lhs, const Matrix<T_, N, P, S_> &rhs, Memoize) {
+    using TT_ = std::common_type_t<T, T_>;
+    static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_copyable<T_>::value,
+                  "memoized operations require trivially copyable elements");
+    detail::MemoCache &cache = detail::MemoCache::instance();
+    if (!cache.enabled()) {
+        return mul(lhs, rhs);
     }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) : md_(other.read()) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP <- STACK" << std::endl);
+    // the algorithm of large products affects the rounding
+    const uint64_t op = detail::mix64(1 + static_cast<uint64_t>(detail::mul_policy_setting().load())) ^ detail::strassen_crossover_setting();
+    const uint64_t key = detail::memo_key<T, T_>(op, hash(lhs), hash(rhs));
+    const std::initializer_list<detail::MemoBytes> operands = { { lhs.read(), M * N * sizeof(T) }, { rhs.read(), N * P * sizeof(T_) } };
+    Matrix<TT_, M, P, result_matrix_data_storage(S, S_)> ret;
+    if (!cache.find(key, operands, ret.write(), M * P * sizeof(TT_))) {
+        ret = mul(lhs, rhs);
+        cache.insert(key, operands, ret.read(), M * P * sizeof(TT_));
     }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) : md_(other.read()) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP type converter" << std::endl);
+    return ret;
+}
+
+// Computes determinant of matrix(n,n) (see "det()"), the result is memoized
+template<typename T, size_t N, MatrixDataStorage S>
+T det(const Matrix<T, N, N, S> &val, Memoize) {
+    static_assert(std::is_trivially_copyable<T>::value, "memoized operations require trivially copyable elements");
+    detail::MemoCache &cache = detail::MemoCache::instance();
+    if (!cache.enabled()) {
+        return det(val);
     }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) : md_(other.read()) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  HEAP <- USER" << std::endl);
+    const uint64_t key = detail::memo_key<T, T>(0, hash(val), 0);
+    const std::initializer_list<detail::MemoBytes> operands = { { val.read(), N * N * sizeof(T) } };
+    T res;
+    if (!cache.find(key, operands, &res, sizeof(T))) {
+        res = det(val);
+        cache.insert(key, operands, &res, sizeof(T));
     }
+    return res;
+}
 
-    const T* const read() const { return md_.read(); }
-    T* write() { return md_.write(); }
-    void print() {
-        const T* const arr = read();
-        for (size_t i = 0; i < M * N; ) {
-            std::cout << arr[i];
-            std::cout << (!(++i % N) ? '\n' : ' ');
+
+
+// Quantized matrices
+// Quantization parameters of the matrix
+enum class MatrixQuantization {
+    PER_TENSOR, // one scale and zero point for the whole matrix
+    PER_ROW     // scale and zero point for every row
+};
+
+// Matrix(m,n) of 8-bit integers q approximating real numbers x = scale * (q - zero_point).
+// It takes four times less memory than float matrix. Scales and zero points
+// are chosen for ranges of rows or the whole matrix including zero, so zero
+// is represented exactly. Storage S is used for all data.
+template<size_t M, size_t N, MatrixQuantization Q = MatrixQuantization::PER_TENSOR, MatrixDataStorage S = MatrixDataStorage::UNSPECIFIED>
+class QuantizedMatrix {
+    static_assert(S != MatrixDataStorage::USER, "Quantized matrix can't be placed in user memory");
+
+  public:
+    static constexpr size_t kGroups = (Q == MatrixQuantization::PER_ROW) ? M : 1; // sets of parameters
+
+  private:
+    Matrix<int8_t, M, N, S> data_;
+    Matrix<float, kGroups, 1, S> scales_;
+    Matrix<int32_t, kGroups, 1, S> zero_points_;
+
+  public:
+    // Quantizes real matrix
+    template<typename T, MatrixDataStorage S_>
+    explicit QuantizedMatrix(const Matrix<T, M, N, S_> &val) {
+        MATRIX_TRACE_(detail::TraceScope trace_("quantize", detail::type_name<T>(), M, N, 0, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, S_>(elementwise_cost(M * N, sizeof(T), sizeof(int8_t), 3))));
+        const T *arr = val.read();
+        int8_t *q = data_.write();
+        const size_t size = M * N / kGroups; // elements of a group
+        for (size_t g = 0; g < kGroups; ++g) {
+            float min = 0;
+            float max = 0;
+            for (size_t i = g * size; i < (g + 1) * size; ++i) {
+                min = std::min(min, static_cast<float>(arr[i]));
+                max = std::max(max, static_cast<float>(arr[i]));
+            }
+            const float scale = (max > min) ? (max - min) / 255 : 1.0f;
+            const int32_t zero_point = static_cast<int32_t>(std::max(-128.0f, std::min(127.0f, std::nearbyint(-128 - min / scale))));
+            const float inv = 1 / scale;
+            for (size_t i = g * size; i < (g + 1) * size; ++i) {
+                const float x = std::nearbyint(static_cast<float>(arr[i]) * inv) + zero_point;
+                q[i] = static_cast<int8_t>(std::max(-128.0f, std::min(127.0f, x)));
+            }
+            scales_.write()[g] = scale;
+            zero_points_.write()[g] = zero_point;
         }
-        std::cout << std::endl;
     }
 
-    template<typename T_, MatrixDataStorage S_>
-    Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
-        T *arr = write();
-        const T_* const other_arr = other.read();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] += static_cast<T>(other_arr[i]);
+    // Restores real matrix
+    template<typename T = float>
+    Matrix<T, M, N, S> dequantize() const {
+        MATRIX_TRACE_(detail::TraceScope trace_("dequantize", detail::type_name<T>(), M, N, 0, S));
+        MATRIX_STATS_((detail::count_cost<T, M, N, S>(elementwise_cost(M * N, sizeof(int8_t), sizeof(T), 2))));
+        Matrix<T, M, N, S> ret;
+        T *arr = ret.write();
+        const int8_t *q = data_.read();
+        const size_t size = M * N / kGroups;
+        for (size_t g = 0; g < kGroups; ++g) {
+            const float scale = scales_.read()[g];
+            const int32_t zero_point = zero_points_.read()[g];
+            for (size_t i = g * size; i < (g + 1) * size; ++i) {
+                arr[i] = static_cast<T>(scale * static_cast<float>(q[i] - zero_point));
+            }
         }
-        return *this;
+        return ret;
     }
-    template<typename T_, MatrixDataStorage S_>
-    Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
-        T *arr = write();
-        const T_* const other_arr = other.read();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] -= static_cast<T>(other_arr[i]);
+
+    const Matrix<int8_t, M, N, S>& data() const { return data_; }
+    // Parameters of row "i" (of the matrix for per tensor quantization)
+    float scale(const size_t i = 0) const { return scales_.read()[(Q == MatrixQuantization::PER_ROW) ? i : 0]; }
+    int32_t zero_point(const size_t i = 0) const { return zero_points_.read()[(Q == MatrixQuantization::PER_ROW) ? i : 0]; }
+};
+
+// Quantizes matrix(m,n) with the given parameters
+template<MatrixQuantization Q = MatrixQuantization::PER_TENSOR, typename T, size_t M, size_t N, MatrixDataStorage S>
+QuantizedMatrix<M, N, Q, result_matrix_data_storage(S)> quantize(const Matrix<T, M, N, S> &val) {
+    return QuantizedMatrix<M, N, Q, result_matrix_data_storage(S)>(val);
+}
+
+// Multiplies quantized matrix(m,n) by quantized matrix(n,p), the result is real.
+// Products of 8-bit integers are accumulated in 32-bit integers, then zero
+// points are accounted with sums of rows and columns and the result is scaled:
+//   r_ij = sa_i * sb * (sum(a_ik * b_kj) - zb * sum(a_ik) - za_i * sum(b_kj) + n * za_i * zb)
+// The right matrix must have per tensor parameters, because they are common
+// for all terms of a dot product.
+template<size_t M, size_t N, size_t P, MatrixQuantization Q, MatrixDataStorage S, MatrixDataStorage S_>
+Matrix<float, M, P, result_matrix_data_storage(S, S_)> mul(const QuantizedMatrix<M, N, Q, S> &lhs, const QuantizedMatrix<N, P, MatrixQuantization::PER_TENSOR, S_> &rhs) {
+    MATRIX_TRACE_(detail::TraceScope trace_("mul", detail::type_name<int32_t>(), M, N, P, S, S_));
+    MATRIX_STATS_((detail::count_cost<int8_t, M, N, S>(mul_cost<int8_t, int8_t, M, N, P>())));
+    const int8_t *a = lhs.data().read();
+    const int8_t *b = rhs.data().read();
+    auto acc = Matrix<int32_t, M, P, MatrixDataStorage::HEAP>::uninitialized();
+    std::vector<int32_t> row_sums(M);
+    std::vector<int32_t> column_sums(P);
+    detail::gemm_i8(M, N, P, a, b, acc.write(), row_sums.data(), column_sums.data());
+    const int32_t zb = rhs.zero_point();
+    const float sb = rhs.scale();
+    Matrix<float, M, P, result_matrix_data_storage(S, S_)> ret;
+    float *arr = ret.write();
+    const int32_t *accs = acc.read();
+    for (size_t i = 0; i < M; ++i) {
+        const int32_t za = lhs.zero_point(i);
+        const float scale = lhs.scale(i) * sb;
+        const int32_t offset = static_cast<int32_t>(N) * za * zb - zb * row_sums[i];
+        for (size_t j = 0; j < P; ++j) {
+            arr[i * P + j] = scale * static_cast<float>(accs[i * P + j] - za * column_sums[j] + offset);
         }
-        return *this;
     }
-    template<typename T_>
-    Matrix& operator*=(const T_ &other) {
-        T *arr = write();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] *= static_cast<T>(other);
+    return ret;
+}
+
+
+
+// Factorizations
+namespace detail {
+
+// Factors symmetric positive definite matrix(n,n) "a" in place as L * L^T,
+// where L is lower triangular. Only the lower triangle of "a" is read, the
+// upper one is zeroed. The matrix is processed by column blocks: the diagonal
+// block is factored, then the panel below it is solved against the diagonal
+// block and the trailing lower triangle is updated by the panel. The panel and
+// the update are split between threads by rows. Returns false if the matrix
+// isn't positive definite.
+template<typename T>
+bool cholesky_factor(T *a, const size_t n) {
+    const size_t block = MATRIX_BLOCK_SIZE_;
+    for (size_t k0 = 0; k0 < n; k0 += block) {
+        const size_t k1 = std::min(n, k0 + block);
+        const size_t width = k1 - k0;
+        for (size_t j = k0; j < k1; ++j) { // diagonal block
+            T *aj = a + j * n;
+            T d = aj[j] - dot(aj + k0, aj + k0, j - k0);
+            if (!(d > T(0))) { // catches NaN also
+                return false;
+            }
+            d = std::sqrt(d);
+            aj[j] = d;
+            for (size_t i = j + 1; i < k1; ++i) {
+                T *ai = a + i * n;
+                ai[j] = (ai[j] - dot(ai + k0, aj + k0, j - k0)) / d;
+            }
         }
-        return *this;
+        parallel_for(k1, n, (n - k1) * width * width, [a, n, k0, k1](size_t first, size_t last) { // panel
+            for (size_t i = first; i < last; ++i) {
+                T *ai = a + i * n;
+                for (size_t j = k0; j < k1; ++j) {
+                    const T *aj = a + j * n;
+                    ai[j] = (ai[j] - dot(ai + k0, aj + k0, j - k0)) / aj[j];
+                }
+            }
+        });
+        parallel_for(k1, n, (n - k1) * (n - k1) * width, [a, n, k0, k1](size_t first, size_t last) { // trailing update
+            for (size_t i = first; i < last; ++i) {
+                T *ai = a + i * n;
+                for (size_t j = k1; j <= i; ++j) {
+                    ai[j] -= dot(ai + k0, a + j * n + k0, k1 - k0);
+                }
+            }
+        });
     }
-    template<typename T_>
-    Matrix& operator/=(const T_ &other) {
-        T *arr = write();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] /= static_cast<T>(other);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = i + 1; j < n; ++j) {
+            a[i * n + j] = T(0);
         }
-        return *this;
     }
-};
-
-// Matrix in user-defined memory. Template parameter should be set explicitly.
-template<typename T, size_t M, size_t N>
-class Matrix<T, M, N, MatrixDataStorage::USER> {
-  private:
-    MatrixData<T, M, N, MatrixDataStorage::USER> md_;
+    return true;
+}
 
-  public:
-    // First constructor parameter is user memory for matrix data placement. The
-    // amount of memory should be big enough to carry M * N * sizeof(T) bytes.
-    // Memory is explicitly managed by user himself.
-    explicit Matrix(T *mem) : md_(mem) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER constructor" << std::endl);
+// Solves L * L^T * X = B in place of matrix(n,p) "b" for columns [first, last)
+template<typename T>
+void cholesky_solve(const T *l, T *b, const size_t n, const size_t p, const size_t first, const size_t last) {
+    const size_t width = last - first;
+    if (p == 1) { // vector right-hand side allows to use contiguous rows of L only
+        for (size_t i = 0; i < n; ++i) { // L * Y = B
+            b[i] = (b[i] - dot(l + i * n, b, i)) / l[i * n + i];
+        }
+        for (size_t i = n; i-- > 0; ) { // L^T * X = Y
+            b[i] /= l[i * n + i];
+            axpy(b, l + i * n, -b[i], i);
+        }
+        return;
     }
-    template<typename T_>
-    Matrix(T *mem, T_ &&val) : md_(mem, std::forward<T_>(val)) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER constructor (val)" << std::endl);
+    for (size_t i = 0; i < n; ++i) { // L * Y = B
+        T *bi = b + i * p + first;
+        for (size_t k = 0; k < i; ++k) {
+            axpy(bi, b + k * p + first, -l[i * n + k], width);
+        }
+        const T d = T(1) / l[i * n + i];
+        for (size_t j = 0; j < width; ++j) {
+            bi[j] *= d;
+        }
     }
-    template<typename T_>
-    Matrix(T *mem, T_ *arr) : md_(mem, arr) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  USER constructor (arr)" << std::endl);
+    for (size_t i = n; i-- > 0; ) { // L^T * X = Y, row "i" of L is column "i" of L^T
+        T *bi = b + i * p + first;
+        const T d = T(1) / l[i * n + i];
+        for (size_t j = 0; j < width; ++j) {
+            bi[j] *= d;
+        }
+        for (size_t k = 0; k < i; ++k) {
+            axpy(b + k * p + first, bi, -l[i * n + k], width);
+        }
     }
-    template<typename T_>
-    Matrix(std::initializer_list<T_> init) = delete; // memory isn't specified
+}
 
-    ~Matrix() = default;
-    // Creating a copy of metrix with user-defined memory is prohibited due to
-    // a lack of pointer to memory location for the new matrix. Other copy-like
-    // constructors from another storage type or another data type are prohibited
-    // for the same reason.
-    Matrix(const Matrix &other) = delete;
-    Matrix(Matrix &&other) = default;
-    Matrix& operator=(const Matrix &other) = default;
-    Matrix& operator=(Matrix &&other) = default;
 
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) = delete;
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) = delete;
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) = delete;
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) = delete;
+// Householder reflectors of column block [k0, k1) of matrix(m,n) "a" factored
+// by "qr_factor()" in compact WY form: H(k0) * ... * H(k1 - 1) = I - V * T * V^T.
+// Reflectors occupy rows [k0, m), so V is matrix(m - k0, k1 - k0) with unit
+// diagonal. V, V^T and upper triangular T are stored contiguously.
+template<typename T>
+struct BlockReflector {
+    size_t rows = 0;
+    size_t width = 0;
+    std::vector<T> v;  // V
+    std::vector<T> vt; // V^T
+    std::vector<T> t;  // T
 
-    const T* const read() const { return md_.read(); }
-    T* write() { return md_.write(); }
-    void print() {
-        const T* const arr = read();
-        for (size_t i = 0; i < M * N; ) {
-            std::cout << arr[i];
-            std::cout << (!(++i % N) ? '\n' : ' ');
+    void assign(const T *a, const T *tau, const size_t m, const size_t n, const size_t k0, const size_t k1) {
+        rows = m - k0;
+        width = k1 - k0;
+        v.assign(rows * width, T(0));
+        vt.assign(width * rows, T(0));
+        t.assign(width * width, T(0));
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; (j < width) && (j <= i); ++j) {
+                const T val = (i == j) ? T(1) : a[(k0 + i) * n + k0 + j];
+                v[i * width + j] = val;
+                vt[j * rows + i] = val;
+            }
+        }
+        for (size_t j = 0; j < width; ++j) { // T(0:j, j) = -tau(j) * T(0:j, 0:j) * V(:, 0:j)^T * v(j)
+            const T *vj = vt.data() + j * rows;
+            for (size_t i = 0; i < j; ++i) {
+                t[i * width + j] = dot(vt.data() + i * rows, vj, rows);
+            }
+            for (size_t i = 0; i < j; ++i) {
+                T sum = 0;
+                for (size_t k = i; k < j; ++k) {
+                    sum += t[i * width + k] * t[k * width + j];
+                }
+                t[i * width + j] = -tau[k0 + j] * sum;
+            }
+            t[j * width + j] = tau[k0 + j];
         }
-        std::cout << std::endl;
     }
 
-    template<typename T_, MatrixDataStorage S_>
-    Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
-        T *arr = write();
-        const T_* const other_arr = other.read();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] += static_cast<T>(other_arr[i]);
+    // Applies (I - V * T * V^T) or its transpose to matrix(rows, p) "c" with
+    // rows "ldc" elements apart. Both products with V are done by "gemm()".
+    void apply(T *c, const size_t p, const size_t ldc, const bool transpose, std::vector<T> &w) const {
+        w.resize(width * p);
+        gemm(width, rows, p, vt.data(), rows, c, ldc, w.data(), p, false); // W = V^T * C
+        if (transpose) { // W = -T^T * W
+            for (size_t i = width; i-- > 0; ) {
+                T *wi = w.data() + i * p;
+                const T d = -t[i * width + i];
+                for (size_t j = 0; j < p; ++j) {
+                    wi[j] *= d;
+                }
+                for (size_t k = 0; k < i; ++k) {
+                    axpy(wi, w.data() + k * p, -t[k * width + i], p);
+                }
+            }
+        } else { // W = -T * W
+            for (size_t i = 0; i < width; ++i) {
+                T *wi = w.data() + i * p;
+                const T d = -t[i * width + i];
+                for (size_t j = 0; j < p; ++j) {
+                    wi[j] *= d;
+                }
+                for (size_t k = i + 1; k < width; ++k) {
+                    axpy(wi, w.data() + k * p, -t[i * width + k], p);
+                }
+            }
         }
-        return *this;
+        gemm(rows, width, p, v.data(), width, w.data(), p, c, ldc, true); // C += V * W
     }
-    template<typename T_, MatrixDataStorage S_>
-    Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
-        T *arr = write();
-        const T_* const other_arr = other.read();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] -= static_cast<T>(other_arr[i]);
+};
+
+// Factors matrix(m,n) "a", m >= n, in place as Q * R. R is written in the upper
+// triangle and Householder vectors H(j) = I - tau(j) * v(j) * v(j)^T below the
+// diagonal (v(j) has implicit unit element on the diagonal). Column blocks are
+// factored by reflectors one by one, the rest columns are updated by the block
+// reflector of a whole block.
+template<typename T>
+void qr_factor(T *a, T *tau, const size_t m, const size_t n) {
+    const size_t block = MATRIX_BLOCK_SIZE_;
+    std::vector<T> w(block);
+    BlockReflector<T> reflector;
+    for (size_t k0 = 0; k0 < n; k0 += block) {
+        const size_t k1 = std::min(n, k0 + block);
+        for (size_t j = k0; j < k1; ++j) {
+            const T alpha = a[j * n + j];
+            T sigma = 0;
+            for (size_t i = j + 1; i < m; ++i) {
+                sigma += a[i * n + j] * a[i * n + j];
+            }
+            if (sigma == T(0)) { // column is already reduced
+                tau[j] = 0;
+                continue;
+            }
+            const T norm = std::sqrt(alpha * alpha + sigma);
+            const T beta = (alpha > T(0)) ? -norm : norm;
+            tau[j] = (beta - alpha) / beta;
+            const T scale = T(1) / (alpha - beta);
+            for (size_t i = j + 1; i < m; ++i) {
+                a[i * n + j] *= scale;
+            }
+            a[j * n + j] = beta;
+            // Apply H(j) to the rest columns of the block: w = v^T * A, A -= tau * v * w
+            const size_t width = k1 - j - 1;
+            std::copy(a + j * n + j + 1, a + j * n + k1, w.begin());
+            for (size_t i = j + 1; i < m; ++i) {
+                axpy(w.data(), a + i * n + j + 1, a[i * n + j], width);
+            }
+            axpy(a + j * n + j + 1, w.data(), -tau[j], width);
+            for (size_t i = j + 1; i < m; ++i) {
+                axpy(a + i * n + j + 1, w.data(), -tau[j] * a[i * n + j], width);
+            }
+        }
+        if (k1 < n) {
+            reflector.assign(a, tau, m, n, k0, k1);
+            reflector.apply(a + k0 * n + k1, n - k1, n, true, w);
+        }
+    }
+}
+
+
+// Factors matrix(n,n) "a" in place as P * A = L * U with partial pivoting. L
+// with implicit unit diagonal is written below the diagonal, U in the upper
+// triangle. Row "j" was swapped with row "pivots[j]" at step "j". Column blocks
+// are factored with row swaps, then the block row of U is solved and the
+// trailing matrix is updated by "gemm()". Returns false if the matrix is singular.
+template<typename T>
+bool lu_factor(T *a, size_t *pivots, const size_t n) {
+    const size_t block = MATRIX_BLOCK_SIZE_;
+    bool nonsingular = true;
+    std::vector<T> l;
+    for (size_t k0 = 0; k0 < n; k0 += block) {
+        const size_t k1 = std::min(n, k0 + block);
+        const size_t width = k1 - k0;
+        for (size_t j = k0; j < k1; ++j) { // panel
+            size_t pivot = j;
+            for (size_t i = j + 1; i < n; ++i) {
+                if (std::abs(a[i * n + j]) > std::abs(a[pivot * n + j])) {
+                    pivot = i;
+                }
+            }
+            pivots[j] = pivot;
+            if (pivot != j) {
+                std::swap_ranges(a + j * n, a + j * n + n, a + pivot * n);
+            }
+            const T d = a[j * n + j];
+            if (d == T(0)) { // column is zero, nothing to eliminate
+                nonsingular = false;
+                continue;
+            }
+            const T *aj = a + j * n;
+            for (size_t i = j + 1; i < n; ++i) {
+                T *ai = a + i * n;
+                ai[j] /= d;
+                axpy(ai + j + 1, aj + j + 1, -ai[j], k1 - j - 1);
+            }
+        }
+        if (k1 == n) {
+            break;
+        }
+        for (size_t i = k0; i < k1; ++i) { // U12 = L11^-1 * A12
+            for (size_t k = k0; k < i; ++k) {
+                axpy(a + i * n + k1, a + k * n + k1, -a[i * n + k], n - k1);
+            }
+        }
+        l.resize((n - k1) * width); // A22 -= L21 * U12
+        for (size_t i = k1; i < n; ++i) {
+            for (size_t j = 0; j < width; ++j) {
+                l[(i - k1) * width + j] = -a[i * n + k0 + j];
+            }
+        }
+        gemm(n - k1, width, n - k1, l.data(), width, a + k0 * n + k1, n, a + k1 * n + k1, n, true);
+    }
+    return nonsingular;
+}
+
+// Solves L * Y = B in place of matrix(n,p) "b" with unit lower triangular L of
+// matrix(n,n) "a" factored by "lu_factor()". Rows are solved by blocks: the rows
+// already solved are accounted by "gemm()", then the block is substituted. If
+// B is the identity matrix, Y is lower triangular and only its lower part is computed.
+template<typename T>
+void lu_solve_lower(const T *a, T *b, const size_t n, const size_t p, const bool identity) {
+    const size_t block = MATRIX_BLOCK_SIZE_;
+    std::vector<T> w(block * p);
+    for (size_t i0 = 0; i0 < n; i0 += block) {
+        const size_t i1 = std::min(n, i0 + block);
+        const size_t width = identity ? i1 : p; // nonzero columns of the block
+        if (i0 > 0) {
+            gemm(i1 - i0, i0, width, a + i0 * n, n, b, p, w.data(), width, false);
+            for (size_t i = i0; i < i1; ++i) {
+                axpy(b + i * p, w.data() + (i - i0) * width, T(-1), width);
+            }
+        }
+        for (size_t i = i0; i < i1; ++i) {
+            for (size_t k = i0; k < i; ++k) {
+                axpy(b + i * p, b + k * p, -a[i * n + k], width);
+            }
         }
-        return *this;
     }
-    template<typename T_>
-    Matrix& operator*=(const T_ &other) {
-        T *arr = write();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] *= static_cast<T>(other);
+}
+
+// Solves U * X = Y in place of matrix(n,p) "b" with upper triangular U of
+// matrix(n,n) "a" factored by "lu_factor()" by blocks of rows from the last one
+template<typename T>
+void lu_solve_upper(const T *a, T *b, const size_t n, const size_t p) {
+    const size_t block = MATRIX_BLOCK_SIZE_;
+    std::vector<T> w(block * p);
+    for (size_t i1 = n; i1 > 0; ) {
+        const size_t i0 = (i1 > block) ? i1 - block : 0;
+        if (i1 < n) {
+            gemm(i1 - i0, n - i1, p, a + i0 * n + i1, n, b + i1 * p, p, w.data(), p, false);
+            axpy(b + i0 * p, w.data(), T(-1), (i1 - i0) * p);
         }
-        return *this;
+        for (size_t i = i1; i-- > i0; ) {
+            T *bi = b + i * p;
+            for (size_t k = i + 1; k < i1; ++k) {
+                axpy(bi, b + k * p, -a[i * n + k], p);
+            }
+            const T d = T(1) / a[i * n + i];
+            for (size_t j = 0; j < p; ++j) {
+                bi[j] *= d;
+            }
+        }
+        i1 = i0;
     }
-    template<typename T_>
-    Matrix& operator/=(const T_ &other) {
-        T *arr = write();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] /= static_cast<T>(other);
+}
+
+// Solves A * X = B in place of matrix(n,p) "b" with matrix(n,n) "a" factored by
+// "lu_factor()"
+template<typename T>
+void lu_solve(const T *a, const size_t *pivots, T *b, const size_t n, const size_t p) {
+    for (size_t j = 0; j < n; ++j) { // P * B
+        if (pivots[j] != j) {
+            std::swap_ranges(b + j * p, b + j * p + p, b + pivots[j] * p);
         }
-        return *this;
     }
-};
+    lu_solve_lower(a, b, n, p, false);
+    lu_solve_upper(a, b, n, p);
+}
+
+// Computes inverse of matrix(n,n) factored by "lu_factor()" in place of the
+// identity matrix(n,n) "b" as U^-1 * L^-1 * P. Permutation is applied to
+// columns of the result, so L^-1 stays lower triangular.
+template<typename T>
+void lu_inverse(const T *a, const size_t *pivots, T *b, const size_t n) {
+    lu_solve_lower(a, b, n, n, true);
+    lu_solve_upper(a, b, n, n);
+    for (size_t j = n; j-- > 0; ) { // X * P
+        if (pivots[j] != j) {
+            for (size_t i = 0; i < n; ++i) {
+                std::swap(b[i * n + j], b[i * n + pivots[j]]);
+            }
+        }
+    }
+}
+
+} // namespace detail
+
+// Cholesky factorization A = L * L^T of symmetric positive definite matrix(n,n).
+// Only the lower triangle of A is used. The factor is computed once and reused
+// for solving linear systems and computing determinant. Elements of the factor
+// have floating point type T, storage S is used for the factor.
+template<typename T, size_t N, MatrixDataStorage S = MatrixDataStorage::UNSPECIFIED>
+class Cholesky {
+    static_assert(std::is_floating_point<T>::value, "Cholesky factor must have floating point elements");
+    static_assert(S != MatrixDataStorage::USER, "Cholesky factor can't be placed in user memory");
 
-// Matrix memory will be chosen based on metrix size. This type of matrix will
-// be created by default, but it also could be created explicitly.
-template<typename T, size_t M, size_t N>
-class Matrix<T, M, N, MatrixDataStorage::UNSPECIFIED> {
   private:
-    MatrixData<T, M, N, choose_matrix_data_storage(sizeof(T) * M * N)> md_;
+    Matrix<T, N, N, S> l_; // lower triangular factor
+    bool positive_definite_;
 
   public:
-    Matrix() : md_() {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  UNSPECIFIED constructor" << std::endl);
-    }
-    template<typename T_>
-    explicit Matrix(T_ &&val) : md_(std::forward<T_>(val)) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  UNSPECIFIED constructor (val)" << std::endl);
-    }
-    template<typename T_>
-    explicit Matrix(T_ *arr) : md_(arr) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  UNSPECIFIED constructor (arr)" << std::endl);
-    }
-    template<typename T_>
-    Matrix(std::initializer_list<T_> init) : md_(init) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  UNSPECIFIED constructor (init)" << std::endl);
+    template<typename T_, MatrixDataStorage S_>
+    explicit Cholesky(const Matrix<T_, N, N, S_> &val) : l_(val) {
+        MATRIX_TRACE_(detail::TraceScope trace_("cholesky", detail::type_name<T>(), N, N, 0, S_));
+        MATRIX_STATS_((detail::count_cost<T, N, N, S>(cholesky_cost<T, N>())));
+        positive_definite_ = detail::cholesky_factor(l_.write(), N);
     }
 
-    ~Matrix() = default;
-    Matrix(const Matrix &other) = default;
-    Matrix(Matrix &&other) = default;
-    Matrix& operator=(const Matrix &other) = default;
-    Matrix& operator=(Matrix &&other) = default;
+    // Whether the matrix is positive definite. Otherwise the factorization
+    // wasn't completed and other methods make no sense.
+    bool positive_definite() const { return positive_definite_; }
+    // Lower triangular factor L
+    const Matrix<T, N, N, S>& factor() const { return l_; }
 
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::UNSPECIFIED> &other) : md_(other.read()) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  UNSPECIFIED type converter" << std::endl);
-    }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::STACK> &other) : md_(other.read()) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  UNSPECIFIED <- STACK" << std::endl);
+    // Solves A * X = B for matrix(n,p) B (p right-hand sides)
+    template<typename T_, size_t P, MatrixDataStorage S_>
+    Matrix<T, N, P, result_matrix_data_storage(S_)> solve(const Matrix<T_, N, P, S_> &rhs) const {
+        MATRIX_TRACE_(detail::TraceScope trace_("cholesky_solve", detail::type_name<T>(), N, N, P, S, S_));
+        MATRIX_STATS_((detail::count_cost<T, N, P, result_matrix_data_storage(S_)>(triangular_solve_cost<T, T, N, P>())));
+        Matrix<T, N, P, result_matrix_data_storage(S_)> ret(rhs);
+        T *arr = ret.write();
+        const T *l = l_.read();
+        detail::parallel_for(0, P, 2 * N * N * P, [l, arr](size_t first, size_t last) {
+            detail::cholesky_solve(l, arr, N, P, first, last);
+        });
+        return ret;
     }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::HEAP> &other) : md_(other.read()) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  UNSPECIFIED <- HEAP" << std::endl);
+
+    // Natural logarithm of determinant of A, which doesn't overflow for large
+    // matrices unlike determinant itself
+    T log_det() const {
+        const T *l = l_.read();
+        T sum = 0;
+        for (size_t i = 0; i < N; ++i) {
+            sum += std::log(l[i * N + i]);
+        }
+        return 2 * sum;
     }
-    template<typename T_>
-    Matrix(const Matrix<T_, M, N, MatrixDataStorage::USER> &other) : md_(other.read()) {
-        MATRIX_DEBUG_(std::cout << FUNC_NAME_ << std::endl);
-        MATRIX_DEBUG_(std::cout << "  UNSPECIFIED <- USER" << std::endl);
+    // Determinant of A as the squared product of diagonal elements of L
+    T det() const {
+        const T *l = l_.read();
+        T prod = 1;
+        for (size_t i = 0; i < N; ++i) {
+            prod *= l[i * N + i];
+        }
+        return prod * prod;
     }
+};
 
-    const T* const read() const { return md_.read(); }
-    T* write() { return md_.write(); }
-    void print() {
-        const T* const arr = read();
-        for (size_t i = 0; i < M * N; ) {
-            std::cout << arr[i];
-            std::cout << (!(++i % N) ? '\n' : ' ');
+// Computes Cholesky factorization of symmetric positive definite matrix(n,n).
+// Integer matrices are factored in double precision.
+template<typename T, size_t N, MatrixDataStorage S>
+Cholesky<detail::floating_t<T>, N, result_matrix_data_storage(S)> cholesky(const Matrix<T, N, N, S> &val) {
+    return Cholesky<detail::floating_t<T>, N, result_matrix_data_storage(S)>(val);
+}
+
+// Householder QR factorization A = Q * R of matrix(m,n), m >= n, where Q is
+// orthogonal and R is upper triangular. The factorization is computed once and
+// reused for least-squares solutions. Elements of the factorization have
+// floating point type T, storage S is used for the factorization.
+template<typename T, size_t M, size_t N, MatrixDataStorage S = MatrixDataStorage::UNSPECIFIED>
+class QR {
+    static_assert(std::is_floating_point<T>::value, "QR factorization must have floating point elements");
+    static_assert(S != MatrixDataStorage::USER, "QR factorization can't be placed in user memory");
+    static_assert(M >= N, "QR factorization requires at least as many rows as columns");
+
+  private:
+    Matrix<T, M, N, S> qr_;  // R and Householder vectors
+    Matrix<T, 1, N, S> tau_; // factors of Householder reflectors
+
+    // Applies Q or Q^T to matrix(m,p) "arr" block by block
+    void apply_q(T *arr, const size_t p, const bool transpose) const {
+        const size_t block = MATRIX_BLOCK_SIZE_;
+        const size_t blocks = (N + block - 1) / block;
+        detail::BlockReflector<T> reflector;
+        std::vector<T> w;
+        for (size_t b = 0; b < blocks; ++b) { // Q^T = H(n-1) * ... * H(0), Q is reversed
+            const size_t k0 = (transpose ? b : blocks - 1 - b) * block;
+            reflector.assign(qr_.read(), tau_.read(), M, N, k0, std::min(N, k0 + block));
+            reflector.apply(arr + k0 * p, p, p, transpose, w);
         }
-        std::cout << std::endl;
     }
 
+  public:
     template<typename T_, MatrixDataStorage S_>
-    Matrix& operator+=(const Matrix<T_, M, N, S_> &other) {
-        T *arr = write();
-        const T_* const other_arr = other.read();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] += static_cast<T>(other_arr[i]);
+    explicit QR(const Matrix<T_, M, N, S_> &val) : qr_(val) {
+        MATRIX_TRACE_(detail::TraceScope trace_("qr", detail::type_name<T>(), M, N, 0, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, N, S>(qr_cost<T, M, N>())));
+        detail::qr_factor(qr_.write(), tau_.write(), M, N);
+    }
+
+    // Whether R has no zero diagonal elements, that is A has full column rank
+    bool full_rank() const {
+        const T *arr = qr_.read();
+        for (size_t i = 0; i < N; ++i) {
+            if (arr[i * N + i] == T(0)) {
+                return false;
+            }
         }
-        return *this;
+        return true;
     }
-    template<typename T_, MatrixDataStorage S_>
-    Matrix& operator-=(const Matrix<T_, M, N, S_> &other) {
-        T *arr = write();
-        const T_* const other_arr = other.read();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] -= static_cast<T>(other_arr[i]);
+    // Upper triangular factor R(n,n)
+    Matrix<T, N, N, S> r() const {
+        Matrix<T, N, N, S> ret(T(0));
+        T *arr = ret.write();
+        const T *qr = qr_.read();
+        for (size_t i = 0; i < N; ++i) {
+            for (size_t j = i; j < N; ++j) {
+                arr[i * N + j] = qr[i * N + j];
+            }
         }
-        return *this;
+        return ret;
     }
-    template<typename T_>
-    Matrix& operator*=(const T_ &other) {
-        T *arr = write();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] *= static_cast<T>(other);
+    // Orthogonal factor Q(m,n) with orthonormal columns
+    Matrix<T, M, N, S> q() const {
+        Matrix<T, M, N, S> ret(T(0));
+        T *arr = ret.write();
+        for (size_t i = 0; i < N; ++i) {
+            arr[i * N + i] = T(1);
         }
-        return *this;
+        apply_q(arr, N, false);
+        return ret;
     }
-    template<typename T_>
-    Matrix& operator/=(const T_ &other) {
-        T *arr = write();
-        for (size_t i = 0; i < M * N; ++i) {
-            arr[i] /= static_cast<T>(other);
+
+    // Solves A * X = B for matrix(m,p) B in the least-squares sense: X(n,p)
+    // minimizes the 2-norm of every column of A * X - B. A must have full rank.
+    template<typename T_, size_t P, MatrixDataStorage S_>
+    Matrix<T, N, P, result_matrix_data_storage(S_)> solve(const Matrix<T_, M, P, S_> &rhs) const {
+        MATRIX_TRACE_(detail::TraceScope trace_("qr_solve", detail::type_name<T>(), M, N, P, S, S_));
+        MATRIX_STATS_((detail::count_cost<T, M, P, result_matrix_data_storage(S_)>(
+            { 4 * M * N * P + N * N * P, M * N * sizeof(T) + (M + N) * P * sizeof(T) })));
+        Matrix<T, M, P, MatrixDataStorage::HEAP> qtb(rhs);
+        T *b = qtb.write();
+        apply_q(b, P, true); // Q^T * B
+        const T *r = qr_.read();
+        for (size_t i = N; i-- > 0; ) { // R * X = Q^T * B, first n rows
+            T *bi = b + i * P;
+            for (size_t k = i + 1; k < N; ++k) {
+                detail::axpy(bi, b + k * P, -r[i * N + k], P);
+            }
+            const T d = T(1) / r[i * N + i];
+            for (size_t j = 0; j < P; ++j) {
+                bi[j] *= d;
+            }
         }
-        return *this;
+        return Matrix<T, N, P, result_matrix_data_storage(S_)>(b);
     }
 };
 
-
-
-// Arithmetic operators are implemented without passing matrix by value to avoid
-// copying. As a result elements are created inside function that avoids extra
-// algorithmic complexity. But it forbids to use corresponding assignment operators
-// from class effectivelly.
-// "+matrix"
-template<typename T, size_t M, size_t N, MatrixDataStorage S>
-Matrix<T, M, N, result_matrix_data_storage(S)> operator+(const Matrix<T, M, N, S> &val) {
-    return Matrix<T, M, N, result_matrix_data_storage(S)>(val); // creates a copy
-}
-// "-matrix"
+// Computes Householder QR factorization of matrix(m,n), m >= n. Integer
+// matrices are factored in double precision.
 template<typename T, size_t M, size_t N, MatrixDataStorage S>
-Matrix<T, M, N, result_matrix_data_storage(S)> operator-(const Matrix<T, M, N, S> &val) {
-    Matrix<T, M, N, result_matrix_data_storage(S)> ret;
-    T *arr = ret.write();
-    const T* const val_arr = val.read();
-    for (size_t i = 0; i < M * N; ++i) {
-        arr[i] = -val_arr[i];
-    }
-    return ret;
-}
-// "matrix + matrix"
-template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
-Matrix<std::common_type_t<T, T_>, M, N, result_matrix_data_storage(S, S_)> operator+(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
-    using TT_ = std::common_type_t<T, T_>;
-    Matrix<TT_, M, N, result_matrix_data_storage(S, S_)> ret;
-    TT_ *arr = ret.write();
-    const T* const lhs_arr = lhs.read();
-    const T_* const rhs_arr = rhs.read();
-    for (size_t i = 0; i < M * N; ++i) {
-        arr[i] = static_cast<TT_>(lhs_arr[i] + rhs_arr[i]);
-    }
-    return ret;
+QR<detail::floating_t<T>, M, N, result_matrix_data_storage(S)> qr(const Matrix<T, M, N, S> &val) {
+    return QR<detail::floating_t<T>, M, N, result_matrix_data_storage(S)>(val);
 }
-// "matrix - matrix"
-template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
-Matrix<std::common_type_t<T, T_>, M, N, result_matrix_data_storage(S, S_)> operator-(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
-    using TT_ = std::common_type_t<T, T_>;
-    Matrix<TT_, M, N, result_matrix_data_storage(S, S_)> ret;
-    TT_ *arr = ret.write();
-    const T* const lhs_arr = lhs.read();
-    const T_* const rhs_arr = rhs.read();
-    for (size_t i = 0; i < M * N; ++i) {
-        arr[i] = static_cast<TT_>(lhs_arr[i] - rhs_arr[i]);
+
+// LU factorization P * A = L * U of matrix(n,n) with partial pivoting, where P
+// is permutation, L is lower triangular with unit diagonal and U is upper
+// triangular. The factorization is computed once and reused for solving linear
+// systems, inversion and computing determinant. Elements of the factorization
+// have floating point type T, storage S is used for the factorization.
+template<typename T, size_t N, MatrixDataStorage S = MatrixDataStorage::UNSPECIFIED>
+class LU {
+    static_assert(std::is_floating_point<T>::value, "LU factorization must have floating point elements");
+    static_assert(S != MatrixDataStorage::USER, "LU factorization can't be placed in user memory");
+
+  private:
+    Matrix<T, N, N, S> lu_;           // L and U
+    Matrix<size_t, 1, N, S> pivots_; // row swaps
+    bool singular_;
+
+  public:
+    template<typename T_, MatrixDataStorage S_>
+    explicit LU(const Matrix<T_, N, N, S_> &val) : lu_(val) {
+        MATRIX_TRACE_(detail::TraceScope trace_("lu", detail::type_name<T>(), N, N, 0, S_));
+        MATRIX_STATS_((detail::count_cost<T, N, N, S>(lu_cost<T, N>())));
+        singular_ = !detail::lu_factor(lu_.write(), pivots_.write(), N);
     }
-    return ret;
-}
-// "matrix * scalar"
-template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S>
-Matrix<T, M, N, result_matrix_data_storage(S)> operator*(const Matrix<T, M, N, S> &lhs, const T_ &rhs) {
-    Matrix<T, M, N, result_matrix_data_storage(S)> ret;
-    T *arr = ret.write();
-    const T* const lhs_arr = lhs.read();
-    for (size_t i = 0; i < M * N; ++i) {
-        arr[i] = lhs_arr[i] * static_cast<T>(rhs);
+
+    // Whether the matrix is singular. Solutions and inverse of singular matrix
+    // have infinite or NaN elements.
+    bool singular() const { return singular_; }
+    // Factors L and U in one matrix, unit diagonal of L isn't stored
+    const Matrix<T, N, N, S>& factors() const { return lu_; }
+    // Row "i" was swapped with row "pivots()[i]" at step "i"
+    const size_t* pivots() const { return pivots_.read(); }
+
+    // Solves A * X = B for matrix(n,p) B (p right-hand sides)
+    template<typename T_, size_t P, MatrixDataStorage S_>
+    Matrix<T, N, P, result_matrix_data_storage(S_)> solve(const Matrix<T_, N, P, S_> &rhs) const {
+        MATRIX_TRACE_(detail::TraceScope trace_("lu_solve", detail::type_name<T>(), N, N, P, S, S_));
+        MATRIX_STATS_((detail::count_cost<T, N, P, result_matrix_data_storage(S_)>(triangular_solve_cost<T, T, N, P>())));
+        Matrix<T, N, P, result_matrix_data_storage(S_)> ret(rhs);
+        detail::lu_solve(lu_.read(), pivots_.read(), ret.write(), N, P);
+        return ret;
     }
-    return ret;
-}
-// "scalar * matrix"
-template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S>
-Matrix<T, M, N, result_matrix_data_storage(S)> operator*(const T_ &lhs, const Matrix<T, M, N, S> &rhs) {
-    // Another arguments order of "matrix * scalar"
-    return (rhs * lhs);
-}
-// "matrix / scalar"
-template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S>
-Matrix<T, M, N, result_matrix_data_storage(S)> operator/(const Matrix<T, M, N, S> &lhs, const T_ &rhs) {
-    Matrix<T, M, N, result_matrix_data_storage(S)> ret;
-    T *arr = ret.write();
-    const T* const lhs_arr = lhs.read();
-    for (size_t i = 0; i < M * N; ++i) {
-        arr[i] = lhs_arr[i] / static_cast<T>(rhs);
+    // Computes inverse matrix by solving A * X = I
+    Matrix<T, N, N, S> inverse() const {
+        MATRIX_TRACE_(detail::TraceScope trace_("lu_inverse", detail::type_name<T>(), N, N, N, S));
+        MATRIX_STATS_((detail::count_cost<T, N, N, S>({ 4 * N * N * N / 3, 2 * N * N * sizeof(T) })));
+        Matrix<T, N, N, S> ret(T(0));
+        T *arr = ret.write();
+        for (size_t i = 0; i < N; ++i) {
+            arr[i * N + i] = T(1);
+        }
+        detail::lu_inverse(lu_.read(), pivots_.read(), arr, N);
+        return ret;
     }
-    return ret;
-}
-
-// Comparison operators
-// "matrix == matrix"
-template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
-bool operator==(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
-    const T* const lhs_arr = lhs.read();
-    const T_* const rhs_arr = rhs.read();
-    for (size_t i = 0; i < M * N; ++i) {
-        if (lhs_arr[i] != rhs_arr[i]) { // bad for FP
-            return false;
+    // Determinant of A as the product of diagonal elements of U with the sign
+    // of permutation
+    T det() const {
+        const T *arr = lu_.read();
+        const size_t *pivots = pivots_.read();
+        T prod = 1;
+        for (size_t i = 0; i < N; ++i) {
+            prod *= (pivots[i] != i) ? -arr[i * N + i] : arr[i * N + i];
         }
+        return prod;
     }
-    return true;
-}
-// "matrix != matrix"
-template<typename T, typename T_, size_t M, size_t N, MatrixDataStorage S, MatrixDataStorage S_>
-bool operator!=(const Matrix<T, M, N, S> &lhs, const Matrix<T_, M, N, S_> &rhs) {
-    // Opposite to "matrix == matrix"
-    return !(lhs == rhs);
-}
-
+};
 
+// Computes LU factorization of matrix(n,n) with partial pivoting. Integer
+// matrices are factored in double precision.
+template<typename T, size_t N, MatrixDataStorage S>
+LU<detail::floating_t<T>, N, result_matrix_data_storage(S)> lu(const Matrix<T, N, N, S> &val) {
+    return LU<detail::floating_t<T>, N, result_matrix_data_storage(S)>(val);
+}
 
-// Other matrix functions
-// Multiplies matrix(m,n) by matrix(n,p)
-//     < N >       < P >     < P >
-// ^ (a a a a)   ^ (b b)   ^ (r r)
-// M (a a a a) x N (b b) = M (r r)
-// v (a a a a)   v (b b)   v (r r)
-//                 (b b)
-template<typename T, typename T_, size_t M, size_t N, size_t P, MatrixDataStorage S, MatrixDataStorage S_>
-Matrix<std::common_type_t<T, T_>, M, P, result_matrix_data_storage(S, S_)> mul(const Matrix<T, M, N, S> &lhs, const Matrix<T_, N, P, S_> &rhs) {
-    using TT_ = std::common_type_t<T, T_>;
-    Matrix<TT_, M, P, result_matrix_data_storage(S, S_)> ret;
-    TT_ *arr = ret.write();
-    const T* const lhs_arr = lhs.read();
-    const T_* const rhs_arr = rhs.read();
-    for (size_t i = 0; i < M; ++i) { // rows of result
-        size_t iN = i * N; // use const inside a row values
-        size_t iP = i * P;
-        for (size_t j = 0; j < P; ++j) { // columns of result
-            TT_ val = 0; // use local storage for temp value
-            for (size_t k = 0; k < N; ++k) { // dot product
-                val += static_cast<TT_>(lhs_arr[iN + k] * rhs_arr[k * P + j]);
-            }
-            arr[iP + j] = val;
-        }
-    }
+// Solves linear system A * X = B for matrix(n,n) A and matrix(n,p) B by LU
+// factorization with partial pivoting. Integer matrices are solved in double
+// precision. Solution of singular system has infinite or NaN elements.
+template<typename T, typename T_, size_t N, size_t P, MatrixDataStorage S, MatrixDataStorage S_>
+Matrix<detail::floating_t<std::common_type_t<T, T_>>, N, P, result_matrix_data_storage(S, S_)> solve(const Matrix<T, N, N, S> &lhs, const Matrix<T_, N, P, S_> &rhs) {
+    using TT_ = detail::floating_t<std::common_type_t<T, T_>>;
+    const LU<TT_, N, result_matrix_data_storage(S)> factorization(lhs);
+    MATRIX_TRACE_(detail::TraceScope trace_("solve", detail::type_name<TT_>(), N, N, P, S, S_));
+    MATRIX_STATS_((detail::count_cost<TT_, N, P, result_matrix_data_storage(S, S_)>(triangular_solve_cost<TT_, TT_, N, P>())));
+    Matrix<TT_, N, P, result_matrix_data_storage(S, S_)> ret(rhs);
+    detail::lu_solve(factorization.factors().read(), factorization.pivots(), ret.write(), N, P);
     return ret;
 }
 
-// Computes determinant of matrix(n,n). Gaussian elimination method is used to
-// obtain something close to lower triangular matrix (LTM), thus the complexity
-// is O(n^3). This method should be applied to matrices with floating point
-// elements, overwise integer division will zero the result. Precise method
-// specialization for integers is not implemented due to fast integer overflow.
+// Computes inverse of matrix(n,n) by LU factorization with partial pivoting.
+// Integer matrices are inverted in double precision. Inverse of singular matrix
+// has infinite or NaN elements.
 template<typename T, size_t N, MatrixDataStorage S>
-T det(const Matrix<T, N, N, S> &val) {
-    Matrix<T, N, N, result_matrix_data_storage(S)> ltm(val); // will be transformed to almost-LTM
-    T *arr = ltm.write();
-
-    T factor = 1; // accumulates intermediate multiplyers
-    // Since transposed matrix has the same determinant as original we transform
-    // given matrix to almost-LTM because of C-style array location in memory.
-    for (size_t i = 0; i < N; ++i) { // rows
-        size_t iN = i * N; // use const inside a row values
-        if (arr[iN + i] == 0) { // diagonal elenment is zero, need to swap columns
-            size_t j = i + 1;
-            for ( ; j < N; ++j) { // search for not-zero element further in the same row
-                if (arr[iN + j] != 0) { // non-zero element found, swap columns (actually, lower parts only)
-                    for (size_t k = i; k < N; ++k) {
-                        std::swap(arr[k * N + i], arr[k * N + j]);
-                    }
-                    factor = -factor; // column swap inverts determinant
-                    j = i; // used as flag that matrix is nondegenerate
-                    break;
-                }
-            }
-            if (j != i) { // determinant of degenerate matrix is zero
-                return T(0);
-            }
-        }
-        for (size_t j = i + 1; j < N; ++j) { // further columns
-            if (arr[iN + j] != 0) {
-                T multiplier = arr[iN + i] / arr[iN + j];
-                factor *= multiplier; // column multiplication changes determinant
-                for (size_t k = i + 1; k < N; ++k) { // subtract lower part of column
-                    arr[k * N + j] = arr[k * N + j] * multiplier - arr[k * N + i];
-                }
-            }
-        }
-    }
-    T res = arr[0];
-    for (size_t i = 1; i < N; ++i) { // diagonal elements represent determinant
-        res *= arr[i * N + i];
-    }
-    res /= factor;
-    return res;
+Matrix<detail::floating_t<T>, N, N, result_matrix_data_storage(S)> inverse(const Matrix<T, N, N, S> &val) {
+    return lu(val).inverse();
 }
 
 } // namespace matrix
@@ -904,8 +5250,22 @@ T det(const Matrix<T, N, N, S> &val) {
 
 
 // Cleanup
-#undef MATRIX_DEBUG_
-#undef FUNC_NAME_
+#undef MATRIX_STATS_
+#undef MATRIX_TRACE_
+#undef MATRIX_TRACE_BUFFER_SIZE_
 #undef MATRIX_DATA_STORAGE_STACK_SIZE_MAX_
+#undef MATRIX_BLOCK_SIZE_
+#undef MATRIX_PARALLEL_WORK_MIN_
+#undef MATRIX_STRASSEN_CROSSOVER_
+#undef MATRIX_CONSTEXPR_
+#undef MATRIX_F16C_
+#undef MATRIX_I8_AVX512_VNNI_
+#undef MATRIX_I8_AVX512_
+#undef MATRIX_I8_AVX2_
+#undef MATRIX_I8_SSE2_
+#undef MATRIX_I8_
+#undef MATRIX_STREAM_
+#undef MATRIX_MMAP_
+#undef MATRIX_STREAM_BYTES_MIN_
 
 #endif // #ifndef MATRIX_H